@@ -0,0 +1,146 @@
+/**
+ * Created by 刘嘉辉 on 11/03/18.
+ * Copyright (c) 2018 刘嘉辉 All rights reserved.
+ * @brief To immplmente conn_store.h.
+ */
+
+#ifndef CONN_STORE_H
+#define CONN_STORE_H
+
+#include <vector>
+#include <stddef.h>
+
+/**
+ * 对象池 每次向系统申请CHUNK_SIZE个对象
+ * 归还的对象挂在空闲链表上复用
+ */
+template< typename T >
+class object_pool
+{
+public:
+    static const int CHUNK_SIZE = 64;
+
+public:
+    object_pool() {}
+    ~object_pool()
+    {
+        for ( size_t i = 0; i < m_chunks.size(); ++i )
+        {
+            delete [] m_chunks[i];
+        }
+    }
+
+    T* alloc()
+    {
+        if ( m_free.empty() )
+        {
+            T* chunk = new T[ CHUNK_SIZE ];
+            m_chunks.push_back( chunk );
+            for ( int i = CHUNK_SIZE - 1; i >= 0; --i )
+            {
+                m_free.push_back( chunk + i );
+            }
+        }
+        T* obj = m_free.back();
+        m_free.pop_back();
+        return obj;
+    }
+
+    void free( T* obj )
+    {
+        m_free.push_back( obj );
+    }
+
+private:
+    std::vector< T* > m_chunks;
+    std::vector< T* > m_free;
+};
+
+
+/**
+ * 默认的连接存储 稀疏的 fd -> 连接对象 表加对象池
+ * 子进程是单线程的　所以这里不加锁
+ *
+ * processpool 要求存储类提供:
+ *     Store( int max_fd )
+ *     T* create( int fd )   为新连接取对象
+ *     T* get( int fd )      查找 不存在返回NULL
+ *     void release( int fd ) 连接关闭后归还
+ */
+template< typename T >
+class conn_store
+{
+public:
+    static const int PAGE_SHIFT = 10;
+    static const int PAGE_SIZE = 1 << PAGE_SHIFT;
+
+public:
+    conn_store( int max_fd ) : m_max_fd( max_fd )
+    {
+        m_page_number = ( max_fd + PAGE_SIZE - 1 ) >> PAGE_SHIFT;
+        m_pages = new T**[ m_page_number ];
+        for ( int i = 0; i < m_page_number; ++i )
+        {
+            m_pages[i] = NULL;
+        }
+    }
+
+    ~conn_store()
+    {
+        for ( int i = 0; i < m_page_number; ++i )
+        {
+            delete [] m_pages[i];
+        }
+        delete [] m_pages;
+    }
+
+    T* get( int fd )
+    {
+        if( ( fd < 0 ) || ( fd >= m_max_fd ) || ! m_pages[ fd >> PAGE_SHIFT ] )
+        {
+            return NULL;
+        }
+        return m_pages[ fd >> PAGE_SHIFT ][ fd & ( PAGE_SIZE - 1 ) ];
+    }
+
+    T* create( int fd )
+    {
+        if( ( fd < 0 ) || ( fd >= m_max_fd ) )
+        {
+            return NULL;
+        }
+        T**& page = m_pages[ fd >> PAGE_SHIFT ];
+        if( ! page )
+        {
+            page = new T*[ PAGE_SIZE ];
+            for ( int i = 0; i < PAGE_SIZE; ++i )
+            {
+                page[i] = NULL;
+            }
+        }
+        T*& obj = page[ fd & ( PAGE_SIZE - 1 ) ];
+        if( ! obj )
+        {
+            obj = m_pool.alloc();
+        }
+        return obj;
+    }
+
+    void release( int fd )
+    {
+        T* obj = get( fd );
+        if( obj )
+        {
+            m_pool.free( obj );
+            m_pages[ fd >> PAGE_SHIFT ][ fd & ( PAGE_SIZE - 1 ) ] = NULL;
+        }
+    }
+
+private:
+    int m_max_fd;
+    int m_page_number;
+    T*** m_pages;
+    object_pool< T > m_pool;
+};
+
+#endif
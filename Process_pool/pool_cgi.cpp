@@ -19,6 +19,7 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <iostream>
 
 #include "processpool.h"
@@ -49,27 +50,32 @@ public:
         /*循环读取和分析客户的数据*/
         while(true)
         {
-            idx = m_read_idx;
-            ret = recv(m_sockfd, m_buf + idx, BUFFER_SIZE-1-idx, 0);
+            /**
+             * 只窥视不取走 请求行之后紧跟着请求体 要留在socket里作为cgi程序的标准输入
+             * 每次都从头窥视 所以是m_read_idx = ret 而不是累加
+             */
+            idx = 0;
+            ret = recv(m_sockfd, m_buf, BUFFER_SIZE-1, MSG_PEEK);
 
             if(ret < 0)
             {
                 if( errno != EAGAIN)
                 {
-                    removefd(m_epollfd, m_sockfd);
+                    close_conn();
                 }
+                break;
             }
 
             /*如果对方关闭链接，服务器端也关闭*/
             else if(ret == 0)
             {
-                removefd(m_epollfd, m_sockfd);
+                close_conn();
                 break;
             }
             else
             {
-                m_read_idx += ret;
-                std::cout<<"user content is : "<<m_buf<<std::endl;
+                m_read_idx = ret;
+                m_buf[m_read_idx] = '\0';
 
                 for(;idx < m_read_idx; ++idx)
                 {
@@ -79,60 +85,97 @@ public:
                     }
                 }
 
-                /*如果没有遇到字符 \r\n 就读取更多数据*/
+                /*如果没有遇到字符 \r\n 等下一次可读事件再窥视 缓冲区已满则放弃*/
                 if(idx == m_read_idx)
                 {
-                    continue;
+                    if(m_read_idx >= BUFFER_SIZE-1)
+                    {
+                        close_conn();
+                    }
+                    break;
                 }
-                m_buf[ idx-1 ] = '\0';
-
-                char * file_name = m_buf;
-                /*判断客户需要运行的cgi程序是否存在*/
-                if(access(file_name, F_OK) == -1)
+                /*真正取走请求行 正好到\n为止*/
+                if(recv(m_sockfd, m_buf, idx+1, 0) != idx+1)
                 {
-                    removefd(m_epollfd, m_sockfd);
+                    close_conn();
                     break;
                 }
+                m_buf[ idx-1 ] = '\0';
+                POOL_DEBUG("user content is : %s\n", m_buf);
 
-                /*创建子进程来执行cgi程序*/
-                ret = fork();
-                if(ret == -1)
+                /*请求行是 "程序路径 请求体长度" 旧格式没有长度*/
+                const char * content_length = "0";
+                char * space = strchr(m_buf, ' ');
+                if(space)
                 {
-                    /*父进程关闭连接就可以了*/
-                    removefd(m_epollfd,m_sockfd);
-                    break;
+                    *space = '\0';
+                    content_length = space + 1;
                 }
-                /*父进程*/
-                else if(ret > 0)
+
+                char * file_name = m_buf;
+                /*判断客户需要运行的cgi程序是否存在*/
+                if(access(file_name, F_OK) == -1)
                 {
-                    /*因为父进程并不处理这件事，子进程会共享m_epollfd*/
-                    removefd(m_epollfd,m_sockfd);
+                    close_conn();
                     break;
                 }
-                else
-                {
-                    /*子进程将标准输出定向到m_sockfd,并执行CGI程序*/
-                    close(1);
-                    close(2);
-                    /**
-                     * 不继承原有的文件描述符属性　close-on-exec non-blocking
-                     * 返回一个最小的文件描述符与原来具有相同所指
-                     * 已关闭的STDERR_FILENO是１ 所以　execl 本来要发向1 然后就发到了m_socked那里去
-                     */
-                    dup(m_sockfd);
-                    /**
-                     * execl()用来执行参数path 字符串所代表的文件路径, 
-                     * 接下来的参数代表执行该文件时传递过去的argv(0),argv[1], ..., 
-                     * 最后一个参数必须用空指针(NULL)作结束.
-                     * 示例 execl("/bin/ls", "ls", NULL);
-                     */
-                    execl(m_buf, "ls", NULL);
-                    exit(0);
-                }
+
+                /*创建子进程来执行cgi程序 标准输入输出都接在这条连接上 父进程并不处理这件事 关闭连接就可以了*/
+                spawn(file_name, content_length, m_sockfd, m_sockfd);
+                close_conn();
+                break;
             }
         }
     }
 
+    /**
+     * 创建子进程执行cgi程序 标准输入接in_fd 标准输出接out_fd 返回子进程号
+     * TCP连接上两者是同一个socket 共享内存通道上是两个管道
+     */
+    static pid_t spawn(const char* program, const char* content_length, int in_fd, int out_fd)
+    {
+        pid_t pid = fork();
+        if(pid != 0)
+        {
+            return pid;
+        }
+        /**
+         * 连接是非阻塞accept的 cgi程序不会处理EAGAIN
+         * web服务器对慢客户施加背压时程序应当阻塞在write上 而不是写失败退出
+         */
+        fcntl(in_fd, F_SETFL, fcntl(in_fd, F_GETFL) & ~O_NONBLOCK);
+        fcntl(out_fd, F_SETFL, fcntl(out_fd, F_GETFL) & ~O_NONBLOCK);
+        setenv("CONTENT_LENGTH", content_length, 1);
+        /**
+         * 请求体从标准输入读 输出写到标准输出
+         * dup2不继承原有的文件描述符属性 close-on-exec的描述符在exec时都会关闭
+         */
+        dup2(in_fd, 0);
+        dup2(out_fd, 1);
+        close(2);
+        /**
+         * execl()用来执行参数path 字符串所代表的文件路径, 
+         * 接下来的参数代表执行该文件时传递过去的argv(0),argv[1], ..., 
+         * 最后一个参数必须用空指针(NULL)作结束.
+         * 示例 execl("/bin/ls", "ls", NULL);
+         */
+        execl(program, "ls", NULL);
+        exit(0);
+    }
+
+    /*连接是否已经关闭 进程池据此回收对象*/
+    bool closed() const
+    {
+        return m_sockfd == -1;
+    }
+
+private:
+    void close_conn()
+    {
+        removefd(m_epollfd, m_sockfd);
+        m_sockfd = -1;
+    }
+
 private:
     /*读缓冲区大小*/
     static const int BUFFER_SIZE = 1024;
@@ -152,11 +195,15 @@ int main(int argc, char* argv[])
 {
     if(argc <= 2)
     {
-        printf("usage: %s ip_address port_number\n",basename(argv[0]));
+        printf("usage: %s ip_address port_number [backlog] [shm_control_path]\n",basename(argv[0]));
         return 1;
     }
     const char * ip = argv[1];
     int port = atoi(argv[2]);
+    /*全连接队列长度 原先的5在突发连接时会溢出*/
+    int backlog = (argc > 3) ? atoi(argv[3]) : 1024;
+    /*web服务器经这个Unix域socket接入共享内存通道 见shm_channel.h*/
+    const char * control_path = (argc > 4) ? argv[4] : NULL;
 
 
     int listenfd = socket(PF_INET, SOCK_STREAM, 0);
@@ -171,13 +218,30 @@ int main(int argc, char* argv[])
 
     ret= bind(listenfd, (struct sockaddr*)&address, sizeof(address));
     assert(ret != -1);
-    ret = listen(listenfd,5);
+    ret = listen(listenfd,backlog);
     assert(ret != -1);
 
 
+    int ctlfd = -1;
+    if(control_path)
+    {
+        struct sockaddr_un control_address;
+        bzero(&control_address, sizeof(control_address));
+        control_address.sun_family = AF_UNIX;
+        strncpy(control_address.sun_path, control_path, sizeof(control_address.sun_path) - 1);
+        unlink(control_path);
+        ctlfd = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        assert(ctlfd >= 0);
+        ret = bind(ctlfd, (struct sockaddr*)&control_address, sizeof(control_address));
+        assert(ret != -1);
+        ret = listen(ctlfd, 4);
+        assert(ret != -1);
+    }
+
     processpool<cgi_conn>* pool = processpool<cgi_conn>::create(listenfd);
     if(pool)
     {
+        pool->set_control(ctlfd);
         pool->run();
         delete pool;
     }
@@ -24,6 +24,19 @@
 #include <sys/stat.h>
 #include <iostream>
 
+#include "conn_store.h"
+#include "shm_executor.h"
+
+/**
+ * 每个请求都会走到的调试输出 默认在编译期消除 -DPOOL_VERBOSE时打开
+ * 进程池的各进程是单线程的 不需要web服务器那样的异步日志 只要不在热路径上同步写即可
+ */
+#ifdef POOL_VERBOSE
+#define POOL_DEBUG( ... ) printf( __VA_ARGS__ )
+#else
+#define POOL_DEBUG( ... ) do { } while( 0 )
+#endif
+
 /*子进程类*/
 class process
 {
@@ -38,11 +51,24 @@ public:
     int m_pipefd[2];
 };
 
+/*父进程经通信管道发给子进程的消息*/
+enum POOL_MESSAGE
+{
+    /*监听socket上有新连接*/
+    POOL_NEW_CONN = 1,
+    /*web服务器接入了共享内存通道 随消息带来memfd 本子进程的门铃 web的门铃*/
+    POOL_SHM_ATTACH = 2,
+    /*web服务器断开了共享内存通道*/
+    POOL_SHM_DETACH = 3
+};
+
 /**
  * 进程池类
- * 其模板参数是处理逻辑任务的类
+ * 其模板参数T是处理逻辑任务的类
+ * Store是子进程中保存连接对象的容器　默认按需分配的conn_store
+ * 设置了控制socket时 父进程在其上接受一个web服务器接入共享内存通道 见shm_channel.h
  */
-template< typename T >
+template< typename T, typename Store = conn_store< T > >
 class processpool
 {
 private:
@@ -50,11 +76,11 @@ private:
 
 public:
     /*单例模式 在之后调用到*/
-    static processpool< T >* create( int listenfd, int process_number = 8 )
+    static processpool< T, Store >* create( int listenfd, int process_number = 8 )
     {
         if( !m_instance )
         {
-            m_instance = new processpool< T >( listenfd, process_number );
+            m_instance = new processpool< T, Store >( listenfd, process_number );
         }
         return m_instance;
     }
@@ -64,6 +90,9 @@ public:
         delete [] m_sub_process;
     }
     
+    /*共享内存通道的控制socket(已listen的Unix域socket) 在run之前设置*/
+    void set_control( int ctlfd ) { m_ctlfd = ctlfd; }
+
     /*启动进程池*/
     void run();
 
@@ -71,12 +100,19 @@ private:
     void setup_sig_pipe();
     void run_parent();
     void run_child();
+    /*父进程: web服务器连上控制socket 交换共享内存通道的描述符并转交给各子进程*/
+    void shm_attach();
+    void shm_detach();
+    /*子进程: 读完通信管道上的所有消息*/
+    void child_messages( int pipefd, Store* users );
 
 private:
     /*进程允许的最大子进程数*/
     static const int MAX_PROCESS_NUMBER = 16;
     /*每个子进程最多能处理的客户数量*/
     static const int USER_PER_PROCESS = 65536;
+    /*子进程收到一次通知最多accept的连接数*/
+    static const int ACCEPT_BUDGET = 64;
     /*epoll 最多能处理的事件数*/
     static const int MAX_EVENT_NUMBER = 10000;
     /*进程池中的进程数*/
@@ -89,14 +125,19 @@ private:
     int m_listenfd;
     /*子进程通过stop来决定是否停止*/
     int m_stop;
+    /*共享内存通道的控制socket 以及已接入的web服务器的连接*/
+    int m_ctlfd;
+    int m_shm_conn;
+    /*子进程中的共享内存通道*/
+    shm_executor< T > m_shm;
     /*保存所有的子进程的描述信息*/
     process* m_sub_process;
     /*进程池静态实例*/
-    static processpool< T >* m_instance;
+    static processpool< T, Store >* m_instance;
 };
 
-template< typename T >
-processpool< T >* processpool< T >::m_instance = NULL;
+template< typename T, typename Store >
+processpool< T, Store >* processpool< T, Store >::m_instance = NULL;
 
 /*用于处理信号的管道　实现统一信号源*/
 static int sig_pipefd[2];
@@ -112,7 +153,6 @@ static int setnonblocking( int fd )
 static void addfd( int epollfd, int fd )
 {
     epoll_event event;
-    aw
     event.data.fd = fd;
     event.events = EPOLLIN | EPOLLET;
     epoll_ctl( epollfd, EPOLL_CTL_ADD, fd, &event );
@@ -148,9 +188,9 @@ static void addsig( int sig, void( handler )(int), bool restart = true )
 
 
 /*进程池的构造函数 参数listenfd是监听*/
-template< typename T >
-processpool< T >::processpool( int listenfd, int process_number ) 
-    : m_listenfd( listenfd ), m_process_number( process_number ), m_idx( -1 ), m_stop( false )
+template< typename T, typename Store >
+processpool< T, Store >::processpool( int listenfd, int process_number ) 
+    : m_listenfd( listenfd ), m_process_number( process_number ), m_idx( -1 ), m_stop( false ), m_ctlfd( -1 ), m_shm_conn( -1 )
 {
     assert( ( process_number > 0 ) && ( process_number <= MAX_PROCESS_NUMBER ) );
     m_sub_process = new process[ process_number ];
@@ -186,8 +226,8 @@ processpool< T >::processpool( int listenfd, int process_number )
  * 每一个子进程都会拥有一次 sig_pipefd
  * 父子进程都做一次
  */
-template< typename T >
-void processpool< T >::setup_sig_pipe()
+template< typename T, typename Store >
+void processpool< T, Store >::setup_sig_pipe()
 {
     m_epollfd = epoll_create( 5 );
     assert( m_epollfd != -1 );
@@ -206,8 +246,8 @@ void processpool< T >::setup_sig_pipe()
 }
 
 /*父进程中的m_idx是-1 子进程中的m_idx值大于等于0　我们据此判断接下来要运行的代码是父进程代码还是子进程的 */
-template< typename T >
-void processpool< T >::run()
+template< typename T, typename Store >
+void processpool< T, Store >::run()
 {
     if( m_idx != -1 )
     {
@@ -217,9 +257,91 @@ void processpool< T >::run()
     run_parent();
 }
 
+/**
+ * 管道是非阻塞的ET模式 一次事件要把积压的消息都读完
+ * 每次只读一个int 带描述符的消息与它的数据一起到达 边界不会错开
+ */
+template< typename T, typename Store >
+void processpool< T, Store >::child_messages( int pipefd, Store* users )
+{
+    while( true )
+    {
+        int message = 0;
+        int fds[3];
+        int fd_number = 0;
+        int ret = shm_recv_fds( pipefd, &message, fds, &fd_number, 3 );
+        if( ret <= 0 )
+        {
+            break;
+        }
+        if( message == POOL_SHM_ATTACH )
+        {
+            if( fd_number == 3 && m_shm.attach( m_epollfd, m_idx, fds[0], fds[1], fds[2] ) )
+            {
+                POOL_DEBUG( "child %d attached shared memory channel\n", m_idx );
+            }
+            else
+            {
+                for( int i = 0; i < fd_number; ++i )
+                {
+                    close( fds[i] );
+                }
+            }
+            continue;
+        }
+        for( int i = 0; i < fd_number; ++i )
+        {
+            close( fds[i] );
+        }
+        if( message == POOL_SHM_DETACH )
+        {
+            m_shm.detach();
+            continue;
+        }
+
+        /**
+         * 让子进程来完成客户端的连接
+         * 父进程的监听socket是ET模式 一次通知后要尽量把队列取空 最多ACCEPT_BUDGET个
+         */
+        for( int n = 0; n < ACCEPT_BUDGET; ++n )
+        {
+            struct sockaddr_in client_address;
+            socklen_t client_addrlength = sizeof( client_address );
+            int connfd = accept4( m_listenfd, ( struct sockaddr* )&client_address, &client_addrlength,
+                                  SOCK_NONBLOCK | SOCK_CLOEXEC );
+            if ( connfd < 0 )
+            {
+                if( errno == ECONNABORTED || errno == EINTR )
+                {
+                    continue;
+                }
+                if( errno != EAGAIN && errno != EWOULDBLOCK )
+                {
+                    printf( "errno is: %d\n", errno );
+                }
+                break;
+            }
+            T* conn = users->create( connfd );
+            if( ! conn )
+            {
+                close( connfd );
+                continue;
+            }
+            addfd( m_epollfd, connfd );
+
+            /**
+             * 模板类T必须实现init方法　以初始化一个客户端连接
+             * 以及closed方法　告知process之后连接是否已经关闭
+             * 连接对象由Store按fd索引　只为实际存在的连接分配
+             */
+            conn->init( m_epollfd, connfd, client_address );
+        }
+    }
+}
+
 /*子进程*/
-template< typename T >
-void processpool< T >::run_child()
+template< typename T, typename Store >
+void processpool< T, Store >::run_child()
 {
     /*用于父子进程通信*/
     setup_sig_pipe();
@@ -227,11 +349,17 @@ void processpool< T >::run_child()
     /*每个子进程都能通过其在进程池中的序号值m_idx找到与父进程通信的管道*/
     int pipefd = m_sub_process[m_idx].m_pipefd[ 1 ];
     addfd( m_epollfd, pipefd );
+    /*控制socket只由父进程处理*/
+    if( m_ctlfd != -1 )
+    {
+        close( m_ctlfd );
+        m_ctlfd = -1;
+    }
 
     epoll_event events[ MAX_EVENT_NUMBER ];
     
-    /*处理cgi请求的类 一个子进程最多处理USER_PER_PROCESS个连接*/
-    T* users = new T [ USER_PER_PROCESS ];
+    /*处理cgi请求的类 一个子进程最多处理USER_PER_PROCESS个连接 对象在连接到来时才分配*/
+    Store* users = new Store( USER_PER_PROCESS );
     assert( users );
     int number = 0;
     int ret = -1;
@@ -251,33 +379,7 @@ void processpool< T >::run_child()
             /*从父子进程之间的管道读取数据 并将结果保存在变量client中 如果成功表示有新客户连接到来*/
             if( ( sockfd == pipefd ) && ( events[i].events & EPOLLIN ) )
             {
-                int client = 0;
-                /*仅接收　不处理字符串*/
-                ret = recv( sockfd, ( char* )&client, sizeof( client ), 0 );
-                if( ( ( ret < 0 ) && ( errno != EAGAIN ) ) || ret == 0 ) 
-                {
-                    continue;
-                }
-                /*让子进程来完成客户端的连接*/
-                else
-                {
-                    struct sockaddr_in client_address;
-                    socklen_t client_addrlength = sizeof( client_address );
-                    int connfd = accept( m_listenfd, ( struct sockaddr* )&client_address, &client_addrlength );
-                    if ( connfd < 0 )
-                    {
-                        printf( "errno is: %d\n", errno );
-                        continue;
-                    }
-                    addfd( m_epollfd, connfd );
-                    
-                    /**
-                     * 模板类T必须实现init方法　以初始化一个客户端连接 
-                     * 我们直接使用connfd来索引逻辑处理对象,以提高程序的运行效率 
-                     * 但有一个问题就是有些浪费资源　hash_map获取会更好一些
-                     */
-                    users[connfd].init( m_epollfd, connfd, client_address );
-                }
+                child_messages( pipefd, users );
             }
 
             /** 
@@ -299,6 +401,14 @@ void processpool< T >::run_child()
                     {
                         switch( signals[i] )
                         {
+                            /*回收退出的cgi程序 否则都成了僵尸进程*/
+                            case SIGCHLD:
+                            {
+                                while( waitpid( -1, NULL, WNOHANG ) > 0 )
+                                {
+                                }
+                                break;
+                            }
                             case SIGINT:
                             {
                                 m_stop = true;
@@ -313,10 +423,26 @@ void processpool< T >::run_child()
                 }
             }
 
+            /*共享内存通道的门铃 或者某个cgi程序有了输出*/
+            else if( m_shm.owns( sockfd ) )
+            {
+                m_shm.handle( sockfd );
+            }
+
             /*客户请求的到来　调用process来处理*/
             else if( events[i].events & EPOLLIN )
             {
-                users[sockfd].process();
+                T* conn = users->get( sockfd );
+                if( ! conn )
+                {
+                    continue;
+                }
+                conn->process();
+                /*连接已关闭 归还对象*/
+                if( conn->closed() )
+                {
+                    users->release( sockfd );
+                }
             }
             else
             {
@@ -325,24 +451,29 @@ void processpool< T >::run_child()
         }
     }
 
-    delete [] users;
+    m_shm.detach();
+    delete users;
     users = NULL;
     close( pipefd );
     close( m_listenfd );
     close( m_epollfd );
 }
 
-template< typename T >
-void processpool< T >::run_parent()
+template< typename T, typename Store >
+void processpool< T, Store >::run_parent()
 {
     setup_sig_pipe();
 
     /*父进程监听listenfd*/
     addfd( m_epollfd, m_listenfd );
+    if( m_ctlfd != -1 )
+    {
+        addfd( m_epollfd, m_ctlfd );
+    }
 
     epoll_event events[ MAX_EVENT_NUMBER ];
     int sub_process_counter = 0;
-    int new_conn = 1;
+    int new_conn = POOL_NEW_CONN;
     int number = 0;
     int ret = -1;
 
@@ -384,7 +515,24 @@ void processpool< T >::run_parent()
                 /*主进程发送信息通知子进程接受连接*/
                 send( m_sub_process[i].m_pipefd[0], ( char* )&new_conn, sizeof( new_conn ), 0 );
                 
-                printf( "send request to child %d\n", i );
+                POOL_DEBUG( "send request to child %d\n", i );
+            }
+
+            /*web服务器来接入共享内存通道*/
+            else if( sockfd == m_ctlfd )
+            {
+                shm_attach();
+            }
+
+            /*已接入的web服务器断开了 只会是EOF 它不在控制连接上发别的*/
+            else if( sockfd == m_shm_conn )
+            {
+                char buf[ 16 ];
+                ret = recv( m_shm_conn, buf, sizeof( buf ), 0 );
+                if( ret == 0 || ( ret < 0 && errno != EAGAIN ) )
+                {
+                    shm_detach();
+                }
             }
 
             /*处理父进程接收到的信号*/
@@ -461,7 +609,90 @@ void processpool< T >::run_parent()
     }
 
     /*关闭*/
+    shm_detach();
     close( m_epollfd );
 }
 
+/**
+ * 握手: 父进程先发子进程数 web服务器据此建好共享内存后发回
+ *       一个int和 memfd web的门铃 各子进程的门铃 共2+子进程数个描述符
+ * 同一时刻只接入一个web服务器 例如热升级时新进程接不进来 就继续走TCP
+ * 握手在控制socket上阻塞进行 有超时 只在web服务器启动时发生一次
+ */
+template< typename T, typename Store >
+void processpool< T, Store >::shm_attach()
+{
+    while( true )
+    {
+        int connfd = accept4( m_ctlfd, NULL, NULL, SOCK_CLOEXEC );
+        if( connfd < 0 )
+        {
+            if( errno == ECONNABORTED || errno == EINTR )
+            {
+                continue;
+            }
+            break;
+        }
+        if( m_shm_conn != -1 )
+        {
+            close( connfd );
+            continue;
+        }
+
+        struct timeval timeout = { 1, 0 };
+        setsockopt( connfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout ) );
+        int fds[ 2 + MAX_PROCESS_NUMBER ];
+        int fd_number = 0;
+        int value = 0;
+        if( send( connfd, &m_process_number, sizeof( m_process_number ), MSG_NOSIGNAL ) != sizeof( m_process_number )
+            || shm_recv_fds( connfd, &value, fds, &fd_number, 2 + MAX_PROCESS_NUMBER ) != sizeof( value )
+            || fd_number != 2 + m_process_number )
+        {
+            for( int i = 0; i < fd_number; ++i )
+            {
+                close( fds[i] );
+            }
+            close( connfd );
+            continue;
+        }
+
+        /*每个子进程拿到 memfd 自己的门铃 web的门铃*/
+        for( int i = 0; i < m_process_number; ++i )
+        {
+            if( m_sub_process[i].m_pid != -1 )
+            {
+                int child_fds[3] = { fds[0], fds[ 2 + i ], fds[1] };
+                shm_send_fds( m_sub_process[i].m_pipefd[0], POOL_SHM_ATTACH, child_fds, 3 );
+            }
+        }
+        for( int i = 0; i < fd_number; ++i )
+        {
+            close( fds[i] );
+        }
+        m_shm_conn = connfd;
+        addfd( m_epollfd, m_shm_conn );
+        printf( "web server attached the shared memory channel\n" );
+    }
+}
+
+template< typename T, typename Store >
+void processpool< T, Store >::shm_detach()
+{
+    if( m_shm_conn == -1 )
+    {
+        return;
+    }
+    removefd( m_epollfd, m_shm_conn );
+    m_shm_conn = -1;
+    int message = POOL_SHM_DETACH;
+    for( int i = 0; i < m_process_number; ++i )
+    {
+        if( m_sub_process[i].m_pid != -1 )
+        {
+            send( m_sub_process[i].m_pipefd[0], ( char* )&message, sizeof( message ), 0 );
+        }
+    }
+    printf( "web server detached the shared memory channel\n" );
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,184 @@
+/**
+ * Created by 刘嘉辉 on 11/18/18.
+ * Copyright (c) 2018 刘嘉辉 All rights reserved.
+ * @brief To immplmente shm_channel.h.
+ */
+
+#ifndef SHM_CHANNEL_H
+#define SHM_CHANNEL_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+/**
+ * web服务器与cgi进程池之间的共享内存通道 两边都包含这个头文件
+ *
+ * web服务器创建memfd与eventfd 经控制socket(Unix域)用SCM_RIGHTS交给进程池的父进程
+ * 父进程再经各子进程的通信管道转交 之后的请求与应答只走共享内存 不再有socket调用
+ *
+ * 每个子进程一个shm_child:
+ *   requests  web -> 子进程 的消息环 消息是 槽号 | 类型 只有一个生产者(web一侧加锁)
+ *   ready     子进程 -> web 的消息环 槽中有了新输出或者结束
+ *   slots     每个在途的cgi请求占一个槽 请求体与程序路径由web写入
+ *             程序的输出由子进程写进槽内的环形缓冲区 web直接从共享内存发给客户 发完才推进tail
+ * 门铃: 每个子进程一个eventfd 由web写 web一侧一个eventfd 所有子进程都写
+ *
+ * 通知去重: 子进程只在notified由0变1时才往ready里放消息 web取出消息后先清零再读数据
+ * 背压: 输出环满时子进程置waiting后不再读程序的输出 web推进tail后发现waiting就敲子进程的门铃
+ */
+
+/*每个子进程同时处理的请求数*/
+static const int SHM_SLOTS = 32;
+/*消息环的大小 是2的幂 每个槽同时最多有START与ABORT两条消息*/
+static const int SHM_RING_SIZE = 128;
+static const int SHM_PROGRAM_LEN = 512;
+/*请求体更大的请求仍走TCP*/
+static const int SHM_BODY_SIZE = 16 * 1024;
+static const int SHM_OUT_SIZE = 64 * 1024;
+static const unsigned int SHM_MAGIC = 0x63676931;
+
+/*requests环中的消息类型 放在槽号的高16位*/
+enum SHM_MESSAGE { SHM_START = 0, SHM_ABORT = 1 };
+
+/*单生产者单消费者的消息环 两个下标各占一条缓存行*/
+struct shm_ring
+{
+    unsigned long head;
+    char pad1[ 56 ];
+    unsigned long tail;
+    char pad2[ 56 ];
+    unsigned int msgs[ SHM_RING_SIZE ];
+};
+
+inline bool shm_push( shm_ring& ring, unsigned int msg )
+{
+    unsigned long head = ring.head;
+    if( head - __atomic_load_n( &ring.tail, __ATOMIC_ACQUIRE ) >= ( unsigned long )SHM_RING_SIZE )
+    {
+        return false;
+    }
+    ring.msgs[ head & ( SHM_RING_SIZE - 1 ) ] = msg;
+    __atomic_store_n( &ring.head, head + 1, __ATOMIC_RELEASE );
+    return true;
+}
+
+inline bool shm_pop( shm_ring& ring, unsigned int& msg )
+{
+    unsigned long tail = ring.tail;
+    if( tail == __atomic_load_n( &ring.head, __ATOMIC_ACQUIRE ) )
+    {
+        return false;
+    }
+    msg = ring.msgs[ tail & ( SHM_RING_SIZE - 1 ) ];
+    __atomic_store_n( &ring.tail, tail + 1, __ATOMIC_RELEASE );
+    return true;
+}
+
+struct shm_slot
+{
+    /*web写 子进程在START之后读*/
+    char program[ SHM_PROGRAM_LEN ];
+    int body_len;
+    char body[ SHM_BODY_SIZE ];
+    /*子进程写*/
+    unsigned long out_head;
+    char pad1[ 56 ];
+    /*web写*/
+    unsigned long out_tail;
+    char pad2[ 56 ];
+    /*程序的输出已经全部写进环里 此后子进程不再碰这个槽*/
+    int eof;
+    /*ready中已有该槽的消息*/
+    int notified;
+    /*子进程因为环满停下了*/
+    int waiting;
+    char out[ SHM_OUT_SIZE ];
+};
+
+struct shm_child
+{
+    shm_ring requests;
+    shm_ring ready;
+    shm_slot slots[ SHM_SLOTS ];
+};
+
+/*共享内存区的开头 后面紧跟child_number个shm_child*/
+struct shm_region
+{
+    unsigned int magic;
+    int child_number;
+    char pad[ 56 ];
+};
+
+inline size_t shm_region_size( int child_number )
+{
+    return sizeof( shm_region ) + sizeof( shm_child ) * child_number;
+}
+
+inline shm_child* shm_children( shm_region* region )
+{
+    return ( shm_child* )( region + 1 );
+}
+
+/*经Unix域socket发送一个int和若干描述符*/
+inline bool shm_send_fds( int sockfd, int value, const int* fds, int n )
+{
+    struct iovec iov = { &value, sizeof( value ) };
+    char control[ CMSG_SPACE( sizeof( int ) * 64 ) ];
+    struct msghdr msg;
+    memset( &msg, 0, sizeof( msg ) );
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if( n > 0 )
+    {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE( sizeof( int ) * n );
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR( &msg );
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN( sizeof( int ) * n );
+        memcpy( CMSG_DATA( cmsg ), fds, sizeof( int ) * n );
+    }
+    return sendmsg( sockfd, &msg, MSG_NOSIGNAL ) == sizeof( value );
+}
+
+/*返回读到的字节数 收到的描述符放进fds 个数放进n 描述符都带close-on-exec*/
+inline ssize_t shm_recv_fds( int sockfd, int* value, int* fds, int* n, int max )
+{
+    struct iovec iov = { value, sizeof( *value ) };
+    char control[ CMSG_SPACE( sizeof( int ) * 64 ) ];
+    struct msghdr msg;
+    memset( &msg, 0, sizeof( msg ) );
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof( control );
+    ssize_t ret = recvmsg( sockfd, &msg, MSG_CMSG_CLOEXEC );
+    *n = 0;
+    for( struct cmsghdr* cmsg = CMSG_FIRSTHDR( &msg ); ret > 0 && cmsg; cmsg = CMSG_NXTHDR( &msg, cmsg ) )
+    {
+        if( cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS )
+        {
+            int count = ( cmsg->cmsg_len - CMSG_LEN( 0 ) ) / sizeof( int );
+            for( int i = 0; i < count; ++i )
+            {
+                int fd;
+                memcpy( &fd, CMSG_DATA( cmsg ) + i * sizeof( int ), sizeof( int ) );
+                if( *n < max )
+                {
+                    fds[ ( *n )++ ] = fd;
+                }
+                else
+                {
+                    close( fd );
+                }
+            }
+        }
+    }
+    return ret;
+}
+
+#endif
@@ -0,0 +1,311 @@
+/**
+ * Created by 刘嘉辉 on 11/18/18.
+ * Copyright (c) 2018 刘嘉辉 All rights reserved.
+ * @brief To immplmente shm_executor.h.
+ */
+
+#ifndef SHM_EXECUTOR_H
+#define SHM_EXECUTOR_H
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "shm_channel.h"
+
+/**
+ * 子进程一侧的共享内存通道 由processpool在子进程中持有
+ * 门铃响时取出requests中的消息 START为槽启动cgi程序 ABORT结束槽上的程序(客户已经断开)
+ * 程序的标准输入是一个管道 请求体一次写进去 标准输出的管道登记到子进程的epoll中
+ * 输出可读时读进槽的输出环 环满时停下 等web推进tail后敲门铃再继续
+ * 模板类T需要实现静态函数spawn( program, content_length, in_fd, out_fd ) 返回子进程号
+ */
+template< typename T >
+class shm_executor
+{
+public:
+    shm_executor() : m_region( NULL ), m_size( 0 ), m_child( NULL ), m_epollfd( -1 ), m_doorbell( -1 ), m_to_web( -1 )
+    {
+        for( int i = 0; i < SHM_SLOTS; ++i )
+        {
+            m_pipes[i] = -1;
+            m_blocked[i] = false;
+        }
+    }
+
+    ~shm_executor()
+    {
+        detach();
+    }
+
+    bool attached() const { return m_region != NULL; }
+
+    /*映射web服务器交来的共享内存 idx为本进程在进程池中的序号*/
+    bool attach( int epollfd, int idx, int memfd, int doorbell, int to_web )
+    {
+        detach();
+        struct stat st;
+        void* address = MAP_FAILED;
+        if( fstat( memfd, &st ) == 0 && st.st_size >= ( off_t )sizeof( shm_region ) )
+        {
+            address = mmap( NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0 );
+        }
+        close( memfd );
+        shm_region* region = ( shm_region* )address;
+        if( address == MAP_FAILED || region->magic != SHM_MAGIC || idx >= region->child_number
+            || st.st_size < ( off_t )shm_region_size( region->child_number ) )
+        {
+            if( address != MAP_FAILED )
+            {
+                munmap( address, st.st_size );
+            }
+            close( doorbell );
+            close( to_web );
+            return false;
+        }
+        m_region = region;
+        m_size = st.st_size;
+        m_child = &shm_children( region )[ idx ];
+        m_epollfd = epollfd;
+        m_doorbell = doorbell;
+        m_to_web = to_web;
+        watch( m_doorbell );
+        /*attach之前web已经放进来的请求*/
+        on_doorbell();
+        return true;
+    }
+
+    /*web服务器退出了 丢下在途的程序*/
+    void detach()
+    {
+        if( ! m_region )
+        {
+            return;
+        }
+        for( int i = 0; i < SHM_SLOTS; ++i )
+        {
+            if( m_pipes[i] != -1 )
+            {
+                unwatch( m_pipes[i] );
+                m_pipes[i] = -1;
+            }
+            m_blocked[i] = false;
+        }
+        unwatch( m_doorbell );
+        close( m_to_web );
+        munmap( m_region, m_size );
+        m_region = NULL;
+        m_child = NULL;
+    }
+
+    /*fd是门铃或者某个程序的输出*/
+    bool owns( int fd ) const
+    {
+        return m_region && ( fd == m_doorbell || slot_of( fd ) >= 0 );
+    }
+
+    void handle( int fd )
+    {
+        if( fd == m_doorbell )
+        {
+            on_doorbell();
+        }
+        else
+        {
+            pump( slot_of( fd ) );
+        }
+    }
+
+private:
+    void watch( int fd )
+    {
+        epoll_event event;
+        event.data.fd = fd;
+        event.events = EPOLLIN | EPOLLET;
+        epoll_ctl( m_epollfd, EPOLL_CTL_ADD, fd, &event );
+        fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK );
+    }
+
+    void unwatch( int fd )
+    {
+        epoll_ctl( m_epollfd, EPOLL_CTL_DEL, fd, 0 );
+        close( fd );
+    }
+
+    int slot_of( int fd ) const
+    {
+        for( int i = 0; i < SHM_SLOTS; ++i )
+        {
+            if( m_pipes[i] == fd )
+            {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    void on_doorbell()
+    {
+        eventfd_t value;
+        eventfd_read( m_doorbell, &value );
+        unsigned int msg;
+        while( shm_pop( m_child->requests, msg ) )
+        {
+            int slot = msg & 0xffff;
+            if( slot >= SHM_SLOTS )
+            {
+                continue;
+            }
+            if( ( msg >> 16 ) == SHM_START )
+            {
+                start( slot );
+            }
+            else if( m_pipes[ slot ] != -1 )
+            {
+                finish( slot );
+            }
+        }
+        /*web腾出了空间 继续读之前因为环满停下的程序输出*/
+        for( int i = 0; i < SHM_SLOTS; ++i )
+        {
+            if( m_blocked[i] )
+            {
+                pump( i );
+            }
+        }
+    }
+
+    void start( int slot )
+    {
+        shm_slot& s = m_child->slots[ slot ];
+        int in[2], out[2];
+        if( pipe2( in, O_CLOEXEC ) < 0 )
+        {
+            finish( slot );
+            return;
+        }
+        if( pipe2( out, O_CLOEXEC ) < 0 )
+        {
+            close( in[0] );
+            close( in[1] );
+            finish( slot );
+            return;
+        }
+        /*请求体不超过SHM_BODY_SIZE 管道放得下 一次写完后关闭 程序读到EOF*/
+        int body_len = ( s.body_len > 0 && s.body_len <= SHM_BODY_SIZE ) ? s.body_len : 0;
+        bool ok = body_len == 0 || ::write( in[1], s.body, body_len ) == body_len;
+        close( in[1] );
+        s.program[ SHM_PROGRAM_LEN - 1 ] = '\0';
+        char content_length[ 16 ];
+        snprintf( content_length, sizeof( content_length ), "%d", body_len );
+        pid_t pid = ok ? T::spawn( s.program, content_length, in[0], out[1] ) : -1;
+        close( in[0] );
+        close( out[1] );
+        if( pid < 0 )
+        {
+            close( out[0] );
+            finish( slot );
+            return;
+        }
+        m_pipes[ slot ] = out[0];
+        watch( out[0] );
+        pump( slot );
+    }
+
+    /*把程序的输出读进槽的环 直到管道读空 环满或者程序结束*/
+    void pump( int slot )
+    {
+        if( slot < 0 || m_pipes[ slot ] == -1 )
+        {
+            return;
+        }
+        shm_slot& s = m_child->slots[ slot ];
+        m_blocked[ slot ] = false;
+        bool wrote = false;
+        while( true )
+        {
+            unsigned long head = s.out_head;
+            unsigned long used = head - __atomic_load_n( &s.out_tail, __ATOMIC_SEQ_CST );
+            if( used >= ( unsigned long )SHM_OUT_SIZE )
+            {
+                /*先置waiting再看一次tail web在两者之间推进了tail也不会漏掉门铃*/
+                __atomic_store_n( &s.waiting, 1, __ATOMIC_SEQ_CST );
+                if( head - __atomic_load_n( &s.out_tail, __ATOMIC_SEQ_CST ) < ( unsigned long )SHM_OUT_SIZE )
+                {
+                    continue;
+                }
+                m_blocked[ slot ] = true;
+                break;
+            }
+            unsigned long offset = head % SHM_OUT_SIZE;
+            unsigned long room = SHM_OUT_SIZE - used;
+            if( room > SHM_OUT_SIZE - offset )
+            {
+                room = SHM_OUT_SIZE - offset;
+            }
+            ssize_t n = ::read( m_pipes[ slot ], s.out + offset, room );
+            if( n > 0 )
+            {
+                __atomic_store_n( &s.out_head, head + n, __ATOMIC_SEQ_CST );
+                wrote = true;
+                continue;
+            }
+            if( n < 0 && errno == EINTR )
+            {
+                continue;
+            }
+            if( n < 0 && errno == EAGAIN )
+            {
+                break;
+            }
+            finish( slot );
+            return;
+        }
+        if( wrote )
+        {
+            notify( slot );
+        }
+    }
+
+    /*程序结束或被放弃 此后不再碰这个槽 由web回收*/
+    void finish( int slot )
+    {
+        if( m_pipes[ slot ] != -1 )
+        {
+            unwatch( m_pipes[ slot ] );
+            m_pipes[ slot ] = -1;
+        }
+        m_blocked[ slot ] = false;
+        __atomic_store_n( &m_child->slots[ slot ].eof, 1, __ATOMIC_SEQ_CST );
+        notify( slot );
+    }
+
+    void notify( int slot )
+    {
+        if( __atomic_exchange_n( &m_child->slots[ slot ].notified, 1, __ATOMIC_SEQ_CST ) == 0 )
+        {
+            shm_push( m_child->ready, slot );
+            eventfd_write( m_to_web, 1 );
+        }
+    }
+
+private:
+    shm_region* m_region;
+    size_t m_size;
+    shm_child* m_child;
+    int m_epollfd;
+    int m_doorbell;
+    int m_to_web;
+    /*各槽上程序标准输出的读端 -1表示槽空闲*/
+    int m_pipes[ SHM_SLOTS ];
+    /*因为输出环满停下 门铃响时重试*/
+    bool m_blocked[ SHM_SLOTS ];
+};
+
+#endif
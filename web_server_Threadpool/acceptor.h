@@ -0,0 +1,226 @@
+/**
+ * Created by 刘嘉辉 on 11/05/18.
+ * Copyright (c) 2018 刘嘉辉 All rights reserved.
+ * @brief To immplmente acceptor.h.
+ */
+
+#ifndef ACCEPTOR_H
+#define ACCEPTOR_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include "log.h"
+
+/**
+ * 监听socket的接收子系统
+ * 监听socket以ET模式注册 一次事件必须把全连接队列取空 否则剩下的连接要等到下一个事件
+ * 每轮最多accept m_budget个 避免连接洪峰时饿死已有连接的读写
+ * 预算用完时pending()为真　主循环应以0超时再进入一轮
+ * 可以同时有多个acceptor 例如一个TCP的加若干个Unix域的 共用同一个reactor
+ */
+class acceptor
+{
+public:
+    static const int DEFAULT_BACKLOG = 1024;
+    static const int DEFAULT_BUDGET = 64;
+
+public:
+    acceptor() : m_listenfd( -1 ), m_local( false ), m_budget( DEFAULT_BUDGET ), m_left( 0 ), m_pending( false ), m_starved( false ) {}
+
+    /**
+     * 创建 绑定并监听
+     * defer_secs > 0 时设置TCP_DEFER_ACCEPT 数据到达后内核才把连接交给accept
+     */
+    int open( const char* ip, int port, int backlog, int defer_secs )
+    {
+        int fd = socket( PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+        if( fd < 0 )
+        {
+            return -1;
+        }
+        /**
+         * 重启时端口上还有TIME_WAIT的连接也能绑定
+         * 不再用SO_LINGER{1,0}: 它会被accept出的连接继承 close时发RST 还没被客户读走的应答尾部会被丢掉
+         */
+        int reuse = 1;
+        setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
+
+        struct sockaddr_in address;
+        bzero( &address, sizeof( address ) );
+        address.sin_family = AF_INET;
+        inet_pton( AF_INET, ip, &address.sin_addr );
+        address.sin_port = htons( port );
+
+        if( bind( fd, ( struct sockaddr* )&address, sizeof( address ) ) < 0 )
+        {
+            close( fd );
+            return -1;
+        }
+        attach( fd, backlog, defer_secs );
+        return m_listenfd;
+    }
+
+    /**
+     * Unix域的监听socket 同一台机器上的反向代理经由它连接 不经过TCP协议栈 也不占临时端口
+     * 路径上是上次退出时留下的socket文件就先删掉 还有进程在上面监听则失败
+     */
+    int open_unix( const char* path, int backlog )
+    {
+        struct sockaddr_un address;
+        if( strlen( path ) >= sizeof( address.sun_path ) )
+        {
+            return -1;
+        }
+        bzero( &address, sizeof( address ) );
+        address.sun_family = AF_UNIX;
+        strcpy( address.sun_path, path );
+
+        int fd = socket( PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+        if( fd < 0 )
+        {
+            return -1;
+        }
+        if( connect( fd, ( struct sockaddr* )&address, sizeof( address ) ) == 0 )
+        {
+            close( fd );
+            errno = EADDRINUSE;
+            return -1;
+        }
+        if( errno == ECONNREFUSED )
+        {
+            unlink( path );
+        }
+        close( fd );
+
+        fd = socket( PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+        if( fd < 0 )
+        {
+            return -1;
+        }
+        if( bind( fd, ( struct sockaddr* )&address, sizeof( address ) ) < 0 )
+        {
+            close( fd );
+            return -1;
+        }
+        return attach( fd, backlog, 0 );
+    }
+
+    /*接管一个已经bind的socket(例如热升级继承来的) 重新listen以应用新的backlog*/
+    int attach( int fd, int backlog, int defer_secs )
+    {
+        struct sockaddr_storage address;
+        socklen_t len = sizeof( address );
+        m_local = getsockname( fd, ( struct sockaddr* )&address, &len ) == 0 && address.ss_family == AF_UNIX;
+        if( defer_secs > 0 && ! m_local )
+        {
+            setsockopt( fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_secs, sizeof( defer_secs ) );
+        }
+        if( listen( fd, backlog ) < 0 )
+        {
+            close( fd );
+            return -1;
+        }
+        m_listenfd = fd;
+        return m_listenfd;
+    }
+
+    void set_budget( int budget )
+    {
+        m_budget = ( budget > 0 ) ? budget : DEFAULT_BUDGET;
+    }
+
+    /*开始新一轮 重置预算*/
+    void begin()
+    {
+        m_left = m_budget;
+        m_pending = false;
+    }
+
+    /**
+     * 取下一个连接 返回的fd已经是非阻塞且close-on-exec的
+     * 队列已空或本轮预算用完时返回-1
+     */
+    int next( struct sockaddr_in& addr )
+    {
+        while( m_left > 0 )
+        {
+            socklen_t len = sizeof( addr );
+            int connfd = accept4( m_listenfd, ( struct sockaddr* )&addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC );
+            if( connfd >= 0 )
+            {
+                m_starved = false;
+                /*Unix域的对端没有IP和端口 只标记地址族*/
+                if( m_local )
+                {
+                    bzero( &addr, sizeof( addr ) );
+                    addr.sin_family = AF_UNIX;
+                }
+                --m_left;
+                return connfd;
+            }
+            /*连接在accept之前已被对端重置 跳过继续取*/
+            if( errno == EINTR || errno == ECONNABORTED || errno == EPROTO )
+            {
+                continue;
+            }
+            /**
+             * 文件描述符用完 连接还留在队列里 ET模式下不会再有新的事件
+             * 标记为pending让主循环回来重试 starved时主循环稍等一会再试 不空转
+             */
+            if( errno == EMFILE || errno == ENFILE )
+            {
+                /*重试期间只在刚用完时记一次*/
+                if( ! m_starved )
+                {
+                    LOG_WARN( "accept: %s", strerror( errno ) );
+                }
+                m_pending = true;
+                m_starved = true;
+                return -1;
+            }
+            m_starved = false;
+            if( errno != EAGAIN && errno != EWOULDBLOCK )
+            {
+                LOG_WARN( "accept errno is: %d", errno );
+            }
+            return -1;
+        }
+        m_pending = true;
+        m_starved = false;
+        return -1;
+    }
+
+    /*本轮因预算用完或文件描述符用完而停止 队列里可能还有连接*/
+    bool pending() const { return m_pending; }
+    /*本轮因文件描述符用完而停止 要等已有连接关闭才能继续accept*/
+    bool starved() const { return m_starved; }
+
+    int fd() const { return m_listenfd; }
+    /*是否是Unix域的监听socket*/
+    bool local() const { return m_local; }
+
+    void reset()
+    {
+        m_listenfd = -1;
+        m_pending = false;
+        m_starved = false;
+    }
+
+private:
+    int m_listenfd;
+    bool m_local;
+    int m_budget;
+    int m_left;
+    bool m_pending;
+    bool m_starved;
+};
+
+#endif
@@ -0,0 +1,156 @@
+/**
+ * Created by 刘嘉辉 on 11/06/18.
+ * Copyright (c) 2018 刘嘉辉 All rights reserved.
+ * @brief To immplmente affinity.h.
+ */
+
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sched.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * 线程放置
+ * 主线程与工作线程可以绑定到指定的CPU集合
+ * 连接对象的缓冲区由主线程在accept时初始化 按first-touch策略落在主线程所在的NUMA节点
+ * 所以工作线程默认放在与主线程相同的节点上 处理连接时访问的是本地内存
+ */
+
+/*解析形如 "0-3,8,10-11" 的CPU列表*/
+static bool parse_cpu_list( const char* text, cpu_set_t* set )
+{
+    CPU_ZERO( set );
+    const char* p = text;
+    while( *p )
+    {
+        char* end;
+        long first = strtol( p, &end, 10 );
+        if( end == p || first < 0 || first >= CPU_SETSIZE )
+        {
+            return false;
+        }
+        long last = first;
+        p = end;
+        if( *p == '-' )
+        {
+            ++p;
+            last = strtol( p, &end, 10 );
+            if( end == p || last < first || last >= CPU_SETSIZE )
+            {
+                return false;
+            }
+            p = end;
+        }
+        for( long cpu = first; cpu <= last; ++cpu )
+        {
+            CPU_SET( cpu, set );
+        }
+        if( *p == ',' )
+        {
+            ++p;
+        }
+        else if( *p )
+        {
+            return false;
+        }
+    }
+    return CPU_COUNT( set ) > 0;
+}
+
+/*CPU所在的NUMA节点 通过sysfs中cpuN目录下的nodeM链接得到 不可知时返回0*/
+static int cpu_node( int cpu )
+{
+    char path[ 64 ];
+    snprintf( path, sizeof( path ), "/sys/devices/system/cpu/cpu%d", cpu );
+    DIR* dir = opendir( path );
+    if( ! dir )
+    {
+        return 0;
+    }
+    int node = 0;
+    struct dirent* entry;
+    while( ( entry = readdir( dir ) ) != NULL )
+    {
+        if( strncmp( entry->d_name, "node", 4 ) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9' )
+        {
+            node = atoi( entry->d_name + 4 );
+            break;
+        }
+    }
+    closedir( dir );
+    return node;
+}
+
+/*与set中任意CPU处于同一NUMA节点的所有在线CPU*/
+static void node_cpus( const cpu_set_t* set, cpu_set_t* out )
+{
+    cpu_set_t online;
+    CPU_ZERO( out );
+    if( sched_getaffinity( 0, sizeof( online ), &online ) != 0 )
+    {
+        *out = *set;
+        return;
+    }
+
+    bool nodes[ CPU_SETSIZE ] = { false };
+    for( int cpu = 0; cpu < CPU_SETSIZE; ++cpu )
+    {
+        if( CPU_ISSET( cpu, set ) )
+        {
+            nodes[ cpu_node( cpu ) ] = true;
+        }
+    }
+    for( int cpu = 0; cpu < CPU_SETSIZE; ++cpu )
+    {
+        if( CPU_ISSET( cpu, &online ) && nodes[ cpu_node( cpu ) ] )
+        {
+            CPU_SET( cpu, out );
+        }
+    }
+    if( CPU_COUNT( out ) == 0 )
+    {
+        *out = *set;
+    }
+}
+
+/*集合中的第n个CPU(循环) 用于把工作线程逐个分散到不同CPU上*/
+static int nth_cpu( const cpu_set_t* set, int n )
+{
+    int count = CPU_COUNT( set );
+    if( count == 0 )
+    {
+        return -1;
+    }
+    n %= count;
+    for( int cpu = 0; cpu < CPU_SETSIZE; ++cpu )
+    {
+        if( CPU_ISSET( cpu, set ) && n-- == 0 )
+        {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+static bool pin_thread( pthread_t thread, int cpu )
+{
+    cpu_set_t one;
+    CPU_ZERO( &one );
+    CPU_SET( cpu, &one );
+    return pthread_setaffinity_np( thread, sizeof( one ), &one ) == 0;
+}
+
+static bool pin_thread( pthread_t thread, const cpu_set_t* set )
+{
+    return pthread_setaffinity_np( thread, sizeof( *set ), set ) == 0;
+}
+
+#endif
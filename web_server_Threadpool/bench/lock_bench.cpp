@@ -0,0 +1,628 @@
+/**
+ * Created by 刘嘉辉 on 11/18/18.
+ * Copyright (c) 2018 刘嘉辉 All rights reserved.
+ * @brief To immplmente lock_bench.cpp.
+ */
+
+/**
+ * locker.h中同步原语的微基准 在1到64个线程下对比原来的sem/locker/cond以及pthread
+ * 不属于服务器本身 单独编译:
+ *     g++ -std=c++11 -O2 -o lock_bench lock_bench.cpp -lpthread
+ *     ./lock_bench [总操作数] [最多线程数]
+ * 每一列是每次操作的平均纳秒数 越小越好
+ *     mutex:   各线程反复加锁 给共享计数加一 解锁 锁外做一点空循环
+ *     rw:      千分之一写 其余读一个std::unordered_map 路径缓存的访问模式
+ *     pc:      一半线程生产一半线程消费 std::vector加锁保护 消费者在队列空时睡眠
+ *     q:       无锁的有界MPMC队列 消费者在队列空时睡眠 只比较睡眠与唤醒的方式
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unordered_map>
+#include <vector>
+#include "../locker.h"
+
+static double now_s()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*起n个线程 第i个线程调用f(i) 返回全部结束所用的秒数*/
+template< typename F >
+static double run_threads( int n, F& f )
+{
+    struct arg
+    {
+        F* f;
+        int id;
+        static void* entry( void* p )
+        {
+            arg* a = ( arg* )p;
+            ( *a->f )( a->id );
+            return NULL;
+        }
+    };
+    std::vector< pthread_t > threads( n );
+    std::vector< arg > args( n );
+    double start = now_s();
+    for( int i = 0; i < n; ++i )
+    {
+        args[i].f = &f;
+        args[i].id = i;
+        if( pthread_create( &threads[i], NULL, arg::entry, &args[i] ) != 0 )
+        {
+            perror( "pthread_create" );
+            exit( 1 );
+        }
+    }
+    for( int i = 0; i < n; ++i )
+    {
+        pthread_join( threads[i], NULL );
+    }
+    return now_s() - start;
+}
+
+/*生产者与消费者各占一半 至少各一个*/
+static void split( int n, int& producers, int& consumers )
+{
+    producers = ( n / 2 > 0 ) ? n / 2 : 1;
+    consumers = ( n - producers > 0 ) ? n - producers : 1;
+}
+
+
+/*互斥锁*/
+struct pthread_mutex
+{
+    pthread_mutex_t m;
+    pthread_mutex() { pthread_mutex_init( &m, NULL ); }
+    ~pthread_mutex() { pthread_mutex_destroy( &m ); }
+    void lock() { pthread_mutex_lock( &m ); }
+    void unlock() { pthread_mutex_unlock( &m ); }
+};
+
+template< typename M >
+struct mutex_task
+{
+    M m;
+    volatile long counter;
+    long per;
+
+    void operator()( int )
+    {
+        for( long i = 0; i < per; ++i )
+        {
+            m.lock();
+            counter = counter + 1;
+            m.unlock();
+            for( int k = 0; k < 20; ++k )
+            {
+                asm volatile( "" );
+            }
+        }
+    }
+};
+
+template< typename M >
+static double bench_mutex( int n, long total )
+{
+    mutex_task< M > task;
+    task.counter = 0;
+    task.per = total / n;
+    double t = run_threads( n, task );
+    if( task.counter != task.per * n )
+    {
+        fprintf( stderr, "mutex: lost updates %ld/%ld\n", ( long )task.counter, task.per * n );
+    }
+    return t * 1e9 / ( task.per * n );
+}
+
+
+/*读写锁 读写都用locker的就是加读写锁之前的路径缓存*/
+struct rw_by_locker
+{
+    locker l;
+    void read_lock() { l.lock(); }
+    void read_unlock() { l.unlock(); }
+    void write_lock() { l.lock(); }
+    void write_unlock() { l.unlock(); }
+};
+
+struct rw_by_pthread
+{
+    pthread_rwlock_t l;
+    rw_by_pthread() { pthread_rwlock_init( &l, NULL ); }
+    ~rw_by_pthread() { pthread_rwlock_destroy( &l ); }
+    void read_lock() { pthread_rwlock_rdlock( &l ); }
+    void read_unlock() { pthread_rwlock_unlock( &l ); }
+    void write_lock() { pthread_rwlock_wrlock( &l ); }
+    void write_unlock() { pthread_rwlock_unlock( &l ); }
+};
+
+template< typename L >
+struct rw_task
+{
+    L l;
+    std::unordered_map< int, int > map;
+    long per;
+    volatile long sink;
+
+    void operator()( int id )
+    {
+        unsigned int seed = id * 7919 + 1;
+        long sum = 0;
+        for( long i = 0; i < per; ++i )
+        {
+            seed = seed * 1103515245 + 12345;
+            int key = ( seed >> 8 ) & 1023;
+            if( ( seed >> 20 ) % 1000 == 0 )
+            {
+                l.write_lock();
+                map[ key ] = i;
+                l.write_unlock();
+            }
+            else
+            {
+                l.read_lock();
+                sum += map.find( key )->second;
+                l.read_unlock();
+            }
+        }
+        sink = sum;
+    }
+};
+
+template< typename L >
+static double bench_rw( int n, long total )
+{
+    rw_task< L > task;
+    for( int i = 0; i < 1024; ++i )
+    {
+        task.map[i] = i;
+    }
+    task.per = total / n;
+    double t = run_threads( n, task );
+    return t * 1e9 / ( task.per * n );
+}
+
+
+/**
+ * 生产者消费者
+ * sem: 线程池原来的做法 locker保护队列 sem计数 消费者凭sem的计数取
+ * pthread: pthread_mutex加pthread_cond 带谓词等待
+ * cond_var: spin_locker加cond_var
+ * locker.h中的cond自带互斥锁 wait前后自己加解锁 不能在同一把锁下检查谓词 没法正确地用在这里 不列出
+ */
+struct pc_sem
+{
+    locker l;
+    sem s;
+    std::vector< long > queue;
+    long per;
+    long total;
+    long got;
+    int producers;
+    int consumers;
+
+    void operator()( int id )
+    {
+        if( id < producers )
+        {
+            for( long i = 0; i < per; ++i )
+            {
+                l.lock();
+                queue.push_back( i );
+                l.unlock();
+                s.post();
+            }
+            return;
+        }
+        while( true )
+        {
+            s.wait();
+            l.lock();
+            if( queue.empty() )
+            {
+                l.unlock();
+                break;
+            }
+            queue.pop_back();
+            bool last = ( ++got == total );
+            l.unlock();
+            /*最后一个元素取走后 多post几次让其余消费者看到空队列退出*/
+            if( last )
+            {
+                for( int k = 0; k < consumers; ++k )
+                {
+                    s.post();
+                }
+            }
+        }
+    }
+};
+
+struct pc_pthread
+{
+    pthread_mutex_t l;
+    pthread_cond_t c;
+    std::vector< long > queue;
+    long per;
+    long total;
+    long got;
+    bool finished;
+    int producers;
+
+    pc_pthread() : got( 0 ), finished( false )
+    {
+        pthread_mutex_init( &l, NULL );
+        pthread_cond_init( &c, NULL );
+    }
+
+    ~pc_pthread()
+    {
+        pthread_cond_destroy( &c );
+        pthread_mutex_destroy( &l );
+    }
+
+    void operator()( int id )
+    {
+        if( id < producers )
+        {
+            for( long i = 0; i < per; ++i )
+            {
+                pthread_mutex_lock( &l );
+                queue.push_back( i );
+                pthread_mutex_unlock( &l );
+                pthread_cond_signal( &c );
+            }
+            return;
+        }
+        pthread_mutex_lock( &l );
+        while( true )
+        {
+            while( queue.empty() && ! finished )
+            {
+                pthread_cond_wait( &c, &l );
+            }
+            if( queue.empty() )
+            {
+                break;
+            }
+            queue.pop_back();
+            if( ++got == total )
+            {
+                finished = true;
+                pthread_cond_broadcast( &c );
+            }
+        }
+        pthread_mutex_unlock( &l );
+    }
+};
+
+struct pc_cond_var
+{
+    spin_locker l;
+    cond_var c;
+    std::vector< long > queue;
+    long per;
+    long total;
+    long got;
+    bool finished;
+    int producers;
+
+    pc_cond_var() : got( 0 ), finished( false ) {}
+
+    void operator()( int id )
+    {
+        if( id < producers )
+        {
+            for( long i = 0; i < per; ++i )
+            {
+                l.lock();
+                queue.push_back( i );
+                l.unlock();
+                c.notify_one();
+            }
+            return;
+        }
+        l.lock();
+        while( true )
+        {
+            c.wait( l, [this]{ return ! queue.empty() || finished; } );
+            if( queue.empty() )
+            {
+                break;
+            }
+            queue.pop_back();
+            if( ++got == total )
+            {
+                finished = true;
+                c.notify_all();
+            }
+        }
+        l.unlock();
+    }
+};
+
+template< typename T >
+static double bench_pc( int n, long total )
+{
+    T task;
+    int consumers;
+    split( n, task.producers, consumers );
+    task.per = total / task.producers;
+    task.total = task.per * task.producers;
+    task.got = 0;
+    double t = run_threads( task.producers + consumers, task );
+    return t * 1e9 / task.total;
+}
+
+/*pc_sem要知道消费者数 单独设置*/
+static double bench_pc_sem( int n, long total )
+{
+    pc_sem task;
+    split( n, task.producers, task.consumers );
+    task.per = total / task.producers;
+    task.total = task.per * task.producers;
+    task.got = 0;
+    double t = run_threads( task.producers + task.consumers, task );
+    return t * 1e9 / task.total;
+}
+
+
+/*Vyukov的有界MPMC无锁队列 容量须是2的幂*/
+class mpmc_queue
+{
+public:
+    explicit mpmc_queue( int size ) : m_cells( new cell[ size ] ), m_mask( size - 1 ), m_head( 0 ), m_tail( 0 )
+    {
+        for( int i = 0; i < size; ++i )
+        {
+            m_cells[i].seq = i;
+        }
+    }
+
+    ~mpmc_queue()
+    {
+        delete [] m_cells;
+    }
+
+    bool push( long value )
+    {
+        unsigned long pos = __atomic_load_n( &m_head, __ATOMIC_RELAXED );
+        while( true )
+        {
+            cell& c = m_cells[ pos & m_mask ];
+            long diff = ( long )__atomic_load_n( &c.seq, __ATOMIC_ACQUIRE ) - ( long )pos;
+            if( diff == 0 )
+            {
+                if( __atomic_compare_exchange_n( &m_head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+                {
+                    c.value = value;
+                    __atomic_store_n( &c.seq, pos + 1, __ATOMIC_RELEASE );
+                    return true;
+                }
+            }
+            else if( diff < 0 )
+            {
+                return false;
+            }
+            else
+            {
+                pos = __atomic_load_n( &m_head, __ATOMIC_RELAXED );
+            }
+        }
+    }
+
+    bool pop( long& value )
+    {
+        unsigned long pos = __atomic_load_n( &m_tail, __ATOMIC_RELAXED );
+        while( true )
+        {
+            cell& c = m_cells[ pos & m_mask ];
+            long diff = ( long )__atomic_load_n( &c.seq, __ATOMIC_ACQUIRE ) - ( long )( pos + 1 );
+            if( diff == 0 )
+            {
+                if( __atomic_compare_exchange_n( &m_tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+                {
+                    value = c.value;
+                    __atomic_store_n( &c.seq, pos + m_mask + 1, __ATOMIC_RELEASE );
+                    return true;
+                }
+            }
+            else if( diff < 0 )
+            {
+                return false;
+            }
+            else
+            {
+                pos = __atomic_load_n( &m_tail, __ATOMIC_RELAXED );
+            }
+        }
+    }
+
+private:
+    /*C++11的new不保证超过16字节的对齐 用填充让相邻的格子不共享缓存行*/
+    struct cell
+    {
+        unsigned long seq;
+        long value;
+        char pad[ 64 - sizeof( unsigned long ) - sizeof( long ) ];
+    };
+
+    cell* m_cells;
+    unsigned long m_mask;
+    alignas( 64 ) unsigned long m_head;
+    alignas( 64 ) unsigned long m_tail;
+};
+
+/*无锁队列加sem 每放入一个post一次*/
+struct q_sem
+{
+    mpmc_queue queue;
+    sem s;
+    long per;
+    long total;
+    long got;
+    int producers;
+    int consumers;
+
+    q_sem() : queue( 1 << 16 ), got( 0 ) {}
+
+    void operator()( int id )
+    {
+        long value;
+        if( id < producers )
+        {
+            for( long i = 0; i < per; ++i )
+            {
+                while( ! queue.push( i ) )
+                {
+                    sched_yield();
+                }
+                s.post();
+            }
+            return;
+        }
+        while( true )
+        {
+            s.wait();
+            if( ! queue.pop( value ) )
+            {
+                break;
+            }
+            if( __atomic_add_fetch( &got, 1, __ATOMIC_RELAXED ) == total )
+            {
+                for( int k = 0; k < consumers; ++k )
+                {
+                    s.post();
+                }
+            }
+        }
+    }
+};
+
+/*无锁队列加event_count 没有等待者时通知不进内核*/
+struct q_event_count
+{
+    mpmc_queue queue;
+    event_count ec;
+    long per;
+    long total;
+    long got;
+    bool finished;
+    int producers;
+
+    q_event_count() : queue( 1 << 16 ), got( 0 ), finished( false ) {}
+
+    void take()
+    {
+        if( __atomic_add_fetch( &got, 1, __ATOMIC_RELAXED ) == total )
+        {
+            __atomic_store_n( &finished, true, __ATOMIC_SEQ_CST );
+            ec.notify_all();
+        }
+    }
+
+    void operator()( int id )
+    {
+        long value;
+        if( id < producers )
+        {
+            for( long i = 0; i < per; ++i )
+            {
+                while( ! queue.push( i ) )
+                {
+                    sched_yield();
+                }
+                ec.notify();
+            }
+            return;
+        }
+        while( true )
+        {
+            if( queue.pop( value ) )
+            {
+                take();
+                continue;
+            }
+            if( __atomic_load_n( &finished, __ATOMIC_SEQ_CST ) )
+            {
+                break;
+            }
+            int key = ec.prepare_wait();
+            if( queue.pop( value ) )
+            {
+                ec.cancel_wait();
+                take();
+                continue;
+            }
+            if( __atomic_load_n( &finished, __ATOMIC_SEQ_CST ) )
+            {
+                ec.cancel_wait();
+                break;
+            }
+            ec.wait( key );
+        }
+    }
+};
+
+static double bench_q_sem( int n, long total )
+{
+    q_sem task;
+    split( n, task.producers, task.consumers );
+    task.per = total / task.producers;
+    task.total = task.per * task.producers;
+    double t = run_threads( task.producers + task.consumers, task );
+    return t * 1e9 / task.total;
+}
+
+static double bench_q_event_count( int n, long total )
+{
+    q_event_count task;
+    int consumers;
+    split( n, task.producers, consumers );
+    task.per = total / task.producers;
+    task.total = task.per * task.producers;
+    double t = run_threads( task.producers + consumers, task );
+    return t * 1e9 / task.total;
+}
+
+
+int main( int argc, char* argv[] )
+{
+    long total = ( argc > 1 ) ? atol( argv[1] ) : 2000000;
+    int max_threads = ( argc > 2 ) ? atoi( argv[2] ) : 64;
+    if( total <= 0 || max_threads <= 0 )
+    {
+        printf( "usage: %s [total_ops] [max_threads]\n", argv[0] );
+        return 1;
+    }
+
+    printf( "%-8s %10s %10s %10s | %10s %10s %10s | %10s %10s %10s | %10s %10s\n",
+            "threads", "mutex:pth", "locker", "spin",
+            "rw:locker", "rw:pth", "rw_locker",
+            "pc:sem", "pc:pth", "cond_var",
+            "q:sem", "event_cnt" );
+    for( int n = 1; n <= max_threads; n *= 2 )
+    {
+        /*队列的几项每个元素要经过两个线程 次数取四分之一 总时间与其余几项相近*/
+        printf( "%-8d %10.1f %10.1f %10.1f | %10.1f %10.1f %10.1f | %10.1f %10.1f %10.1f | %10.1f %10.1f\n", n,
+                bench_mutex< pthread_mutex >( n, total ),
+                bench_mutex< locker >( n, total ),
+                bench_mutex< spin_locker >( n, total ),
+                bench_rw< rw_by_locker >( n, total ),
+                bench_rw< rw_by_pthread >( n, total ),
+                bench_rw< rw_locker >( n, total ),
+                bench_pc_sem( n, total / 4 ),
+                bench_pc< pc_pthread >( n, total / 4 ),
+                bench_pc< pc_cond_var >( n, total / 4 ),
+                bench_q_sem( n, total / 4 ),
+                bench_q_event_count( n, total / 4 ) );
+        fflush( stdout );
+    }
+    return 0;
+}
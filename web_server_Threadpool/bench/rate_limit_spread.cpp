@@ -0,0 +1,53 @@
+/**
+ * Created by 刘嘉辉 on 11/18/18.
+ * Copyright (c) 2018 刘嘉辉 All rights reserved.
+ * @brief To immplmente rate_limit_spread.cpp.
+ */
+
+/**
+ * 检查rate_limiter的分片: 同一个/16里的大量地址应当分散到很多片上 而不是挤满一片后都不受限制
+ * 不属于服务器本身 单独编译:
+ *     g++ -std=c++11 -O2 -o rate_limit_spread rate_limit_spread.cpp
+ *     ./rate_limit_spread [地址数]
+ * 取203.0.0.0/16里的前n个地址各连一次 打印占用的片数与不受限制的地址数 有不受限制的就返回1
+ */
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <set>
+#include "../rate_limit.h"
+
+int main( int argc, char* argv[] )
+{
+    int number = ( argc > 1 ) ? atoi( argv[1] ) : 1000;
+    if( number <= 0 || number > 65536 )
+    {
+        printf( "usage: %s [addresses(1-65536)]\n", argv[0] );
+        return 1;
+    }
+
+    rate_limiter limiter;
+    limiter.configure( 10, 10, 0 );
+
+    std::set< int > shards;
+    int unlimited = 0;
+    for( int i = 0; i < number; ++i )
+    {
+        sockaddr_in addr;
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl( ( 203u << 24 ) | ( unsigned int )i );
+        int slot = limiter.connect( addr );
+        if( slot < 0 )
+        {
+            ++unlimited;
+        }
+        else
+        {
+            shards.insert( slot / rate_limiter::SHARD_SLOTS );
+        }
+    }
+
+    printf( "addresses %d shards %d unlimited %d\n", number, ( int )shards.size(), unlimited );
+    return unlimited == 0 ? 0 : 1;
+}
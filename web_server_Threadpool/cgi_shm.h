@@ -0,0 +1,308 @@
+/**
+ * Created by 刘嘉辉 on 11/18/18.
+ * Copyright (c) 2018 刘嘉辉 All rights reserved.
+ * @brief To immplmente cgi_shm.h.
+ */
+
+#ifndef CGI_SHM_H
+#define CGI_SHM_H
+
+#include <vector>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include "locker.h"
+#include "../Process_pool/shm_channel.h"
+
+/**
+ * web服务器一侧的共享内存通道 协议见shm_channel.h
+ * 工作线程在connect_cgi中取槽 填好程序路径与请求体后放进对应子进程的requests并敲门铃
+ * 主线程(主从模式下是当时的leader)第一次为该连接调用cgi_forward时登记槽的主人 之后子进程敲web的门铃时
+ * dispatch取出ready中的槽号 交给主人的cgi_forward 直接从共享内存发给客户
+ * 取槽 放消息由m_locker保护
+ * 主人表的项用原子操作读写: release可能在工作线程(关闭连接时)调用 与主线程的dispatch同时进行
+ * 登记了主人之后 连接只由运行dispatch的线程驱动 工作线程只会release还没有登记主人的槽 dispatch不会用到已关闭的连接
+ * 槽在程序结束(eof)之后才回收: 连接提前放弃时先置aborted 由release或dispatch中先看到eof的一方回收
+ * T需要实现cgi_forward()与close_conn()
+ */
+template< typename T >
+class cgi_channel
+{
+public:
+    cgi_channel() : m_region( NULL ), m_size( 0 ), m_child_number( 0 ), m_ctlfd( -1 ), m_doorbell( -1 ), m_dead( false ), m_locker( "cgi_shm" ) {}
+
+    ~cgi_channel()
+    {
+        for( size_t i = 0; i < m_child_doorbells.size(); ++i )
+        {
+            close( m_child_doorbells[i] );
+        }
+        if( m_doorbell != -1 )
+        {
+            close( m_doorbell );
+        }
+        if( m_ctlfd != -1 )
+        {
+            close( m_ctlfd );
+        }
+        if( m_region )
+        {
+            munmap( m_region, m_size );
+        }
+    }
+
+    /*连上进程池的控制socket 建好共享内存并把描述符交给它 失败时继续走TCP*/
+    bool attach( const char* path )
+    {
+        struct sockaddr_un address;
+        bzero( &address, sizeof( address ) );
+        address.sun_family = AF_UNIX;
+        strncpy( address.sun_path, path, sizeof( address.sun_path ) - 1 );
+        m_ctlfd = socket( PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+        if( m_ctlfd < 0 || connect( m_ctlfd, ( struct sockaddr* )&address, sizeof( address ) ) < 0 )
+        {
+            return false;
+        }
+        struct timeval timeout = { 1, 0 };
+        setsockopt( m_ctlfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout ) );
+        /*已有别的web服务器接入时对方直接关闭*/
+        if( recv( m_ctlfd, &m_child_number, sizeof( m_child_number ), MSG_WAITALL ) != sizeof( m_child_number )
+            || m_child_number <= 0 || m_child_number > 62 )
+        {
+            return false;
+        }
+
+        m_size = shm_region_size( m_child_number );
+        int memfd = memfd_create( "cgi_shm", MFD_CLOEXEC );
+        if( memfd < 0 || ftruncate( memfd, m_size ) < 0 )
+        {
+            if( memfd >= 0 )
+            {
+                close( memfd );
+            }
+            return false;
+        }
+        void* address_map = mmap( NULL, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0 );
+        if( address_map == MAP_FAILED )
+        {
+            close( memfd );
+            return false;
+        }
+        m_region = ( shm_region* )address_map;
+        m_region->magic = SHM_MAGIC;
+        m_region->child_number = m_child_number;
+
+        m_doorbell = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+        std::vector< int > fds;
+        fds.push_back( memfd );
+        fds.push_back( m_doorbell );
+        for( int i = 0; i < m_child_number; ++i )
+        {
+            int doorbell = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+            m_child_doorbells.push_back( doorbell );
+            fds.push_back( doorbell );
+        }
+        bool ok = m_doorbell >= 0 && m_child_doorbells.back() >= 0 && shm_send_fds( m_ctlfd, 0, &fds[0], fds.size() );
+        close( memfd );
+        if( ! ok )
+        {
+            return false;
+        }
+
+        int slot_number = m_child_number * SHM_SLOTS;
+        m_owners.assign( slot_number, ( T* )NULL );
+        m_aborted.assign( slot_number, 0 );
+        /*倒着放 依次取到的槽轮流属于各个子进程*/
+        for( int i = SHM_SLOTS - 1; i >= 0; --i )
+        {
+            for( int c = m_child_number - 1; c >= 0; --c )
+            {
+                m_free.push_back( c * SHM_SLOTS + i );
+            }
+        }
+        fcntl( m_ctlfd, F_SETFL, fcntl( m_ctlfd, F_GETFL ) | O_NONBLOCK );
+        return true;
+    }
+
+    /*子进程写这个eventfd 由主线程的epoll监听*/
+    int doorbell() const { return m_doorbell; }
+    /*进程池退出时可读(EOF)*/
+    int control() const { return m_ctlfd; }
+    bool dead() const { return __atomic_load_n( &m_dead, __ATOMIC_ACQUIRE ); }
+
+    /*取一个空闲槽 没有时返回-1 调用者改走TCP*/
+    int reserve()
+    {
+        int id = -1;
+        m_locker.lock();
+        if( ! m_dead && ! m_free.empty() )
+        {
+            id = m_free.back();
+            m_free.pop_back();
+        }
+        m_locker.unlock();
+        if( id >= 0 )
+        {
+            shm_slot& s = slot( id );
+            s.out_head = 0;
+            s.out_tail = 0;
+            s.eof = 0;
+            s.notified = 0;
+            s.waiting = 0;
+        }
+        return id;
+    }
+
+    shm_slot& slot( int id )
+    {
+        return shm_children( m_region )[ id / SHM_SLOTS ].slots[ id % SHM_SLOTS ];
+    }
+
+    /*程序路径与请求体已填好 交给子进程*/
+    void start( int id )
+    {
+        send_message( id, SHM_START );
+    }
+
+    /*环中可发送的连续一段*/
+    int readable( int id, const char** data )
+    {
+        shm_slot& s = slot( id );
+        unsigned long tail = s.out_tail;
+        unsigned long used = __atomic_load_n( &s.out_head, __ATOMIC_SEQ_CST ) - tail;
+        unsigned long offset = tail % SHM_OUT_SIZE;
+        *data = s.out + offset;
+        return ( used < SHM_OUT_SIZE - offset ) ? used : SHM_OUT_SIZE - offset;
+    }
+
+    /*程序的输出都已发完*/
+    bool finished( int id )
+    {
+        shm_slot& s = slot( id );
+        return __atomic_load_n( &s.eof, __ATOMIC_SEQ_CST ) && __atomic_load_n( &s.out_head, __ATOMIC_SEQ_CST ) == s.out_tail;
+    }
+
+    /*n字节已经发给客户 腾出空间 子进程因为环满停下时叫醒它*/
+    void consume( int id, int n )
+    {
+        shm_slot& s = slot( id );
+        __atomic_store_n( &s.out_tail, s.out_tail + n, __ATOMIC_SEQ_CST );
+        if( __atomic_exchange_n( &s.waiting, 0, __ATOMIC_SEQ_CST ) )
+        {
+            eventfd_write( m_child_doorbells[ id / SHM_SLOTS ], 1 );
+        }
+    }
+
+    /*主线程或leader 之后该槽的通知交给owner*/
+    void set_owner( int id, T* owner )
+    {
+        __atomic_store_n( &m_owners[ id ], owner, __ATOMIC_RELEASE );
+    }
+
+    /**
+     * 连接不再使用该槽 工作线程中关闭连接时也会调用
+     * 程序已经结束就直接回收 否则通知子进程放弃 等它置eof的通知到来时再回收
+     */
+    void release( int id )
+    {
+        __atomic_store_n( &m_owners[ id ], ( T* )NULL, __ATOMIC_SEQ_CST );
+        __atomic_store_n( &m_aborted[ id ], 1, __ATOMIC_SEQ_CST );
+        if( __atomic_load_n( &slot( id ).eof, __ATOMIC_SEQ_CST ) || dead() )
+        {
+            reclaim( id );
+            return;
+        }
+        send_message( id, SHM_ABORT );
+    }
+
+    /*门铃响了 把各子进程ready中的槽交给主人*/
+    void dispatch()
+    {
+        eventfd_t value;
+        eventfd_read( m_doorbell, &value );
+        for( int c = 0; c < m_child_number; ++c )
+        {
+            unsigned int msg;
+            while( shm_pop( shm_children( m_region )[c].ready, msg ) )
+            {
+                int id = c * SHM_SLOTS + ( msg & 0xffff );
+                if( id >= ( int )m_owners.size() )
+                {
+                    continue;
+                }
+                /*先清零再读数据 之后的输出一定会再来一条通知*/
+                __atomic_store_n( &slot( id ).notified, 0, __ATOMIC_SEQ_CST );
+                T* owner = __atomic_load_n( &m_owners[ id ], __ATOMIC_ACQUIRE );
+                if( owner )
+                {
+                    if( ! owner->cgi_forward() )
+                    {
+                        owner->close_conn();
+                    }
+                }
+                else if( __atomic_load_n( &slot( id ).eof, __ATOMIC_SEQ_CST ) )
+                {
+                    reclaim( id );
+                }
+            }
+        }
+    }
+
+    /*进程池退出了 在途的cgi连接都关掉 以后的请求走TCP(同样会失败)*/
+    void shutdown()
+    {
+        __atomic_store_n( &m_dead, true, __ATOMIC_RELEASE );
+        for( size_t id = 0; id < m_owners.size(); ++id )
+        {
+            T* owner = __atomic_load_n( &m_owners[ id ], __ATOMIC_ACQUIRE );
+            if( owner )
+            {
+                owner->close_conn();
+            }
+        }
+    }
+
+private:
+    void send_message( int id, int type )
+    {
+        shm_child& child = shm_children( m_region )[ id / SHM_SLOTS ];
+        m_locker.lock();
+        shm_push( child.requests, ( id % SHM_SLOTS ) | ( type << 16 ) );
+        m_locker.unlock();
+        eventfd_write( m_child_doorbells[ id / SHM_SLOTS ], 1 );
+    }
+
+    /*release与dispatch都可能看到eof 只有清掉aborted的一方回收*/
+    void reclaim( int id )
+    {
+        if( __atomic_exchange_n( &m_aborted[ id ], 0, __ATOMIC_SEQ_CST ) )
+        {
+            m_locker.lock();
+            m_free.push_back( id );
+            m_locker.unlock();
+        }
+    }
+
+private:
+    shm_region* m_region;
+    size_t m_size;
+    int m_child_number;
+    int m_ctlfd;
+    int m_doorbell;
+    std::vector< int > m_child_doorbells;
+    /*空闲槽号*/
+    std::vector< int > m_free;
+    /*槽号到主人 没有主人时为NULL 都用原子操作访问*/
+    std::vector< T* > m_owners;
+    /*连接已经放弃 等程序结束后回收*/
+    std::vector< char > m_aborted;
+    bool m_dead;
+    locker m_locker;
+};
+
+#endif
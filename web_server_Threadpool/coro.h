@@ -0,0 +1,390 @@
+/**
+ * Created by 刘嘉辉 on 11/12/18.
+ * Copyright (c) 2018 刘嘉辉 All rights reserved.
+ * @brief To immplmente coro.h.
+ */
+
+#ifndef CORO_H
+#define CORO_H
+
+/**
+ * 基于C++20协程的连接处理运行时 需要 -std=c++20 编译 否则整个文件为空
+ *
+ * 协程在主线程的epoll上等待 fd不可读/写时挂起 不占用任何线程
+ * 事件到来时主循环调用coro_reactor::dispatch恢复对应协程
+ *
+ *     coro_detached handler( int fd )
+ *     {
+ *         char buf[ 1024 ];
+ *         ssize_t n = co_await coro_read_some( fd, buf, sizeof( buf ) );
+ *         co_await coro_write_all( fd, buf, n );
+ *     }
+ *
+ * 协程帧从按大小分级的空闲链表中分配 只在主线程使用 不加锁
+ */
+#if defined( __cpp_impl_coroutine )
+
+#include <coroutine>
+#include <exception>
+#include <unordered_map>
+#include <vector>
+#include <new>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+/*协程帧的对象池 FRAME_CLASS字节一级 更大的帧直接走全局分配器*/
+class coro_frame_pool
+{
+public:
+    static const size_t FRAME_CLASS = 256;
+    static const int CLASS_NUMBER = 16;
+
+public:
+    static void* alloc( size_t size )
+    {
+        size_t idx = ( size + FRAME_CLASS - 1 ) / FRAME_CLASS;
+        if( idx >= ( size_t )CLASS_NUMBER )
+        {
+            return ::operator new( size );
+        }
+        node*& head = m_free[ idx ];
+        if( head )
+        {
+            node* n = head;
+            head = n->next;
+            return n;
+        }
+        return ::operator new( idx * FRAME_CLASS );
+    }
+
+    static void free( void* p, size_t size )
+    {
+        size_t idx = ( size + FRAME_CLASS - 1 ) / FRAME_CLASS;
+        if( idx >= ( size_t )CLASS_NUMBER )
+        {
+            ::operator delete( p );
+            return;
+        }
+        node* n = static_cast< node* >( p );
+        n->next = m_free[ idx ];
+        m_free[ idx ] = n;
+    }
+
+private:
+    struct node
+    {
+        node* next;
+    };
+    static inline thread_local node* m_free[ CLASS_NUMBER ] = {};
+};
+
+
+/**
+ * fd到挂起协程的登记表
+ * 以EPOLLONESHOT注册 恢复一次后自动失效 协程需要时再次登记
+ * 等待可以带期限 主线程每轮调用expire 过了期限的等待被恢复 由等待者看到超时
+ */
+class coro_reactor
+{
+public:
+    /*expire真正扫描登记表的间隔 也是期限的精度*/
+    static const int EXPIRE_INTERVAL_MS = 1000;
+
+public:
+    static void set_epollfd( int epollfd )
+    {
+        m_epollfd = epollfd;
+    }
+
+    static long long now_ms()
+    {
+        struct timespec ts;
+        clock_gettime( CLOCK_MONOTONIC_COARSE, &ts );
+        return ( long long )ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    /*deadline_ms为0时不限时*/
+    static void wait( int fd, unsigned int events, std::coroutine_handle<> h, long long deadline_ms = 0 )
+    {
+        waiter& w = m_waiters[ fd ];
+        w.handle = h;
+        w.deadline_ms = deadline_ms;
+        w.expired = false;
+        epoll_event event;
+        event.data.fd = fd;
+        event.events = events | EPOLLONESHOT | EPOLLRDHUP;
+        if( epoll_ctl( m_epollfd, w.added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &event ) == 0 )
+        {
+            w.added = true;
+        }
+    }
+
+    /*fd上有协程在等待则恢复它并返回true*/
+    static bool dispatch( int fd )
+    {
+        std::unordered_map< int, waiter >::iterator it = m_waiters.find( fd );
+        if( it == m_waiters.end() || ! it->second.handle )
+        {
+            return false;
+        }
+        std::coroutine_handle<> h = it->second.handle;
+        it->second.handle = nullptr;
+        h.resume();
+        return true;
+    }
+
+    /*上一次等待是否因为超时结束 取走这个标志*/
+    static bool expired( int fd )
+    {
+        std::unordered_map< int, waiter >::iterator it = m_waiters.find( fd );
+        if( it == m_waiters.end() || ! it->second.expired )
+        {
+            return false;
+        }
+        it->second.expired = false;
+        return true;
+    }
+
+    /**
+     * 恢复过了期限的等待 每EXPIRE_INTERVAL_MS才扫描一遍登记表
+     * 先收集再恢复 恢复的协程会关闭fd 从登记表中删掉自己
+     */
+    static void expire()
+    {
+        long long now = now_ms();
+        if( now < m_next_expire )
+        {
+            return;
+        }
+        m_next_expire = now + EXPIRE_INTERVAL_MS;
+        std::vector< std::coroutine_handle<> > due;
+        for( std::unordered_map< int, waiter >::iterator it = m_waiters.begin(); it != m_waiters.end(); ++it )
+        {
+            waiter& w = it->second;
+            if( w.handle && w.deadline_ms != 0 && w.deadline_ms <= now )
+            {
+                w.expired = true;
+                due.push_back( w.handle );
+                w.handle = nullptr;
+            }
+        }
+        for( size_t i = 0; i < due.size(); ++i )
+        {
+            due[i].resume();
+        }
+    }
+
+    /*关闭fd之前调用*/
+    static void forget( int fd )
+    {
+        std::unordered_map< int, waiter >::iterator it = m_waiters.find( fd );
+        if( it != m_waiters.end() )
+        {
+            if( it->second.added )
+            {
+                epoll_ctl( m_epollfd, EPOLL_CTL_DEL, fd, 0 );
+            }
+            m_waiters.erase( it );
+        }
+    }
+
+private:
+    struct waiter
+    {
+        std::coroutine_handle<> handle;
+        long long deadline_ms = 0;
+        bool expired = false;
+        bool added = false;
+    };
+    static inline int m_epollfd = -1;
+    static inline long long m_next_expire = 0;
+    static inline std::unordered_map< int, waiter > m_waiters;
+};
+
+
+/**
+ * co_await coro_wait_fd{ fd, EPOLLIN } 挂起直到fd就绪
+ * 带deadline_ms时到了期限也会恢复 co_await的结果为false表示超时
+ */
+struct coro_wait_fd
+{
+    int fd;
+    unsigned int events;
+    long long deadline_ms;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend( std::coroutine_handle<> h ) { coro_reactor::wait( fd, events, h, deadline_ms ); }
+    bool await_resume() const { return deadline_ms == 0 || ! coro_reactor::expired( fd ); }
+};
+
+
+/**
+ * 可被co_await的惰性协程 返回T
+ * 结束时通过对称转移恢复等待它的协程
+ */
+template< typename T >
+class coro_task
+{
+public:
+    struct promise_type
+    {
+        T m_value{};
+        std::coroutine_handle<> m_continuation;
+
+        coro_task get_return_object() { return coro_task( std::coroutine_handle< promise_type >::from_promise( *this ) ); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        struct final_awaiter
+        {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend( std::coroutine_handle< promise_type > h ) noexcept
+            {
+                std::coroutine_handle<> next = h.promise().m_continuation;
+                return next ? next : std::noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+        final_awaiter final_suspend() noexcept { return {}; }
+
+        void return_value( T value ) { m_value = value; }
+        void unhandled_exception() { std::terminate(); }
+
+        static void* operator new( size_t size ) { return coro_frame_pool::alloc( size ); }
+        static void operator delete( void* p, size_t size ) { coro_frame_pool::free( p, size ); }
+    };
+
+public:
+    explicit coro_task( std::coroutine_handle< promise_type > h ) : m_handle( h ) {}
+    coro_task( coro_task&& other ) noexcept : m_handle( other.m_handle ) { other.m_handle = nullptr; }
+    coro_task( const coro_task& ) = delete;
+    ~coro_task()
+    {
+        if( m_handle )
+        {
+            m_handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend( std::coroutine_handle<> caller )
+    {
+        m_handle.promise().m_continuation = caller;
+        return m_handle;
+    }
+    T await_resume() { return m_handle.promise().m_value; }
+
+private:
+    std::coroutine_handle< promise_type > m_handle;
+};
+
+
+/*立即开始执行 结束后自行销毁的协程 用作每个连接的入口*/
+struct coro_detached
+{
+    struct promise_type
+    {
+        coro_detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+
+        static void* operator new( size_t size ) { return coro_frame_pool::alloc( size ); }
+        static void operator delete( void* p, size_t size ) { coro_frame_pool::free( p, size ); }
+    };
+};
+
+
+/**
+ * 读到至少一个字节 返回读到的字节数 0表示对端关闭 -1表示出错
+ * deadline_ms是coro_reactor::now_ms()时钟上的期限 过了期限还没有数据时返回-1 errno为ETIMEDOUT 为0时不限时
+ */
+inline coro_task< ssize_t > coro_read_some( int fd, char* buf, size_t len, long long deadline_ms = 0 )
+{
+    while( true )
+    {
+        ssize_t ret = recv( fd, buf, len, 0 );
+        if( ret >= 0 || ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) )
+        {
+            co_return ret;
+        }
+        if( ! co_await coro_wait_fd{ fd, EPOLLIN, deadline_ms } )
+        {
+            errno = ETIMEDOUT;
+            co_return -1;
+        }
+    }
+}
+
+/*全部写完返回len 出错返回-1*/
+inline coro_task< ssize_t > coro_write_all( int fd, const char* buf, size_t len )
+{
+    size_t sent = 0;
+    while( sent < len )
+    {
+        ssize_t ret = send( fd, buf + sent, len - sent, MSG_NOSIGNAL );
+        if( ret >= 0 )
+        {
+            sent += ret;
+            continue;
+        }
+        if( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+        {
+            co_return -1;
+        }
+        co_await coro_wait_fd{ fd, EPOLLOUT, 0 };
+    }
+    co_return ( ssize_t )len;
+}
+
+/*把文件in从offset开始的count字节零拷贝发到out 返回发送的字节数 出错返回-1*/
+inline coro_task< ssize_t > coro_sendfile( int out, int in, off_t offset, size_t count )
+{
+    size_t sent = 0;
+    while( sent < count )
+    {
+        ssize_t ret = sendfile( out, in, &offset, count - sent );
+        if( ret > 0 )
+        {
+            sent += ret;
+            continue;
+        }
+        if( ret == 0 )
+        {
+            break;
+        }
+        if( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+        {
+            co_return -1;
+        }
+        co_await coro_wait_fd{ out, EPOLLOUT, 0 };
+    }
+    co_return ( ssize_t )sent;
+}
+
+/*非阻塞连接 fd须为非阻塞socket 成功返回0 失败返回错误码*/
+inline coro_task< int > coro_connect( int fd, const struct sockaddr* addr, socklen_t len )
+{
+    if( connect( fd, addr, len ) == 0 )
+    {
+        co_return 0;
+    }
+    if( errno != EINPROGRESS )
+    {
+        co_return errno;
+    }
+    co_await coro_wait_fd{ fd, EPOLLOUT, 0 };
+    int error = 0;
+    socklen_t error_len = sizeof( error );
+    getsockopt( fd, SOL_SOCKET, SO_ERROR, &error, &error_len );
+    co_return error;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,155 @@
+/**
+ * Created by 刘嘉辉 on 11/12/18.
+ * Copyright (c) 2018 刘嘉辉 All rights reserved.
+ * @brief To immplmente coro_conn.h.
+ */
+
+#ifndef CORO_CONN_H
+#define CORO_CONN_H
+
+#include "coro.h"
+
+#if defined( __cpp_impl_coroutine )
+
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "http_conn.h"
+#include "stats.h"
+
+extern const char* doc_root;
+
+/**
+ * 用协程写成的静态文件连接处理 与http_conn的状态机等价的直线逻辑
+ * 读请求头 -> 定位文件 -> 写头部 -> sendfile -> keep-alive时继续下一个请求
+ * 挂起期间不占用线程 由主线程的epoll恢复
+ * limit_slot是m_limits中该客户IP的槽号 每个请求消耗一个令牌 连接结束时归还
+ * 只处理不带请求体的GET 带请求体的回400后关闭
+ */
+inline coro_detached coro_serve_conn( int fd, int limit_slot )
+{
+    static const int READ_BUFFER_SIZE = 2048;
+    /*等一个完整请求头的最长时间 keep-alive连接上两个请求之间的空闲也算在内*/
+    static const int IDLE_TIMEOUT_MS = 30000;
+    static const char bad[] = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    char buf[ READ_BUFFER_SIZE ];
+    /*buf中已读入的字节数 以及其中已经处理完的请求头的长度 之后的是流水线上的下一个请求*/
+    size_t used = 0;
+    size_t consumed = 0;
+    __atomic_fetch_add( &http_conn::m_user_count, 1, __ATOMIC_RELAXED );
+
+    bool keep_alive = true;
+    while( keep_alive )
+    {
+        if( consumed > 0 )
+        {
+            memmove( buf, buf + consumed, used - consumed );
+            used -= consumed;
+            consumed = 0;
+        }
+        buf[ used ] = '\0';
+
+        /*读到空行为止*/
+        long long deadline = coro_reactor::now_ms() + IDLE_TIMEOUT_MS;
+        char* end = strstr( buf, "\r\n\r\n" );
+        while( ! end )
+        {
+            if( used >= sizeof( buf ) - 1 )
+            {
+                break;
+            }
+            ssize_t n = co_await coro_read_some( fd, buf + used, sizeof( buf ) - 1 - used, deadline );
+            if( n <= 0 )
+            {
+                break;
+            }
+            used += n;
+            buf[ used ] = '\0';
+            end = strstr( buf, "\r\n\r\n" );
+        }
+        if( ! end )
+        {
+            break;
+        }
+        consumed = end + 4 - buf;
+        *end = '\0';
+
+        /*请求行 GET url HTTP/1.1*/
+        char* url = strchr( buf, ' ' );
+        char* version = url ? strchr( url + 1, ' ' ) : NULL;
+        char* line_end = strstr( buf, "\r\n" );
+        if( ! version || strncasecmp( buf, "GET ", 4 ) != 0 || url[1] != '/' )
+        {
+            co_await coro_write_all( fd, bad, sizeof( bad ) - 1 );
+            break;
+        }
+
+        /*不读请求体 留在buf里会被当成下一个请求*/
+        if( line_end )
+        {
+            const char* length = strcasestr( line_end, "\r\nContent-Length:" );
+            char* digits_end = NULL;
+            if( strcasestr( line_end, "\r\nTransfer-Encoding:" )
+                || ( length && ( strtol( length + 17, &digits_end, 10 ) != 0 || digits_end == length + 17 ) ) )
+            {
+                co_await coro_write_all( fd, bad, sizeof( bad ) - 1 );
+                break;
+            }
+        }
+
+        /*该客户IP的令牌用完 回429后关闭*/
+        if( ! http_conn::m_limits.allow( limit_slot ) )
+        {
+            static const char limited[] = "HTTP/1.1 429 Too Many Requests\r\nRetry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            STAT_INC( limit_requests );
+            co_await coro_write_all( fd, limited, sizeof( limited ) - 1 );
+            break;
+        }
+
+        *version = '\0';
+        ++url;
+        keep_alive = line_end && strcasestr( line_end, "\r\nConnection: keep-alive" ) != NULL;
+
+        char path[ http_conn::FILENAME_LEN ];
+        snprintf( path, sizeof( path ), "%s%s", doc_root, url );
+        int file = open( path, O_RDONLY | O_CLOEXEC );
+        struct stat st;
+        if( file < 0 || fstat( file, &st ) < 0 || ! S_ISREG( st.st_mode ) || ! ( st.st_mode & S_IROTH ) )
+        {
+            if( file >= 0 )
+            {
+                close( file );
+            }
+            char head[ 128 ];
+            int len = snprintf( head, sizeof( head ), "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: %s\r\n\r\n",
+                                keep_alive ? "keep-alive" : "close" );
+            if( co_await coro_write_all( fd, head, len ) < 0 )
+            {
+                break;
+            }
+            continue;
+        }
+
+        char head[ 128 ];
+        int len = snprintf( head, sizeof( head ), "HTTP/1.1 200 OK\r\nContent-Length: %ld\r\nConnection: %s\r\n\r\n",
+                            ( long )st.st_size, keep_alive ? "keep-alive" : "close" );
+        bool ok = co_await coro_write_all( fd, head, len ) == len
+                  && co_await coro_sendfile( fd, file, 0, st.st_size ) == st.st_size;
+        close( file );
+        if( ! ok )
+        {
+            break;
+        }
+    }
+
+    coro_reactor::forget( fd );
+    close( fd );
+    http_conn::m_limits.disconnect( limit_slot );
+    __atomic_fetch_sub( &http_conn::m_user_count, 1, __ATOMIC_RELAXED );
+}
+
+#endif
+
+#endif
@@ -0,0 +1,440 @@
+/**
+ * Created by 刘嘉辉 on 11/10/18.
+ * Copyright (c) 2018 刘嘉辉 All rights reserved.
+ * @brief To immplmente file_cache.h.
+ */
+
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <string>
+#include <memory>
+#include <list>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "locker.h"
+#include "stats.h"
+#include "io_policy.h"
+#include "request_arena.h"
+
+/**
+ * 小文件应答的内存区 从CHUNK_SIZE的大块中按2的幂切出定长块
+ * 大块按CHUNK_SIZE对齐 块的地址去掉低位就是所属的大块 每个大块记着级别 已用块数和自己的空闲链表
+ * 大块上的块全部归还后整块放回空闲大块 任何级别都可以重新切分 不会被最先用到它的级别一直占着
+ * 大块的总量不超过预算 所以预算就是小文件缓存占用内存的上限
+ * 打开大页时大块从按2MB对齐 MADV_HUGEPAGE的区域中切出 热点应答少占TLB
+ */
+class small_arena
+{
+public:
+    static const int CLASS_MIN = 512;
+    static const int CLASS_NUMBER = 10;
+    static const int CHUNK_SIZE = 256 * 1024;
+    /*最大的块 CLASS_MIN << ( CLASS_NUMBER - 1 ) 正好是一个大块*/
+    static const int MAX_BLOCK = CHUNK_SIZE;
+
+public:
+    small_arena() : m_budget( 0 ), m_reserved( 0 ), m_huge( false ), m_region_left( 0 ), m_locker( "file_cache_arena" ) {}
+    ~small_arena()
+    {
+        for ( size_t i = 0; i < m_chunks.size(); ++i )
+        {
+            ::free( m_chunks[i] );
+        }
+        for ( size_t i = 0; i < m_regions.size(); ++i )
+        {
+            ::free( m_regions[i] );
+        }
+    }
+
+    void set_huge_pages( bool huge )
+    {
+        m_locker.lock();
+        m_huge = huge;
+        m_locker.unlock();
+    }
+
+    void set_budget( long budget )
+    {
+        m_locker.lock();
+        m_budget = budget;
+        m_locker.unlock();
+    }
+
+    /*size所属的级别 超过MAX_BLOCK返回-1*/
+    static int class_of( int size )
+    {
+        int cls = 0;
+        while ( cls < CLASS_NUMBER && ( CLASS_MIN << cls ) < size )
+        {
+            ++cls;
+        }
+        return ( cls < CLASS_NUMBER ) ? cls : -1;
+    }
+
+    /*取一块 本级别没有空闲块 没有空闲大块且预算用完时返回NULL*/
+    char* alloc( int cls )
+    {
+        char* block = NULL;
+        m_locker.lock();
+        if ( m_partial[ cls ].empty() )
+        {
+            char* chunk = NULL;
+            if ( ! m_spare.empty() )
+            {
+                chunk = m_spare.back();
+                m_spare.pop_back();
+            }
+            else if ( m_reserved + CHUNK_SIZE <= m_budget && ( chunk = new_chunk() ) )
+            {
+                m_reserved += CHUNK_SIZE;
+            }
+            if ( chunk )
+            {
+                carve( chunk, cls );
+            }
+        }
+        if ( ! m_partial[ cls ].empty() )
+        {
+            chunk_info& info = m_info[ m_partial[ cls ].back() ];
+            block = info.free_head;
+            info.free_head = *( char** )block;
+            ++info.used;
+            if ( ! info.free_head )
+            {
+                m_partial[ cls ].pop_back();
+            }
+        }
+        m_locker.unlock();
+        return block;
+    }
+
+    void free( char* block )
+    {
+        m_locker.lock();
+        char* chunk = chunk_of( block );
+        chunk_info& info = m_info[ chunk ];
+        if ( ! info.free_head )
+        {
+            m_partial[ info.cls ].push_back( chunk );
+        }
+        *( char** )block = info.free_head;
+        info.free_head = block;
+        if ( --info.used == 0 )
+        {
+            std::vector< char* >& partial = m_partial[ info.cls ];
+            *std::find( partial.begin(), partial.end(), chunk ) = partial.back();
+            partial.pop_back();
+            m_spare.push_back( chunk );
+        }
+        m_locker.unlock();
+    }
+
+private:
+    struct chunk_info
+    {
+        int cls;
+        int used;
+        /*空闲块的开头存着下一个空闲块*/
+        char* free_head;
+    };
+
+    static char* chunk_of( char* block )
+    {
+        return ( char* )( ( uintptr_t )block & ~( uintptr_t )( CHUNK_SIZE - 1 ) );
+    }
+
+    /*调用时持有m_locker 把整个大块切成cls级别的块*/
+    void carve( char* chunk, int cls )
+    {
+        chunk_info& info = m_info[ chunk ];
+        info.cls = cls;
+        info.used = 0;
+        info.free_head = NULL;
+        int block_size = CLASS_MIN << cls;
+        for ( int off = CHUNK_SIZE - block_size; off >= 0; off -= block_size )
+        {
+            *( char** )( chunk + off ) = info.free_head;
+            info.free_head = chunk + off;
+        }
+        m_partial[ cls ].push_back( chunk );
+    }
+
+    /*调用时持有m_locker*/
+    char* new_chunk()
+    {
+        if ( ! m_huge )
+        {
+            void* chunk = NULL;
+            if ( posix_memalign( &chunk, CHUNK_SIZE, CHUNK_SIZE ) != 0 )
+            {
+                return NULL;
+            }
+            m_chunks.push_back( ( char* )chunk );
+            return ( char* )chunk;
+        }
+        if ( m_region_left == 0 )
+        {
+            char* region = alloc_huge( HUGE_PAGE_SIZE );
+            if ( ! region )
+            {
+                return NULL;
+            }
+            m_regions.push_back( region );
+            m_region_left = HUGE_PAGE_SIZE / CHUNK_SIZE;
+        }
+        --m_region_left;
+        return m_regions.back() + m_region_left * CHUNK_SIZE;
+    }
+
+private:
+    long m_budget;
+    long m_reserved;
+    bool m_huge;
+    int m_region_left;
+    std::vector< char* > m_chunks;
+    std::vector< char* > m_regions;
+    std::unordered_map< char*, chunk_info > m_info;
+    /*每个级别还有空闲块的大块*/
+    std::vector< char* > m_partial[ CLASS_NUMBER ];
+    /*块全部归还了的大块*/
+    std::vector< char* > m_spare;
+    locker m_locker;
+};
+
+
+/**
+ * 已经拼好的完整200应答 状态行+头部+文件内容 放在内存区的同一块里
+ * Connection头不同 所以依次保存close与keep-alive两份 命中时一次send一整段
+ */
+struct cached_response
+{
+    const char* data[2];
+    int len[2];
+    /*只有文件内容 HTTP/2自己编码头部*/
+    const char* body;
+    int body_len;
+    /*过期时刻(毫秒 CLOCK_MONOTONIC)*/
+    long long expire_ms;
+    char* block;
+    int cls;
+};
+
+/**
+ * 小文件应答缓存 url -> 完整应答
+ * 工作线程在do_request中把小文件直接读进内存区 主线程直接查询并发送 不用进线程池
+ * 内存区的预算用完时先淘汰过期的条目 再按LRU淘汰同级别的条目 最后淘汰任意级别的条目 直到腾出块
+ * 条目用shared_ptr持有 连接发送期间条目被淘汰或替换也不会被释放 最后一个引用放下时块才归还
+ * 不做stat校验 依靠较短的TTL发现文件变化
+ */
+class file_cache
+{
+public:
+    /*默认只缓存不超过该大小的文件*/
+    static const int DEFAULT_MAX_FILE_SIZE = 16 * 1024;
+    static const long DEFAULT_BUDGET = 64L * 1024 * 1024;
+    static const int TTL_MS = 1000;
+    /*状态行与头部的最大长度*/
+    static const int HEAD_MAX = 128;
+
+public:
+    file_cache() : m_max_file_size( DEFAULT_MAX_FILE_SIZE ), m_locker( "file_cache" )
+    {
+        m_arena.set_budget( DEFAULT_BUDGET );
+    }
+
+    /*启动时由命令行设置 两份应答要放得进最大的块*/
+    void configure( int max_file_size, long budget, bool huge_pages )
+    {
+        m_arena.set_huge_pages( huge_pages );
+        int limit = small_arena::MAX_BLOCK / 2 - HEAD_MAX;
+        m_max_file_size = ( max_file_size < limit ) ? max_file_size : limit;
+        m_arena.set_budget( budget );
+    }
+
+    int max_file_size() const { return m_max_file_size; }
+
+    std::shared_ptr< const cached_response > get( const char* url )
+    {
+        std::shared_ptr< const cached_response > entry;
+        m_locker.lock();
+        entry_map::iterator it = m_entries.find( lookup_key( url ) );
+        if( it != m_entries.end() )
+        {
+            if( it->second.response->expire_ms > now_ms() )
+            {
+                entry = it->second.response;
+                m_lru.splice( m_lru.begin(), m_lru, it->second.lru );
+            }
+            else
+            {
+                m_lru.erase( it->second.lru );
+                m_entries.erase( it );
+            }
+        }
+        m_locker.unlock();
+        if( entry )
+        {
+            STAT_INC( cache_hit );
+        }
+        else
+        {
+            STAT_INC( cache_miss );
+        }
+        return entry;
+    }
+
+    /*从已打开的文件读入len字节并拼好应答 放不进缓存时返回空*/
+    std::shared_ptr< const cached_response > load( const char* url, int fd, int len )
+    {
+        if( len <= 0 || len > m_max_file_size )
+        {
+            return std::shared_ptr< const cached_response >();
+        }
+        char head[2][ HEAD_MAX ];
+        int head_len[2];
+        for( int keep_alive = 0; keep_alive < 2; ++keep_alive )
+        {
+            head_len[ keep_alive ] = snprintf( head[ keep_alive ], HEAD_MAX, "HTTP/1.1 200 OK\r\nContent-Length: %d\r\nConnection: %s\r\n\r\n",
+                                               len, keep_alive ? "keep-alive" : "close" );
+        }
+        int cls = small_arena::class_of( head_len[0] + head_len[1] + 2 * len );
+        char* block = alloc( cls );
+        if( ! block )
+        {
+            return std::shared_ptr< const cached_response >();
+        }
+
+        /*块还没有发布出去 不用加锁填充*/
+        char* close_body = block + head_len[0];
+        char* keep_alive_head = close_body + len;
+        int got = 0;
+        while( got < len )
+        {
+            ssize_t n = pread( fd, close_body + got, len - got, got );
+            if( n <= 0 )
+            {
+                m_arena.free( block );
+                return std::shared_ptr< const cached_response >();
+            }
+            got += n;
+        }
+        memcpy( block, head[0], head_len[0] );
+        memcpy( keep_alive_head, head[1], head_len[1] );
+        memcpy( keep_alive_head + head_len[1], close_body, len );
+
+        cached_response* response = new cached_response;
+        response->data[0] = block;
+        response->len[0] = head_len[0] + len;
+        response->data[1] = keep_alive_head;
+        response->len[1] = head_len[1] + len;
+        response->body = close_body;
+        response->body_len = len;
+        response->expire_ms = now_ms() + TTL_MS;
+        response->block = block;
+        response->cls = cls;
+        std::shared_ptr< const cached_response > entry( response, releaser( &m_arena ) );
+
+        m_locker.lock();
+        entry_map::iterator it = m_entries.find( url );
+        if( it != m_entries.end() )
+        {
+            it->second.response = entry;
+            m_lru.splice( m_lru.begin(), m_lru, it->second.lru );
+        }
+        else
+        {
+            m_lru.push_front( url );
+            node& n = m_entries[ url ];
+            n.response = entry;
+            n.lru = m_lru.begin();
+        }
+        m_locker.unlock();
+        return entry;
+    }
+
+private:
+    /*最后一个引用放下时把块还给内存区 内存区有自己的锁 可以在持有m_locker时发生*/
+    struct releaser
+    {
+        explicit releaser( small_arena* arena ) : m_arena( arena ) {}
+        void operator()( cached_response* response ) const
+        {
+            m_arena->free( response->block );
+            delete response;
+        }
+        small_arena* m_arena;
+    };
+
+    struct node
+    {
+        std::shared_ptr< const cached_response > response;
+        std::list< std::string >::iterator lru;
+    };
+    typedef std::unordered_map< std::string, node > entry_map;
+
+    /**
+     * 预算用完时从LRU尾部开始淘汰 直到取到块或者没有可淘汰的
+     * 第一遍淘汰所有级别中已过期的条目 它们的块本来就不会再命中 块全部归还的大块可以给本级别重新切分
+     * 第二遍淘汰同级别的条目 第三遍淘汰任意级别的条目 等它们所在的大块空出来
+     */
+    char* alloc( int cls )
+    {
+        char* block = m_arena.alloc( cls );
+        if( block )
+        {
+            return block;
+        }
+        m_locker.lock();
+        long long now = now_ms();
+        for( int pass = 0; ! block && pass < 3; ++pass )
+        {
+            std::list< std::string >::iterator it = m_lru.end();
+            while( ! block && it != m_lru.begin() )
+            {
+                --it;
+                entry_map::iterator victim = m_entries.find( *it );
+                const cached_response* response = victim->second.response.get();
+                if( ( pass == 0 && response->expire_ms > now ) || ( pass == 1 && response->cls != cls ) )
+                {
+                    continue;
+                }
+                bool last_ref = victim->second.response.use_count() == 1;
+                m_entries.erase( victim );
+                it = m_lru.erase( it );
+                STAT_INC( cache_evict );
+                /*还有连接在发送它时块要等发送完才归还 继续淘汰下一个*/
+                if( last_ref )
+                {
+                    block = m_arena.alloc( cls );
+                }
+            }
+        }
+        m_locker.unlock();
+        return block;
+    }
+
+    static long long now_ms()
+    {
+        struct timespec ts;
+        clock_gettime( CLOCK_MONOTONIC_COARSE, &ts );
+        return ( long long )ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+private:
+    int m_max_file_size;
+    small_arena m_arena;
+    locker m_locker;
+    /*表头是最近用过的url*/
+    std::list< std::string > m_lru;
+    entry_map m_entries;
+};
+
+#endif
@@ -0,0 +1,395 @@
+/**
+ * Created by 刘嘉辉 on 11/17/18.
+ * Copyright (c) 2018 刘嘉辉 All rights reserved.
+ * @brief To immplmente hpack.h.
+ */
+
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <utility>
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * HTTP/2的头部压缩 RFC 7541
+ * 解码器完整实现 静态表 动态表 Huffman 浏览器和curl发来的头部几乎都用到了后两者
+ * 编码器只查静态表: 名字与值都匹配时只发一个字节的索引 否则索引名字加字面值
+ * 不加入动态表也不做Huffman 应答头只有:status与content-length 这样编码器没有状态
+ * 也不用跟踪对端的SETTINGS_HEADER_TABLE_SIZE
+ */
+typedef std::pair< std::string, std::string > hpack_header;
+
+struct hpack_static_entry
+{
+    const char* name;
+    const char* value;
+};
+
+/*静态表 下标从1开始*/
+static const int HPACK_STATIC_SIZE = 61;
+static const hpack_static_entry HPACK_STATIC_TABLE[ HPACK_STATIC_SIZE + 1 ] =
+{
+    { "", "" },
+    { ":authority", "" }, { ":method", "GET" }, { ":method", "POST" }, { ":path", "/" },
+    { ":path", "/index.html" }, { ":scheme", "http" }, { ":scheme", "https" }, { ":status", "200" },
+    { ":status", "204" }, { ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+    { ":status", "404" }, { ":status", "500" }, { "accept-charset", "" }, { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" }, { "accept-ranges", "" }, { "accept", "" }, { "access-control-allow-origin", "" },
+    { "age", "" }, { "allow", "" }, { "authorization", "" }, { "cache-control", "" },
+    { "content-disposition", "" }, { "content-encoding", "" }, { "content-language", "" }, { "content-length", "" },
+    { "content-location", "" }, { "content-range", "" }, { "content-type", "" }, { "cookie", "" },
+    { "date", "" }, { "etag", "" }, { "expect", "" }, { "expires", "" },
+    { "from", "" }, { "host", "" }, { "if-match", "" }, { "if-modified-since", "" },
+    { "if-none-match", "" }, { "if-range", "" }, { "if-unmodified-since", "" }, { "last-modified", "" },
+    { "link", "" }, { "location", "" }, { "max-forwards", "" }, { "proxy-authenticate", "" },
+    { "proxy-authorization", "" }, { "range", "" }, { "referer", "" }, { "refresh", "" },
+    { "retry-after", "" }, { "server", "" }, { "set-cookie", "" }, { "strict-transport-security", "" },
+    { "transfer-encoding", "" }, { "user-agent", "" }, { "vary", "" }, { "via", "" },
+    { "www-authenticate", "" }
+};
+
+/*静态表中常用的名字 编码器直接用下标*/
+static const int HPACK_STATUS_200 = 8;
+static const int HPACK_CONTENT_LENGTH = 28;
+
+/**
+ * Huffman码长 附录B 下标为符号 256是EOS
+ * 这是范式Huffman编码 同一码长的码字按符号顺序连续分配 只存码长就能还原出码字
+ */
+static const unsigned char HPACK_HUFFMAN_BITS[ 257 ] =
+{
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+     6, 10, 10, 12, 13,  6,  8, 11, 10, 10,  8, 11,  8,  6,  6,  6,
+     5,  5,  5,  6,  6,  6,  6,  6,  6,  6,  7,  8, 15,  6, 12, 10,
+    13,  6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+     7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8, 13, 19, 13, 14,  6,
+    15,  5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,  6,  6,  6,  5,
+     6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30
+};
+
+/**
+ * 范式Huffman的解码表 每个码长的第一个码字 码字个数 以及按(码长 符号)排好序的符号
+ * 解码时逐位累加码字 落在某个码长的区间内即得到符号 头部很短 逐位解码足够快
+ */
+class hpack_huffman
+{
+public:
+    static const int MAX_BITS = 30;
+    static const int EOS = 256;
+
+public:
+    static const hpack_huffman& instance()
+    {
+        static hpack_huffman h;
+        return h;
+    }
+
+    /*解码len字节追加到out 非法码字 EOS 或超过7位/不全为1的填充都返回false*/
+    bool decode( const unsigned char* p, int len, std::string& out ) const
+    {
+        unsigned int code = 0;
+        int bits = 0;
+        for ( int i = 0; i < len; ++i )
+        {
+            for ( int b = 7; b >= 0; --b )
+            {
+                code = ( code << 1 ) | ( ( p[i] >> b ) & 1 );
+                ++bits;
+                if ( code - m_first[ bits ] < ( unsigned int )m_count[ bits ] )
+                {
+                    int sym = m_symbols[ m_offset[ bits ] + code - m_first[ bits ] ];
+                    if ( sym == EOS )
+                    {
+                        return false;
+                    }
+                    out += ( char )sym;
+                    code = 0;
+                    bits = 0;
+                }
+                else if ( bits == MAX_BITS )
+                {
+                    return false;
+                }
+            }
+        }
+        return bits < 8 && code == ( 1u << bits ) - 1;
+    }
+
+private:
+    hpack_huffman()
+    {
+        int n = 0;
+        unsigned int code = 0;
+        for ( int bits = 0; bits <= MAX_BITS; ++bits )
+        {
+            m_first[ bits ] = code;
+            m_offset[ bits ] = n;
+            m_count[ bits ] = 0;
+            for ( int sym = 0; sym <= EOS; ++sym )
+            {
+                if ( HPACK_HUFFMAN_BITS[ sym ] == bits )
+                {
+                    m_symbols[ n++ ] = sym;
+                    ++m_count[ bits ];
+                }
+            }
+            code = ( code + m_count[ bits ] ) << 1;
+        }
+    }
+
+private:
+    unsigned int m_first[ MAX_BITS + 1 ];
+    int m_offset[ MAX_BITS + 1 ];
+    int m_count[ MAX_BITS + 1 ];
+    short m_symbols[ EOS + 1 ];
+};
+
+/*每个连接一个 解码对端发来的头部块 动态表跨越整个连接*/
+class hpack_decoder
+{
+public:
+    /*SETTINGS_HEADER_TABLE_SIZE 我们不调整 用协议默认值*/
+    static const unsigned int TABLE_SIZE = 4096;
+    /*每条表项额外计入的字节数*/
+    static const unsigned int ENTRY_OVERHEAD = 32;
+
+public:
+    hpack_decoder() : m_size( 0 ), m_max_size( TABLE_SIZE ) {}
+
+    /*解码一个完整的头部块 出错时返回false 连接必须以COMPRESSION_ERROR关闭*/
+    bool decode( const unsigned char* p, int len, std::vector< hpack_header >& headers )
+    {
+        const unsigned char* end = p + len;
+        while ( p < end )
+        {
+            unsigned int index;
+            if ( *p & 0x80 )
+            {
+                /*索引的头部字段*/
+                if ( ! decode_int( p, end, 7, index ) || ! lookup( index, headers ) )
+                {
+                    return false;
+                }
+            }
+            else if ( ( *p & 0xe0 ) == 0x20 )
+            {
+                /*动态表大小更新*/
+                if ( ! decode_int( p, end, 5, index ) || index > TABLE_SIZE )
+                {
+                    return false;
+                }
+                m_max_size = index;
+                evict( 0 );
+            }
+            else
+            {
+                /*字面值 01带索引 0001永不索引 0000不索引*/
+                bool indexing = ( *p & 0xc0 ) == 0x40;
+                if ( ! decode_int( p, end, indexing ? 6 : 4, index ) )
+                {
+                    return false;
+                }
+                hpack_header h;
+                if ( index != 0 )
+                {
+                    if ( ! name_of( index, h.first ) )
+                    {
+                        return false;
+                    }
+                }
+                else if ( ! decode_string( p, end, h.first ) )
+                {
+                    return false;
+                }
+                if ( ! decode_string( p, end, h.second ) )
+                {
+                    return false;
+                }
+                if ( indexing )
+                {
+                    insert( h );
+                }
+                headers.push_back( h );
+            }
+        }
+        return true;
+    }
+
+private:
+    /*前缀为prefix位的整数 超过28位视为非法*/
+    static bool decode_int( const unsigned char*& p, const unsigned char* end, int prefix, unsigned int& value )
+    {
+        unsigned int max = ( 1u << prefix ) - 1;
+        value = *p++ & max;
+        if ( value < max )
+        {
+            return true;
+        }
+        for ( int shift = 0; p < end && shift <= 21; shift += 7 )
+        {
+            unsigned char b = *p++;
+            value += ( unsigned int )( b & 0x7f ) << shift;
+            if ( ! ( b & 0x80 ) )
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool decode_string( const unsigned char*& p, const unsigned char* end, std::string& out )
+    {
+        if ( p >= end )
+        {
+            return false;
+        }
+        bool huffman = *p & 0x80;
+        unsigned int len;
+        if ( ! decode_int( p, end, 7, len ) || len > ( unsigned int )( end - p ) )
+        {
+            return false;
+        }
+        if ( huffman )
+        {
+            if ( ! hpack_huffman::instance().decode( p, len, out ) )
+            {
+                return false;
+            }
+        }
+        else
+        {
+            out.assign( ( const char* )p, len );
+        }
+        p += len;
+        return true;
+    }
+
+    /*静态表的下标在前 动态表紧随其后 最新加入的是HPACK_STATIC_SIZE + 1*/
+    bool lookup( unsigned int index, std::vector< hpack_header >& headers ) const
+    {
+        if ( index == 0 )
+        {
+            return false;
+        }
+        if ( index <= ( unsigned int )HPACK_STATIC_SIZE )
+        {
+            headers.push_back( hpack_header( HPACK_STATIC_TABLE[ index ].name, HPACK_STATIC_TABLE[ index ].value ) );
+            return true;
+        }
+        index -= HPACK_STATIC_SIZE + 1;
+        if ( index >= m_dynamic.size() )
+        {
+            return false;
+        }
+        headers.push_back( m_dynamic[ index ] );
+        return true;
+    }
+
+    bool name_of( unsigned int index, std::string& name ) const
+    {
+        if ( index <= ( unsigned int )HPACK_STATIC_SIZE )
+        {
+            name = HPACK_STATIC_TABLE[ index ].name;
+            return true;
+        }
+        index -= HPACK_STATIC_SIZE + 1;
+        if ( index >= m_dynamic.size() )
+        {
+            return false;
+        }
+        name = m_dynamic[ index ].first;
+        return true;
+    }
+
+    /*放不下的表项不加入 但表会被清空 这是协议规定的*/
+    void insert( const hpack_header& h )
+    {
+        unsigned int size = h.first.size() + h.second.size() + ENTRY_OVERHEAD;
+        evict( size );
+        if ( size <= m_max_size )
+        {
+            m_dynamic.push_front( h );
+            m_size += size;
+        }
+    }
+
+    /*从最旧的一端淘汰 直到还能再放下incoming字节*/
+    void evict( unsigned int incoming )
+    {
+        while ( ! m_dynamic.empty() && m_size + incoming > m_max_size )
+        {
+            const hpack_header& h = m_dynamic.back();
+            m_size -= h.first.size() + h.second.size() + ENTRY_OVERHEAD;
+            m_dynamic.pop_back();
+        }
+    }
+
+private:
+    std::deque< hpack_header > m_dynamic;
+    unsigned int m_size;
+    unsigned int m_max_size;
+};
+
+/*只用静态表的编码器 没有状态 可以被所有连接共用*/
+class hpack_encoder
+{
+public:
+    /*状态码在静态表中时一个字节 否则索引:status加三位数字*/
+    static void encode_status( int status, std::string& out )
+    {
+        char digits[ 4 ];
+        snprintf( digits, sizeof( digits ), "%03d", status );
+        for ( int i = HPACK_STATUS_200; i <= HPACK_STATUS_200 + 6; ++i )
+        {
+            if ( strcmp( HPACK_STATIC_TABLE[ i ].value, digits ) == 0 )
+            {
+                encode_int( 0x80, 7, i, out );
+                return;
+            }
+        }
+        encode_literal( HPACK_STATUS_200, digits, out );
+    }
+
+    /*不加入索引的字面值 名字用静态表的下标*/
+    static void encode_literal( int name_index, const char* value, std::string& out )
+    {
+        encode_int( 0x00, 4, name_index, out );
+        int len = strlen( value );
+        encode_int( 0x00, 7, len, out );
+        out.append( value, len );
+    }
+
+    static void encode_int( unsigned char flags, int prefix, unsigned int value, std::string& out )
+    {
+        unsigned int max = ( 1u << prefix ) - 1;
+        if ( value < max )
+        {
+            out += ( char )( flags | value );
+            return;
+        }
+        out += ( char )( flags | max );
+        value -= max;
+        while ( value >= 0x80 )
+        {
+            out += ( char )( ( value & 0x7f ) | 0x80 );
+            value >>= 7;
+        }
+        out += ( char )value;
+    }
+};
+
+#endif
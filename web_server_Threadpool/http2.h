@@ -0,0 +1,726 @@
+/**
+ * Created by 刘嘉辉 on 11/17/18.
+ * Copyright (c) 2018 刘嘉辉 All rights reserved.
+ * @brief To immplmente http2.h.
+ */
+
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <map>
+#include <deque>
+#include <string>
+#include <vector>
+#include <memory>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include "hpack.h"
+#include "file_cache.h"
+#include "log.h"
+#include "stats.h"
+
+/**
+ * HTTP/2 RFC 7540 一个连接上的帧层 不做I/O
+ * http_conn把读到的字节交给feed 取出完整的请求找到文件后respond
+ * 要发的帧都攒在输出缓冲区里 由http_conn发送 发走一部分后再pump生成后续的DATA帧
+ *
+ * 多个流的应答体轮流各发一帧 大文件不会挡住后面的小文件
+ * 发送受连接级与流级两层窗口约束 窗口用完就停 等对端的WINDOW_UPDATE
+ * 请求体不交给任何人 收到DATA就立即归还连接级与流级窗口 应答发完时以RST_STREAM(NO_ERROR)让客户停止发送
+ */
+struct h2_stream
+{
+    unsigned int id;
+    /*发送窗口 对端调小INITIAL_WINDOW_SIZE时可能为负*/
+    long window;
+    /*客户已经发完请求*/
+    bool remote_closed;
+    std::string method;
+    std::string path;
+    /*应答体中还没有发出的部分 指向缓存块或mmap的区域*/
+    const char* data;
+    long left;
+    /*应答体的持有者 流关闭时释放*/
+    std::shared_ptr< const cached_response > cached;
+    char* map;
+    off_t map_len;
+    /*访问日志用*/
+    int log_method;
+    int status;
+    long bytes;
+    long long start_us;
+};
+
+class h2_session
+{
+public:
+    static const int FRAME_HEADER_SIZE = 9;
+    /*SETTINGS_MAX_FRAME_SIZE 双方都用协议默认值*/
+    static const int MAX_FRAME_SIZE = 16384;
+    static const unsigned int MAX_CONCURRENT_STREAMS = 100;
+    static const long DEFAULT_WINDOW = 65535;
+    static const long MAX_WINDOW = 0x7fffffff;
+    /*HEADERS加CONTINUATION拼起来的头部块上限*/
+    static const int MAX_HEADER_BLOCK = 64 * 1024;
+    /*输出缓冲区中未发送的字节低于该值时才继续生成DATA帧*/
+    static const int OUT_LOW_WATER = 64 * 1024;
+    /*客户端连接序言*/
+    static const int PREFACE_SIZE = 24;
+
+    enum FRAME_TYPE { DATA = 0, HEADERS, PRIORITY, RST_STREAM, SETTINGS, PUSH_PROMISE, PING, GOAWAY, WINDOW_UPDATE, CONTINUATION };
+    enum FRAME_FLAG { FLAG_END_STREAM = 0x1, FLAG_ACK = 0x1, FLAG_END_HEADERS = 0x4, FLAG_PADDED = 0x8, FLAG_PRIORITY = 0x20 };
+    enum SETTING { SETTINGS_HEADER_TABLE_SIZE = 1, SETTINGS_ENABLE_PUSH, SETTINGS_MAX_CONCURRENT_STREAMS,
+                   SETTINGS_INITIAL_WINDOW_SIZE, SETTINGS_MAX_FRAME_SIZE, SETTINGS_MAX_HEADER_LIST_SIZE };
+    enum ERROR_CODE { NO_ERROR = 0, PROTOCOL_ERROR, INTERNAL_ERROR, FLOW_CONTROL_ERROR, SETTINGS_TIMEOUT, STREAM_CLOSED,
+                      FRAME_SIZE_ERROR, REFUSED_STREAM, CANCEL, COMPRESSION_ERROR, CONNECT_ERROR, ENHANCE_YOUR_CALM };
+
+public:
+    /**
+     * 新连接先发服务端的SETTINGS
+     * upgraded为真时是从HTTP/1.1的Upgrade: h2c切换过来的 在它之前先回101
+     */
+    h2_session( const sockaddr_in& peer, bool upgraded )
+        : m_peer( peer ), m_in_len( 0 ), m_preface_left( PREFACE_SIZE ), m_out_pos( 0 ), m_window( DEFAULT_WINDOW ),
+          m_initial_window( DEFAULT_WINDOW ), m_last_stream_id( 0 ), m_cursor( 0 ), m_header_stream( 0 ), m_header_flags( 0 ),
+          m_goaway_sent( false ), m_peer_goaway( false )
+    {
+        if ( upgraded )
+        {
+            m_out = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+        }
+        unsigned char settings[ 6 ];
+        put16( settings, SETTINGS_MAX_CONCURRENT_STREAMS );
+        put32( settings + 2, MAX_CONCURRENT_STREAMS );
+        frame( SETTINGS, 0, 0, settings, sizeof( settings ) );
+        STAT_INC( h2_sessions );
+    }
+
+    ~h2_session()
+    {
+        while ( ! m_streams.empty() )
+        {
+            close_stream( m_streams.begin()->first );
+        }
+    }
+
+    /**
+     * h2c升级 HTTP2-Settings头是base64url编码的SETTINGS帧载荷
+     * 升级的请求成为流1 它已经没有请求体了
+     */
+    bool upgrade( const char* settings, const char* path )
+    {
+        std::string payload;
+        if ( ! base64url_decode( settings, payload ) || payload.size() % 6 != 0
+             || ! apply_settings( ( const unsigned char* )payload.data(), payload.size() ) )
+        {
+            return false;
+        }
+        h2_stream* s = new_stream( 1 );
+        s->remote_closed = true;
+        s->method = "GET";
+        s->path = path;
+        m_last_stream_id = 1;
+        m_ready.push_back( 1 );
+        return true;
+    }
+
+    /*交给会话解析的字节 连接级错误时已排好GOAWAY 返回false*/
+    bool feed( const char* data, int len )
+    {
+        while ( len > 0 && ! m_goaway_sent )
+        {
+            int take = ( len < IN_BUFFER_SIZE - m_in_len ) ? len : IN_BUFFER_SIZE - m_in_len;
+            memcpy( m_in + m_in_len, data, take );
+            m_in_len += take;
+            data += take;
+            len -= take;
+
+            int pos = 0;
+            if ( m_preface_left > 0 )
+            {
+                pos = ( m_preface_left < m_in_len ) ? m_preface_left : m_in_len;
+                if ( memcmp( m_in, preface() + PREFACE_SIZE - m_preface_left, pos ) != 0 )
+                {
+                    return connection_error( PROTOCOL_ERROR );
+                }
+                m_preface_left -= pos;
+            }
+            while ( m_in_len - pos >= FRAME_HEADER_SIZE )
+            {
+                const unsigned char* h = ( const unsigned char* )m_in + pos;
+                int length = ( h[0] << 16 ) | ( h[1] << 8 ) | h[2];
+                if ( length > MAX_FRAME_SIZE )
+                {
+                    return connection_error( FRAME_SIZE_ERROR );
+                }
+                if ( m_in_len - pos < FRAME_HEADER_SIZE + length )
+                {
+                    break;
+                }
+                if ( ! on_frame( h[3], h[4], get32( h + 5 ) & 0x7fffffff, h + FRAME_HEADER_SIZE, length ) )
+                {
+                    return false;
+                }
+                pos += FRAME_HEADER_SIZE + length;
+            }
+            memmove( m_in, m_in + pos, m_in_len - pos );
+            m_in_len -= pos;
+        }
+        return ! m_goaway_sent;
+    }
+
+    /*取下一个头部已经收齐 等待应答的流*/
+    h2_stream* next_request()
+    {
+        while ( ! m_ready.empty() )
+        {
+            stream_map::iterator it = m_streams.find( m_ready.front() );
+            m_ready.pop_front();
+            if ( it != m_streams.end() )
+            {
+                return it->second;
+            }
+        }
+        return NULL;
+    }
+
+    /*排好HEADERS帧 应答体由pump随后分帧发送 调用前先设置好应答体的持有者*/
+    void respond( h2_stream* s, int status, const char* body, long len )
+    {
+        std::string block;
+        hpack_encoder::encode_status( status, block );
+        char digits[ 24 ];
+        snprintf( digits, sizeof( digits ), "%ld", len );
+        hpack_encoder::encode_literal( HPACK_CONTENT_LENGTH, digits, block );
+
+        s->status = status;
+        s->data = body;
+        s->left = len;
+        frame( HEADERS, FLAG_END_HEADERS | ( len == 0 ? FLAG_END_STREAM : 0 ), s->id, block.data(), block.size() );
+        if ( len == 0 )
+        {
+            finish_stream( s );
+        }
+    }
+
+    /**
+     * 按窗口轮流给有数据的流各发一帧 直到输出缓冲区够多或者都发不动了
+     * 返回输出缓冲区中是否有待发送的字节
+     */
+    bool pump()
+    {
+        /**
+         * 因为错误发出GOAWAY之后只把缓冲区里的帧发完
+         * h2c升级时客户的连接序言到达之前不发DATA 客户这时还在HTTP/1.1的缓冲区里接收
+         */
+        unsigned int skipped = ( m_goaway_sent || m_preface_left > 0 ) ? m_streams.size() : 0;
+        while ( out_len() < OUT_LOW_WATER && m_window > 0 && skipped < m_streams.size() )
+        {
+            stream_map::iterator it = m_streams.upper_bound( m_cursor );
+            if ( it == m_streams.end() )
+            {
+                it = m_streams.begin();
+            }
+            h2_stream* s = it->second;
+            m_cursor = s->id;
+            if ( s->left <= 0 || s->window <= 0 )
+            {
+                ++skipped;
+                continue;
+            }
+            skipped = 0;
+
+            long n = s->left;
+            n = ( n < MAX_FRAME_SIZE ) ? n : MAX_FRAME_SIZE;
+            n = ( n < s->window ) ? n : s->window;
+            n = ( n < m_window ) ? n : m_window;
+            bool last = ( n == s->left );
+            frame( DATA, last ? FLAG_END_STREAM : 0, s->id, s->data, n );
+            s->data += n;
+            s->left -= n;
+            s->window -= n;
+            s->bytes += n;
+            m_window -= n;
+            if ( last )
+            {
+                finish_stream( s );
+            }
+        }
+        return out_len() > 0;
+    }
+
+    const char* out_data() const { return m_out.data() + m_out_pos; }
+    int out_len() const { return m_out.size() - m_out_pos; }
+
+    /*已经发出n字节*/
+    void consume( int n )
+    {
+        m_out_pos += n;
+        if ( m_out_pos == ( int )m_out.size() )
+        {
+            m_out.clear();
+            m_out_pos = 0;
+        }
+        else if ( m_out_pos > OUT_LOW_WATER )
+        {
+            m_out.erase( 0, m_out_pos );
+            m_out_pos = 0;
+        }
+    }
+
+    /*告诉对端不再接受新的流 last_stream_id之后的请求可以安全重试*/
+    void goaway( int error )
+    {
+        if ( m_goaway_sent )
+        {
+            return;
+        }
+        unsigned char payload[ 8 ];
+        put32( payload, m_last_stream_id );
+        put32( payload + 4, error );
+        frame( GOAWAY, 0, 0, payload, sizeof( payload ) );
+        m_goaway_sent = true;
+    }
+
+    /*没有进行中的流*/
+    bool idle() const { return m_streams.empty(); }
+    /*输出缓冲区发完后就可以关闭连接了*/
+    bool finished() const { return m_goaway_sent || ( m_peer_goaway && m_streams.empty() ); }
+
+    static const char* preface() { return "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"; }
+
+private:
+    static const int IN_BUFFER_SIZE = FRAME_HEADER_SIZE + MAX_FRAME_SIZE;
+    typedef std::map< unsigned int, h2_stream* > stream_map;
+
+    bool on_frame( int type, int flags, unsigned int id, const unsigned char* p, int len )
+    {
+        /*头部块没有结束之前只能出现同一个流的CONTINUATION*/
+        if ( m_header_stream != 0 && ( type != CONTINUATION || id != m_header_stream ) )
+        {
+            return connection_error( PROTOCOL_ERROR );
+        }
+        switch ( type )
+        {
+            case DATA:
+                return on_data( flags, id, p, len );
+            case HEADERS:
+                return on_headers( flags, id, p, len );
+            case PRIORITY:
+                return id != 0 || connection_error( PROTOCOL_ERROR );
+            case RST_STREAM:
+            {
+                if ( id == 0 || len != 4 )
+                {
+                    return connection_error( id == 0 ? PROTOCOL_ERROR : FRAME_SIZE_ERROR );
+                }
+                close_stream( id );
+                return true;
+            }
+            case SETTINGS:
+                return on_settings( flags, id, p, len );
+            case PUSH_PROMISE:
+                return connection_error( PROTOCOL_ERROR );
+            case PING:
+            {
+                if ( id != 0 || len != 8 )
+                {
+                    return connection_error( id != 0 ? PROTOCOL_ERROR : FRAME_SIZE_ERROR );
+                }
+                if ( ! ( flags & FLAG_ACK ) )
+                {
+                    frame( PING, FLAG_ACK, 0, p, len );
+                }
+                return true;
+            }
+            case GOAWAY:
+                m_peer_goaway = true;
+                return true;
+            case WINDOW_UPDATE:
+                return on_window_update( id, p, len );
+            case CONTINUATION:
+            {
+                if ( m_header_stream == 0 )
+                {
+                    return connection_error( PROTOCOL_ERROR );
+                }
+                if ( m_header_block.size() + len > ( size_t )MAX_HEADER_BLOCK )
+                {
+                    return connection_error( ENHANCE_YOUR_CALM );
+                }
+                m_header_block.append( ( const char* )p, len );
+                return ! ( flags & FLAG_END_HEADERS ) || end_headers();
+            }
+            /*未知类型的帧必须忽略*/
+            default:
+                return true;
+        }
+    }
+
+    bool on_data( int flags, unsigned int id, const unsigned char*, int len )
+    {
+        if ( id == 0 )
+        {
+            return connection_error( PROTOCOL_ERROR );
+        }
+        if ( len > 0 )
+        {
+            window_update( 0, len );
+        }
+        stream_map::iterator it = m_streams.find( id );
+        if ( it == m_streams.end() )
+        {
+            /*还没打开过的流上不能有DATA 已经关闭的流上的DATA丢弃*/
+            return id <= m_last_stream_id || connection_error( PROTOCOL_ERROR );
+        }
+        if ( flags & FLAG_END_STREAM )
+        {
+            it->second->remote_closed = true;
+        }
+        /*流级窗口也要归还 否则超过初始窗口(64KB)的请求体会停在半路 直到应答发完后的RST_STREAM*/
+        else if ( len > 0 )
+        {
+            window_update( id, len );
+        }
+        return true;
+    }
+
+    bool on_headers( int flags, unsigned int id, const unsigned char* p, int len )
+    {
+        if ( id == 0 || ! ( id & 1 ) )
+        {
+            return connection_error( PROTOCOL_ERROR );
+        }
+        if ( flags & FLAG_PADDED )
+        {
+            int pad = ( len > 0 ) ? p[0] : 0;
+            if ( len < 1 || pad >= len )
+            {
+                return connection_error( PROTOCOL_ERROR );
+            }
+            ++p;
+            len -= pad + 1;
+        }
+        /*优先级不处理 轮流发送已经足够公平*/
+        if ( flags & FLAG_PRIORITY )
+        {
+            if ( len < 5 )
+            {
+                return connection_error( FRAME_SIZE_ERROR );
+            }
+            p += 5;
+            len -= 5;
+        }
+        m_header_stream = id;
+        m_header_flags = flags;
+        m_header_block.assign( ( const char* )p, len );
+        return ! ( flags & FLAG_END_HEADERS ) || end_headers();
+    }
+
+    /*头部块收齐 即使流要被拒绝也得解码 否则两端的动态表就不一致了*/
+    bool end_headers()
+    {
+        unsigned int id = m_header_stream;
+        m_header_stream = 0;
+        std::vector< hpack_header > headers;
+        if ( ! m_decoder.decode( ( const unsigned char* )m_header_block.data(), m_header_block.size(), headers ) )
+        {
+            return connection_error( COMPRESSION_ERROR );
+        }
+
+        /*已经打开的流上是trailer 忽略内容*/
+        stream_map::iterator it = m_streams.find( id );
+        if ( it != m_streams.end() )
+        {
+            if ( m_header_flags & FLAG_END_STREAM )
+            {
+                it->second->remote_closed = true;
+            }
+            return true;
+        }
+        if ( id <= m_last_stream_id )
+        {
+            return connection_error( PROTOCOL_ERROR );
+        }
+        m_last_stream_id = id;
+        if ( m_goaway_sent || m_peer_goaway )
+        {
+            return true;
+        }
+        if ( m_streams.size() >= MAX_CONCURRENT_STREAMS )
+        {
+            rst_stream( id, REFUSED_STREAM );
+            return true;
+        }
+
+        h2_stream* s = new_stream( id );
+        s->remote_closed = m_header_flags & FLAG_END_STREAM;
+        for ( size_t i = 0; i < headers.size(); ++i )
+        {
+            if ( headers[i].first == ":method" )
+            {
+                s->method = headers[i].second;
+            }
+            else if ( headers[i].first == ":path" )
+            {
+                s->path = headers[i].second;
+            }
+        }
+        if ( s->method.empty() || s->path.empty() )
+        {
+            rst_stream( id, PROTOCOL_ERROR );
+            close_stream( id );
+            return true;
+        }
+        m_ready.push_back( id );
+        return true;
+    }
+
+    bool on_settings( int flags, unsigned int id, const unsigned char* p, int len )
+    {
+        if ( id != 0 )
+        {
+            return connection_error( PROTOCOL_ERROR );
+        }
+        if ( flags & FLAG_ACK )
+        {
+            return len == 0 || connection_error( FRAME_SIZE_ERROR );
+        }
+        if ( len % 6 != 0 )
+        {
+            return connection_error( FRAME_SIZE_ERROR );
+        }
+        if ( ! apply_settings( p, len ) )
+        {
+            return false;
+        }
+        frame( SETTINGS, FLAG_ACK, 0, NULL, 0 );
+        return true;
+    }
+
+    /*只有初始窗口会影响我们 其余的设置只做合法性检查*/
+    bool apply_settings( const unsigned char* p, int len )
+    {
+        for ( ; len >= 6; p += 6, len -= 6 )
+        {
+            unsigned int value = get32( p + 2 );
+            switch ( get16( p ) )
+            {
+                case SETTINGS_INITIAL_WINDOW_SIZE:
+                {
+                    if ( value > MAX_WINDOW )
+                    {
+                        return connection_error( FLOW_CONTROL_ERROR );
+                    }
+                    long delta = ( long )value - m_initial_window;
+                    for ( stream_map::iterator it = m_streams.begin(); it != m_streams.end(); ++it )
+                    {
+                        it->second->window += delta;
+                    }
+                    m_initial_window = value;
+                    break;
+                }
+                case SETTINGS_MAX_FRAME_SIZE:
+                {
+                    if ( value < ( unsigned int )MAX_FRAME_SIZE || value > 0xffffff )
+                    {
+                        return connection_error( PROTOCOL_ERROR );
+                    }
+                    break;
+                }
+                case SETTINGS_ENABLE_PUSH:
+                {
+                    if ( value > 1 )
+                    {
+                        return connection_error( PROTOCOL_ERROR );
+                    }
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+        return true;
+    }
+
+    bool on_window_update( unsigned int id, const unsigned char* p, int len )
+    {
+        if ( len != 4 )
+        {
+            return connection_error( FRAME_SIZE_ERROR );
+        }
+        long increment = get32( p ) & 0x7fffffff;
+        if ( id == 0 )
+        {
+            if ( increment == 0 )
+            {
+                return connection_error( PROTOCOL_ERROR );
+            }
+            m_window += increment;
+            return m_window <= MAX_WINDOW || connection_error( FLOW_CONTROL_ERROR );
+        }
+        stream_map::iterator it = m_streams.find( id );
+        if ( it == m_streams.end() )
+        {
+            return true;
+        }
+        it->second->window += increment;
+        if ( increment == 0 || it->second->window > MAX_WINDOW )
+        {
+            rst_stream( id, increment == 0 ? PROTOCOL_ERROR : FLOW_CONTROL_ERROR );
+            close_stream( id );
+        }
+        return true;
+    }
+
+    h2_stream* new_stream( unsigned int id )
+    {
+        h2_stream* s = new h2_stream;
+        s->id = id;
+        s->window = m_initial_window;
+        s->remote_closed = false;
+        s->data = NULL;
+        s->left = 0;
+        s->map = NULL;
+        s->map_len = 0;
+        s->log_method = -1;
+        s->status = 0;
+        s->bytes = 0;
+        s->start_us = now_us();
+        m_streams[ id ] = s;
+        STAT_INC( h2_streams );
+        return s;
+    }
+
+    /*应答的最后一帧已经排好 请求体还没收完时让客户别再发了*/
+    void finish_stream( h2_stream* s )
+    {
+        log_access( m_peer, s->log_method, s->path.c_str(), s->status, s->bytes, now_us() - s->start_us );
+        if ( ! s->remote_closed )
+        {
+            rst_stream( s->id, NO_ERROR );
+        }
+        close_stream( s->id );
+    }
+
+    void close_stream( unsigned int id )
+    {
+        stream_map::iterator it = m_streams.find( id );
+        if ( it == m_streams.end() )
+        {
+            return;
+        }
+        h2_stream* s = it->second;
+        if ( s->map )
+        {
+            munmap( s->map, s->map_len );
+        }
+        delete s;
+        m_streams.erase( it );
+    }
+
+    bool connection_error( int error )
+    {
+        LOG_DEBUG( "http2 connection error %d", error );
+        goaway( error );
+        return false;
+    }
+
+    void rst_stream( unsigned int id, int error )
+    {
+        unsigned char payload[ 4 ];
+        put32( payload, error );
+        frame( RST_STREAM, 0, id, payload, sizeof( payload ) );
+    }
+
+    void window_update( unsigned int id, unsigned int increment )
+    {
+        unsigned char payload[ 4 ];
+        put32( payload, increment );
+        frame( WINDOW_UPDATE, 0, id, payload, sizeof( payload ) );
+    }
+
+    void frame( int type, int flags, unsigned int id, const void* payload, int len )
+    {
+        unsigned char h[ FRAME_HEADER_SIZE ];
+        h[0] = len >> 16;
+        h[1] = len >> 8;
+        h[2] = len;
+        h[3] = type;
+        h[4] = flags;
+        put32( h + 5, id );
+        m_out.append( ( const char* )h, sizeof( h ) );
+        if ( len > 0 )
+        {
+            m_out.append( ( const char* )payload, len );
+        }
+    }
+
+    static unsigned int get16( const unsigned char* p ) { return ( p[0] << 8 ) | p[1]; }
+    static unsigned int get32( const unsigned char* p ) { return ( ( unsigned int )p[0] << 24 ) | ( p[1] << 16 ) | ( p[2] << 8 ) | p[3]; }
+    static void put16( unsigned char* p, unsigned int v ) { p[0] = v >> 8; p[1] = v; }
+    static void put32( unsigned char* p, unsigned int v ) { p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v; }
+
+    /*HTTP2-Settings 不带填充的base64url*/
+    static bool base64url_decode( const char* in, std::string& out )
+    {
+        unsigned int acc = 0;
+        int bits = 0;
+        static const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+        for ( ; *in && *in != '='; ++in )
+        {
+            const char* pos = strchr( alphabet, *in );
+            if ( ! pos )
+            {
+                return false;
+            }
+            int v = pos - alphabet;
+            acc = ( acc << 6 ) | v;
+            bits += 6;
+            if ( bits >= 8 )
+            {
+                bits -= 8;
+                out += ( char )( ( acc >> bits ) & 0xff );
+            }
+        }
+        return true;
+    }
+
+    static long long now_us()
+    {
+        struct timespec ts;
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        return ( long long )ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+private:
+    sockaddr_in m_peer;
+    /*只保存不完整的帧 帧长不超过MAX_FRAME_SIZE*/
+    char m_in[ IN_BUFFER_SIZE ];
+    int m_in_len;
+    /*客户端连接序言还差多少字节没有核对*/
+    int m_preface_left;
+    /*待发送的帧 m_out_pos之前的已经发出*/
+    std::string m_out;
+    int m_out_pos;
+    /*连接级发送窗口 以及对端SETTINGS给出的流初始窗口*/
+    long m_window;
+    long m_initial_window;
+    unsigned int m_last_stream_id;
+    /*上次发DATA的流 下一轮从它后面开始*/
+    unsigned int m_cursor;
+    stream_map m_streams;
+    /*头部已收齐 等待应答的流*/
+    std::deque< unsigned int > m_ready;
+    /*正在接收头部块的流 0表示没有*/
+    unsigned int m_header_stream;
+    int m_header_flags;
+    std::string m_header_block;
+    hpack_decoder m_decoder;
+    bool m_goaway_sent;
+    bool m_peer_goaway;
+};
+
+#endif
@@ -6,6 +6,10 @@
 
 #include "./http_conn.h"
 #include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <string>
 
 /*HTTP的一些状态响应信息*/
 const char* ok_200_title = "OK";
@@ -17,7 +21,17 @@ const char* error_404_title = "Not Found";
 const char* error_404_form = "The requested file was not found on this server.\n";
 const char* error_500_title = "Internal Error";
 const char* error_500_form = "There was an unusual problem serving the requested file.\n";
+const char* error_501_form = "CGI is not available over HTTP/2, use HTTP/1.1.\n";
+/*过载时直接发送的503应答 预先拼好 不经过写缓冲区*/
+const char* error_503_response = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\n"
+                                 "Content-Length: 0\r\nConnection: close\r\n\r\n";
+const char* error_429_response = "HTTP/1.1 429 Too Many Requests\r\nRetry-After: 1\r\n"
+                                 "Content-Length: 0\r\nConnection: close\r\n\r\n";
 const char* doc_root = "./var/www/html";
+/*doc_root下该前缀的url由cgi服务器执行*/
+const char* cgi_prefix = "/cgi-bin/";
+/*一次从cgi上游搬运到管道的最大字节数*/
+const int CGI_CHUNK_SIZE = 16384;
 
 /*设置非阻塞套接字*/
 int setnonblocking( int fd )
@@ -57,29 +71,93 @@ void modfd( int epollfd, int fd, int ev )
 
 int http_conn::m_user_count = 0;
 int http_conn::m_epollfd = -1;
+conn_table< http_conn >* http_conn::m_users = NULL;
+bool http_conn::m_draining = false;
+file_cache http_conn::m_cache;
+path_cache http_conn::m_paths;
+rate_limiter http_conn::m_limits;
+tls_context* http_conn::m_tls = NULL;
+cgi_channel< http_conn >* http_conn::m_cgi_shm = NULL;
+long http_conn::m_zerocopy_min = 0;
+sock_profile http_conn::m_sock;
 
+/**
+ * fd一关闭主线程就可能accept到同号的fd 所以关闭之前先清空表项
+ * 归还对象之后它可能马上被主线程复用 所以recycle必须放在最后
+ */
 void http_conn::close_conn( bool real_close )
 {
     if( real_close && ( m_sockfd != -1 ) )
     {
+        /*应答没发完客户就断开了 也记一条*/
+        if( m_status != 0 )
+        {
+            access_log();
+        }
+        cgi_close();
+        body_close();
+        if( m_ssl )
+        {
+            tls_close( m_ssl );
+            m_ssl = NULL;
+        }
+        delete m_h2;
+        m_h2 = NULL;
+        if( m_users )
+        {
+            m_users->remove( m_sockfd );
+        }
         removefd( m_epollfd, m_sockfd );
         m_sockfd = -1;
-        m_user_count--;
+        __atomic_fetch_sub( &m_user_count, 1, __ATOMIC_RELAXED );
+        m_limits.disconnect( m_limit_slot );
+        m_limit_slot = rate_limiter::UNLIMITED;
+        if( m_users )
+        {
+            m_users->recycle( this );
+        }
     }
 }
 
 /*init 重载*/
-void http_conn::init( int sockfd, const sockaddr_in& addr )
+void http_conn::init( int sockfd, const sockaddr_in& addr, int limit_slot )
 {
     m_sockfd = sockfd;
     m_address = addr;
+    m_limit_slot = limit_slot;
+    m_cgi_fd = -1;
+    m_cgi_slot = -1;
+    m_body_fd = -1;
+    m_file_fd = -1;
+    /*Unix域的连接来自本机的反向代理 TLS已经在代理上终结 始终按明文处理*/
+    m_ssl = ( m_tls && addr.sin_family != AF_UNIX ) ? m_tls->accept( sockfd ) : NULL;
+    m_tls_ready = false;
+    m_ktls = false;
+    /*TLS的数据由OpenSSL写进socket 零拷贝只用于明文*/
+    m_zerocopy = m_zerocopy_min > 0 && ! m_ssl && zerocopy_enable( sockfd );
+    m_zc_sent = 0;
+    m_zc_done = 0;
+    m_zc_parked = false;
     int error = 0;
     socklen_t len = sizeof( error );
     getsockopt( m_sockfd, SOL_SOCKET, SO_ERROR, &error, &len );
-    int reuse = 1;
-    setsockopt( m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
+    m_can_cork = false;
+    m_corked = false;
+    if ( addr.sin_family != AF_UNIX )
+    {
+        m_sock.apply( sockfd );
+        m_can_cork = m_sock.cork;
+        /*SYN中带着数据 即客户用TFO的cookie省掉了一个RTT*/
+        struct tcp_info info;
+        len = sizeof( info );
+        if ( m_sock.fastopen > 0 && getsockopt( sockfd, IPPROTO_TCP, TCP_INFO, &info, &len ) == 0
+             && ( info.tcpi_options & TCPI_OPT_SYN_DATA ) )
+        {
+            STAT_INC( tfo_accepted );
+        }
+    }
     addfd( m_epollfd, sockfd, true );
-    m_user_count++;
+    __atomic_fetch_add( &m_user_count, 1, __ATOMIC_RELAXED );
     
     /*进行状态机的初始化*/
     init();
@@ -92,17 +170,33 @@ void http_conn::init()
     m_linger = false;
 
     m_method = GET;
+    m_arena.reset();
     m_url = 0;
-    m_version = 0;
+    m_version = str_view();
     m_content_length = 0;
-    m_host = 0;
+    m_host = str_view();
+    m_upgrade_h2c = false;
+    m_h2_settings = str_view();
+    m_chunked = false;
+    m_body = 0;
+    m_body_len = 0;
+    m_chunk_state = CHUNK_SIZE;
+    m_chunk_left = 0;
+    body_close();
     m_start_line = 0;
+    m_body_start = 0;
     m_checked_idx = 0;
     m_read_idx = 0;
     m_write_idx = 0;
-    memset( m_read_buf, '\0', READ_BUFFER_SIZE );
-    memset( m_write_buf, '\0', WRITE_BUFFER_SIZE );
-    memset( m_real_file, '\0', FILENAME_LEN );
+    m_bytes_to_send = 0;
+    m_zc_iov = -1;
+    m_parsed_ret = NO_REQUEST;
+    m_file_address = 0;
+    m_file_left = 0;
+    m_cached.reset();
+    m_status = 0;
+    m_bytes_sent = 0;
+    m_start_us = 0;
 }
 
 http_conn::LINE_STATUS http_conn::parse_line()
@@ -119,8 +213,7 @@ http_conn::LINE_STATUS http_conn::parse_line()
             }
             else if ( m_read_buf[ m_checked_idx + 1 ] == '\n' )
             {
-                m_read_buf[ m_checked_idx++ ] = '\0';
-                m_read_buf[ m_checked_idx++ ] = '\0';
+                m_checked_idx += 2;
                 return LINE_OK;
             }
 
@@ -130,8 +223,7 @@ http_conn::LINE_STATUS http_conn::parse_line()
         {
             if( ( m_checked_idx > 1 ) && ( m_read_buf[ m_checked_idx - 1 ] == '\r' ) )
             {
-                m_read_buf[ m_checked_idx-1 ] = '\0';
-                m_read_buf[ m_checked_idx++ ] = '\0';
+                ++m_checked_idx;
                 return LINE_OK;
             }
             return LINE_BAD;
@@ -144,15 +236,23 @@ http_conn::LINE_STATUS http_conn::parse_line()
 /*循环读取客户数据 直到对方关闭或无数据可读*/
 bool http_conn::read()
 {
-    if( m_read_idx >= READ_BUFFER_SIZE )
+    if( m_read_idx >= READ_BUFFER_SIZE || ( m_tls && ! m_ssl && m_address.sin_family != AF_UNIX ) )
     {
         return false;
     }
 
     int bytes_read = 0;
-    while( true )
+    /*缓冲区满了先交给工作线程处理 请求体被写出后腾出空间 重新注册EPOLLIN时还会通知剩下的数据*/
+    while( m_read_idx < READ_BUFFER_SIZE )
     {
-        bytes_read = recv( m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0 );
+        if ( m_ssl )
+        {
+            bytes_read = tls_read( m_ssl, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx );
+        }
+        else
+        {
+            bytes_read = recv( m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0 );
+        }
         if ( bytes_read == -1 )
         {
             if( errno == EAGAIN || errno == EWOULDBLOCK )
@@ -166,51 +266,91 @@ bool http_conn::read()
             return false;
         }
 
+        if ( m_start_us == 0 )
+        {
+            m_start_us = now_us();
+        }
         m_read_idx += bytes_read;
     }
+
+    /*握手在读的过程中完成*/
+    bool resumed;
+    if ( m_ssl && ! m_tls_ready && tls_ready( m_ssl, &resumed ) )
+    {
+        m_tls_ready = true;
+        m_ktls = tls_ktls_send( m_ssl );
+        STAT_INC( tls_handshakes );
+        if ( resumed )
+        {
+            STAT_INC( tls_resumed );
+        }
+        if ( m_ktls )
+        {
+            STAT_INC( tls_ktls );
+        }
+        /*ALPN选中了h2 客户接下来直接发连接序言*/
+        if ( tls_alpn_h2( m_ssl ) )
+        {
+            m_h2 = new h2_session( m_address, false );
+        }
+    }
     return true;
 }
 
-/*解析HTTP请求行，获得请求方法，目标url,以及HTTP版本号*/
-http_conn::HTTP_CODE http_conn::parse_request_line( char* text )
+/**
+ * 解析HTTP请求行，获得请求方法，目标url,以及HTTP版本号
+ * 只切出视图 不改写读缓冲区 url复制进m_arena 供后面当作字符串使用
+ */
+http_conn::HTTP_CODE http_conn::parse_request_line( str_view line )
 {
-    m_url = strpbrk( text, " \t" );
-    if ( ! m_url )
+    str_view method = line.before_blank();
+    if ( method.len == line.len )
     {
         return BAD_REQUEST;
     }
-    *m_url++ = '\0';
 
-    char* method = text;
-    if ( strcasecmp( method, "GET" ) == 0 )
+    if ( method.equals_nocase( "GET" ) )
     {
         m_method = GET;
     }
+    else if ( method.equals_nocase( "POST" ) )
+    {
+        m_method = POST;
+    }
+    else if ( method.equals_nocase( "PUT" ) )
+    {
+        m_method = PUT;
+    }
     else
     {
         return BAD_REQUEST;
     }
 
-    m_url += strspn( m_url, " \t" );
-    m_version = strpbrk( m_url, " \t" );
-    if ( ! m_version )
+    line = line.skip( method.len ).trim();
+    str_view url = line.before_blank();
+    if ( url.len == line.len )
     {
         return BAD_REQUEST;
     }
-    *m_version++ = '\0';
-    m_version += strspn( m_version, " \t" );
-    if ( strcasecmp( m_version, "HTTP/1.1" ) != 0 )
+    m_version = line.skip( url.len ).trim();
+    if ( ! m_version.equals_nocase( "HTTP/1.1" ) )
     {
         return BAD_REQUEST;
     }
 
-    if ( strncasecmp( m_url, "http://", 7 ) == 0 )
+    if ( url.starts_with_nocase( "http://" ) )
     {
-        m_url += 7;
-        m_url = strchr( m_url, '/' );
+        url = url.skip( 7 );
+        const char* slash = ( const char* )memchr( url.data, '/', url.len );
+        url = slash ? url.skip( slash - url.data ) : str_view();
     }
 
-    if ( ! m_url || m_url[ 0 ] != '/' )
+    if ( url.empty() || url.data[ 0 ] != '/' )
+    {
+        return BAD_REQUEST;
+    }
+    m_url = m_arena.copy( url );
+    if ( ! m_url )
     {
         return BAD_REQUEST;
     }
@@ -219,62 +359,247 @@ http_conn::HTTP_CODE http_conn::parse_request_line( char* text )
     return NO_REQUEST;
 }
 
-http_conn::HTTP_CODE http_conn::parse_headers( char* text )
+http_conn::HTTP_CODE http_conn::parse_headers( str_view line )
 {
-    if( text[ 0 ] == '\0' )
+    if( line.empty() )
     {
         if ( m_method == HEAD )
         {
             return GET_REQUEST;
         }
 
-        if ( m_content_length != 0 )
+        if ( m_content_length < 0 || m_content_length > MAX_BODY_SIZE )
+        {
+            return BAD_REQUEST;
+        }
+        if ( m_content_length != 0 || m_chunked )
         {
             m_check_state = CHECK_STATE_CONTENT;
+            m_body_start = m_checked_idx;
             return NO_REQUEST;
         }
 
         return GET_REQUEST;
     }
-    else if ( strncasecmp( text, "Connection:", 11 ) == 0 )
+
+    /*头部名与值都只是视图 值去掉了两端的空白*/
+    const char* colon = ( const char* )memchr( line.data, ':', line.len );
+    if ( ! colon )
+    {
+        LOG_DEBUG( "oop! unknow header %.*s", line.len, line.data );
+        return NO_REQUEST;
+    }
+    str_view name( line.data, colon - line.data );
+    str_view value = line.skip( name.len + 1 ).trim();
+
+    if ( name.equals_nocase( "Connection" ) )
     {
-        text += 11;
-        text += strspn( text, " \t" );
-        if ( strcasecmp( text, "keep-alive" ) == 0 )
+        if ( value.equals_nocase( "keep-alive" ) )
         {
             m_linger = true;
         }
     }
-    else if ( strncasecmp( text, "Content-Length:", 15 ) == 0 )
+    else if ( name.equals_nocase( "Content-Length" ) )
+    {
+        /*不是数字时为-1 太大时截到上限之上 空行时都按400处理*/
+        long length = value.to_long();
+        m_content_length = ( length > MAX_BODY_SIZE ) ? MAX_BODY_SIZE + 1 : length;
+    }
+    else if ( name.equals_nocase( "Transfer-Encoding" ) )
+    {
+        m_chunked = value.contains_nocase( "chunked" );
+    }
+    else if ( name.equals_nocase( "Upgrade" ) )
+    {
+        m_upgrade_h2c = value.contains_nocase( "h2c" );
+    }
+    else if ( name.equals_nocase( "HTTP2-Settings" ) )
     {
-        text += 15;
-        text += strspn( text, " \t" );
-        m_content_length = atol( text );
+        m_h2_settings = value;
     }
-    else if ( strncasecmp( text, "Host:", 5 ) == 0 )
+    else if ( name.equals_nocase( "Host" ) )
     {
-        text += 5;
-        text += strspn( text, " \t" );
-        m_host = text;
+        m_host = value;
     }
     else
     {
-        printf( "oop! unknow header %s\n", text );
+        LOG_DEBUG( "oop! unknow header %.*s", line.len, line.data );
     }
 
     return NO_REQUEST;
 
 }
 
-http_conn::HTTP_CODE http_conn::parse_content( char* text )
+http_conn::HTTP_CODE http_conn::parse_content()
 {
-    if ( m_read_idx >= ( m_content_length + m_checked_idx ) )
+    if ( m_chunked )
     {
-        text[ m_content_length ] = '\0';
-        return GET_REQUEST;
+        return parse_chunked();
     }
 
-    return NO_REQUEST;
+    /*整个请求体放得进读缓冲区 等它到齐即可*/
+    char* text = m_read_buf + m_body_start;
+    if ( m_body_fd == -1 && m_body_start + m_content_length < READ_BUFFER_SIZE )
+    {
+        if ( m_read_idx >= ( m_content_length + m_body_start ) )
+        {
+            m_body = text;
+            m_body_len = m_content_length;
+            return GET_REQUEST;
+        }
+        return NO_REQUEST;
+    }
+
+    /*放不下 已到达的部分先写进memfd 腾出缓冲区继续读*/
+    long need = m_content_length - m_body_len;
+    int take = m_read_idx - m_body_start;
+    if ( take > need )
+    {
+        take = need;
+    }
+    if ( ! spill_body( text, take ) )
+    {
+        return INTERNAL_ERROR;
+    }
+    consume_body( take );
+    return ( m_body_len == m_content_length ) ? GET_REQUEST : NO_REQUEST;
+}
+
+/*chunked请求体 边解码边写进memfd 长度事先未知*/
+http_conn::HTTP_CODE http_conn::parse_chunked()
+{
+    char* start = m_read_buf + m_body_start;
+    char* p = start;
+    char* end = m_read_buf + m_read_idx;
+    HTTP_CODE ret = NO_REQUEST;
+
+    while ( p < end && ret == NO_REQUEST )
+    {
+        switch ( m_chunk_state )
+        {
+            case CHUNK_SIZE:
+            {
+                char* lf = ( char* )memchr( p, '\n', end - p );
+                if ( ! lf )
+                {
+                    ret = ( end - p > 64 ) ? BAD_REQUEST : NO_REQUEST;
+                    end = p;
+                    break;
+                }
+                char* digits_end;
+                long size = strtol( p, &digits_end, 16 );
+                if ( digits_end == p || size < 0 || m_body_len + size > MAX_BODY_SIZE )
+                {
+                    ret = BAD_REQUEST;
+                    break;
+                }
+                p = lf + 1;
+                m_chunk_left = size;
+                m_chunk_state = ( size == 0 ) ? CHUNK_TRAILER : CHUNK_DATA;
+                break;
+            }
+            case CHUNK_DATA:
+            {
+                int take = ( end - p < m_chunk_left ) ? end - p : m_chunk_left;
+                if ( ! spill_body( p, take ) )
+                {
+                    ret = INTERNAL_ERROR;
+                    break;
+                }
+                p += take;
+                m_chunk_left -= take;
+                if ( m_chunk_left == 0 )
+                {
+                    m_chunk_state = CHUNK_DATA_END;
+                }
+                break;
+            }
+            case CHUNK_DATA_END:
+            {
+                if ( end - p < 2 )
+                {
+                    end = p;
+                    break;
+                }
+                if ( p[0] != '\r' || p[1] != '\n' )
+                {
+                    ret = BAD_REQUEST;
+                    break;
+                }
+                p += 2;
+                m_chunk_state = CHUNK_SIZE;
+                break;
+            }
+            case CHUNK_TRAILER:
+            {
+                /*忽略trailer中的头部 直到空行*/
+                char* lf = ( char* )memchr( p, '\n', end - p );
+                if ( ! lf )
+                {
+                    end = p;
+                    break;
+                }
+                bool empty = ( lf == p ) || ( lf == p + 1 && *p == '\r' );
+                p = lf + 1;
+                if ( empty )
+                {
+                    ret = GET_REQUEST;
+                }
+                break;
+            }
+        }
+    }
+
+    consume_body( p - start );
+    return ret;
+}
+
+bool http_conn::spill_body( const char* data, int len )
+{
+    if ( m_body_fd == -1 )
+    {
+        m_body_fd = memfd_create( "http_body", MFD_CLOEXEC );
+        if ( m_body_fd < 0 )
+        {
+            return false;
+        }
+    }
+    while ( len > 0 )
+    {
+        ssize_t n = ::write( m_body_fd, data, len );
+        if ( n < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        len -= n;
+        m_body_len += n;
+    }
+    return true;
+}
+
+void http_conn::consume_body( int len )
+{
+    if ( len <= 0 )
+    {
+        return;
+    }
+    char* start = m_read_buf + m_body_start;
+    memmove( start, start + len, m_read_idx - m_body_start - len );
+    m_read_idx -= len;
+}
+
+void http_conn::body_close()
+{
+    if ( m_body_fd != -1 )
+    {
+        close( m_body_fd );
+        m_body_fd = -1;
+    }
 }
 
 /*主状态机*/
@@ -282,20 +607,28 @@ http_conn::HTTP_CODE http_conn::process_read()
 {
     LINE_STATUS line_status = LINE_OK;
     HTTP_CODE ret = NO_REQUEST;
-    char* text = 0;
+    str_view line;
 
-    while ( ( ( m_check_state == CHECK_STATE_CONTENT ) && ( line_status == LINE_OK  ) )
-                || ( ( line_status = parse_line() ) == LINE_OK ) )
+    while ( true )
     {
-        text = get_line();
+        /*请求体不能再交给parse_line 它会越过请求体去找CRLF*/
+        if ( m_check_state == CHECK_STATE_CONTENT )
+        {
+            return parse_content();
+        }
+        if ( ( line_status = parse_line() ) != LINE_OK )
+        {
+            break;
+        }
+        line = get_line();
         m_start_line = m_checked_idx;
-        printf( "got 1 http line: %s\n", text );
+        LOG_DEBUG( "got 1 http line: %.*s", line.len, line.data );
 
         switch ( m_check_state )
         {
             case CHECK_STATE_REQUESTLINE:
             {
-                ret = parse_request_line( text );
+                ret = parse_request_line( line );
                 if ( ret == BAD_REQUEST )
                 {
                     return BAD_REQUEST;
@@ -304,25 +637,15 @@ http_conn::HTTP_CODE http_conn::process_read()
             }
             case CHECK_STATE_HEADER:
             {
-                ret = parse_headers( text );
+                ret = parse_headers( line );
                 if ( ret == BAD_REQUEST )
                 {
                     return BAD_REQUEST;
                 }
                 else if ( ret == GET_REQUEST )
                 {
-                    return do_request();
-                }
-                break;
-            }
-            case CHECK_STATE_CONTENT:
-            {
-                ret = parse_content( text );
-                if ( ret == GET_REQUEST )
-                {
-                    return do_request();
+                    return GET_REQUEST;
                 }
-                line_status = LINE_OPEN;
                 break;
             }
             default:
@@ -342,35 +665,73 @@ http_conn::HTTP_CODE http_conn::process_read()
  */
 http_conn::HTTP_CODE http_conn::do_request()
 {
-    strcpy( m_real_file, doc_root );
-    int len = strlen( doc_root );
-    strncpy( m_real_file + len, m_url, FILENAME_LEN - len - 1 );
-    if ( stat( m_real_file, &m_file_stat ) < 0 )
+    /*缓存中已有完整应答 连stat也省掉*/
+    if ( m_method == GET && ( m_cached || ( m_cached = m_cache.get( m_url ) ) ) )
     {
-        return NO_RESOURCE;
+        return FILE_REQUEST;
     }
 
-    if ( ! ( m_file_stat.st_mode & S_IROTH ) )
+    HTTP_CODE ret = stat_file( m_url, m_real_file, &m_file_stat );
+    if ( ret != FILE_REQUEST )
     {
-        return FORBIDDEN_REQUEST;
+        return ret;
     }
+    LOG_DEBUG( "文件%s", m_real_file );
 
-    if ( S_ISDIR( m_file_stat.st_mode ) )
+    /*cgi-bin下的可执行文件交给cgi服务器执行 输出由主线程转发给客户*/
+    if ( cgi == 1 && strncmp( m_url, cgi_prefix, strlen( cgi_prefix ) ) == 0 )
     {
-        return BAD_REQUEST;
+        if ( strstr( m_url, ".." ) || ! ( m_file_stat.st_mode & S_IXOTH ) )
+        {
+            return FORBIDDEN_REQUEST;
+        }
+        char program[ PATH_MAX ];
+        if ( ! realpath( m_real_file, program ) )
+        {
+            return NO_RESOURCE;
+        }
+        return connect_cgi( program );
     }
-    printf("文件%s\n",m_real_file);
-    
-    if (cgi == 1)
+
+    int fd = open( m_real_file, O_RDONLY );
+    /*stat结果可能是TTL内缓存的 文件可能已经删除 去掉过时的结果*/
+    if ( fd < 0 )
     {
-        /* 与my_cgi进行连接　交互数据*/
-        send_to_mycgi();
+        m_paths.remove( m_url );
+        return NO_RESOURCE;
     }
-    
-    int fd = open( m_real_file, O_RDONLY );
+    /*以打开的文件为准 文件变短时不会映射到文件末尾之外*/
+    fstat( fd, &m_file_stat );
 
-    /*起始地址(默认NULL) 指定内存段长度 内存段的访问权限 控制内存段内容被修改后程序的行为　被映射的文件描述符　从何处开始映射*/
-    m_file_address = ( char* )mmap( NULL, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    /*小文件直接读进缓存的内存区 一次send发出整个应答 不再mmap*/
+    if ( m_method == GET && m_file_stat.st_size <= m_cache.max_file_size() )
+    {
+        m_cached = m_cache.load( m_url, fd, m_file_stat.st_size );
+        if ( m_cached )
+        {
+            close( fd );
+            return FILE_REQUEST;
+        }
+    }
+
+    /*内核TLS时由SSL_sendfile发送 文件内容不经过用户态*/
+    if ( m_ktls )
+    {
+        m_file_fd = fd;
+        return FILE_REQUEST;
+    }
+
+    /*空文件不映射 process_write按长度为0处理*/
+    if ( m_file_stat.st_size > 0 )
+    {
+        char* address = map_file( fd, m_file_stat.st_size );
+        if ( address == MAP_FAILED )
+        {
+            close( fd );
+            return INTERNAL_ERROR;
+        }
+        m_file_address = address;
+    }
 
     /**
      * 这个有被问到过，我当时没听清问题，理解成了关闭之后是否会解除映射关系，不会
@@ -383,19 +744,104 @@ http_conn::HTTP_CODE http_conn::do_request()
     return FILE_REQUEST;
 }
 
+/*结果连同不存在 不可读的都进m_paths TTL内同一url不再规范化和stat*/
+http_conn::HTTP_CODE http_conn::stat_file( const char* url, char* real_file, struct stat* st )
+{
+    int code;
+    if ( m_paths.get( url, code, *st, real_file, FILENAME_LEN ) )
+    {
+        return ( HTTP_CODE )code;
+    }
+
+    path_entry entry;
+    if ( ! path_cache::normalize( doc_root, url, entry.real_file ) )
+    {
+        entry.code = FORBIDDEN_REQUEST;
+    }
+    else if ( entry.real_file.size() >= ( size_t )FILENAME_LEN || stat( entry.real_file.c_str(), &entry.st ) < 0 )
+    {
+        entry.code = NO_RESOURCE;
+    }
+    else if ( ! ( entry.st.st_mode & S_IROTH ) )
+    {
+        entry.code = FORBIDDEN_REQUEST;
+    }
+    else if ( S_ISDIR( entry.st.st_mode ) )
+    {
+        entry.code = BAD_REQUEST;
+    }
+    else
+    {
+        entry.code = FILE_REQUEST;
+    }
+
+    if ( entry.code == FILE_REQUEST )
+    {
+        strcpy( real_file, entry.real_file.c_str() );
+        *st = entry.st;
+    }
+    else
+    {
+        /*只有文件才用得到路径 不存的话过长的路径也能命中*/
+        entry.real_file.clear();
+    }
+    m_paths.put( url, entry );
+    return ( HTTP_CODE )entry.code;
+}
+
+/*失败时返回MAP_FAILED*/
+char* http_conn::map_file( int fd, off_t size )
+{
+    /*起始地址(默认NULL) 指定内存段长度 内存段的访问权限 控制内存段内容被修改后程序的行为　被映射的文件描述符　从何处开始映射*/
+    char* address = ( char* )mmap( NULL, size, PROT_READ, MAP_PRIVATE | io_map_flags( fd, size ), fd, 0 );
+    if ( address != MAP_FAILED )
+    {
+        io_advise_map( address, size );
+    }
+    return address;
+}
+
 /**
  * 由于本项目侧重于网络方面以及性能的提升
  * 故对cgi的交互处理的不是很严格 仅采用　/r/n协议
  * 但也是基于fastcgi的思想　即通过socket进行数据交互
  * 详情请参考
  * http://www.php-internals.com/book/?p=chapt02/02-02-03-fastcgi
- * 
+ *
+ * 发送程序的绝对路径后 cgi服务器把程序的标准输出接到这条连接上 程序退出时连接关闭
+ * 这里只建立连接 输出的转发在cgi_forward中由主线程完成
  */
-void http_conn::send_to_mycgi()
+http_conn::HTTP_CODE http_conn::connect_cgi( const char* program )
 {
+    /*接上了进程池的共享内存 请求体与程序路径放得下时不建连接*/
+    if ( m_cgi_shm && m_body_len <= SHM_BODY_SIZE && strlen( program ) < ( size_t )SHM_PROGRAM_LEN )
+    {
+        int id = m_cgi_shm->reserve();
+        if ( id >= 0 )
+        {
+            shm_slot& s = m_cgi_shm->slot( id );
+            strcpy( s.program, program );
+            s.body_len = m_body_len;
+            if ( m_body_len > 0 && m_body )
+            {
+                memcpy( s.body, m_body, m_body_len );
+            }
+            else if ( m_body_len > 0 && pread( m_body_fd, s.body, m_body_len, 0 ) != m_body_len )
+            {
+                m_cgi_shm->release( id );
+                return INTERNAL_ERROR;
+            }
+            m_cgi_shm->start( id );
+            STAT_INC( cgi_shm );
+            m_cgi_slot = id;
+            m_cgi_held = 0;
+            m_cgi_eof = false;
+            return CGI_REQUEST;
+        }
+    }
+
     const char* ip = "127.0.0.1";
     int port = 8888;
-    char buff[200] = "/bin/ls\r\n";
 
     struct sockaddr_in server_address;
     bzero( &server_address, sizeof( server_address ) );
@@ -403,114 +849,437 @@ void http_conn::send_to_mycgi()
     inet_pton( AF_INET, ip, &server_address.sin_addr );
     server_address.sin_port = htons( port );
 
-    int sockfd = socket( PF_INET, SOCK_STREAM, 0 );
-    assert( sockfd >= 0 );
+    int sockfd = socket( PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+    if ( sockfd < 0 )
+    {
+        return INTERNAL_ERROR;
+    }
     if ( connect( sockfd, ( struct sockaddr* )&server_address, sizeof( server_address ) ) < 0 )
     {
-        printf( "connection failed\n" );
+        LOG_WARN( "connect to cgi server failed: %s", strerror( errno ) );
+        close( sockfd );
+        return INTERNAL_ERROR;
     }
-    else
+
+    /*程序路径与请求体长度 随后是请求体本身 cgi程序从标准输入读取*/
+    char line[ PATH_MAX + 32 ];
+    int len = snprintf( line, sizeof( line ), "%s %ld\r\n", program, m_body_len );
+    if ( send( sockfd, line, len, 0 ) != len || ! send_body( sockfd ) || pipe2( m_cgi_pipe, O_NONBLOCK | O_CLOEXEC ) < 0 )
     {
-        /*向cgi服务器发送数据并获得返回数据*/
-        send (sockfd , buff, strlen(buff), 0);
-        memset(buff, '\0', sizeof(buff));
-        recv (sockfd, buff, sizeof(buff), 0);
-        printf("\n\n收到%s\n\n", buff);
+        close( sockfd );
+        return INTERNAL_ERROR;
     }
-    
-    close( sockfd );
-    return ;
-}
 
-void http_conn::unmap()
-{
-    if( m_file_address )
+    setnonblocking( sockfd );
+    STAT_INC( cgi_tcp );
+    m_cgi_fd = sockfd;
+    m_cgi_registered = false;
+    m_cgi_pending = 0;
+    m_cgi_eof = false;
+    /*上游socket的事件也要能找到本连接*/
+    if ( m_users )
     {
-        munmap( m_file_address, m_file_stat.st_size );
-        m_file_address = 0;
+        m_users->attach( sockfd, this );
     }
+    return CGI_REQUEST;
 }
 
-bool http_conn::write()
+/**
+ * 上游socket此时还是阻塞的 cgi程序边读我们边写
+ * 要求cgi程序先读完请求体再大量输出 否则双方都会阻塞在写上 发送超时兜底
+ */
+bool http_conn::send_body( int sockfd )
 {
-    int temp = 0;
-    int bytes_have_send = 0;
-    int bytes_to_send = m_write_idx;
-    if ( bytes_to_send == 0 )
+    if ( m_body_len == 0 )
     {
-        modfd( m_epollfd, m_sockfd, EPOLLIN );
-        init();
         return true;
     }
-
-    while( true )
+    struct timeval timeout = { CGI_SEND_TIMEOUT, 0 };
+    setsockopt( sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof( timeout ) );
+    if ( m_body )
     {
-        temp = writev( m_sockfd, m_iv, m_iv_count );
-        if ( temp <= -1 )
+        long sent = 0;
+        while ( sent < m_body_len )
         {
-            /** 
-             * 如果TCP写缓冲没有空间　则等待下一轮EPOLLOUT事件
-             * 虽然在此期间服务器无法立即接受到同一客户的下一个请求
-             * 但是这可以保证连接的完整性
-             */
-            if( errno == EAGAIN )
+            ssize_t n = send( sockfd, m_body + sent, m_body_len - sent, MSG_NOSIGNAL );
+            if ( n <= 0 )
             {
-                modfd( m_epollfd, m_sockfd, EPOLLOUT );
-                return true;
+                return false;
             }
-            unmap();
-            return false;
+            sent += n;
         }
-
-        bytes_to_send -= temp;
-        bytes_have_send += temp;
-        if ( bytes_to_send <= bytes_have_send )
+    }
+    else if ( m_body_fd != -1 )
+    {
+        off_t offset = 0;
+        while ( offset < m_body_len )
         {
-            unmap();
-            if( m_linger )
-            {
-                init();
-                modfd( m_epollfd, m_sockfd, EPOLLIN );
-                return true;
-            }
-            else
+            if ( sendfile( sockfd, m_body_fd, &offset, m_body_len - offset ) <= 0 )
             {
-                modfd( m_epollfd, m_sockfd, EPOLLIN );
                 return false;
-            } 
+            }
         }
     }
+    return true;
 }
 
-/*下边几个函数都是一些相应结构的组织*/
-bool http_conn::add_response( const char* format, ... )
+void http_conn::cgi_close()
 {
-    if( m_write_idx >= WRITE_BUFFER_SIZE )
+    if ( m_cgi_slot != -1 )
     {
-        return false;
+        m_cgi_shm->release( m_cgi_slot );
+        m_cgi_slot = -1;
     }
-    va_list arg_list;
-    va_start( arg_list, format );
-    int len = vsnprintf( m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list );
-    if( len >= ( WRITE_BUFFER_SIZE - 1 - m_write_idx ) )
+    if ( m_cgi_fd == -1 )
     {
-        return false;
+        return;
     }
-    m_write_idx += len;
+    if ( m_users )
+    {
+        m_users->detach( m_cgi_fd );
+    }
+    removefd( m_epollfd, m_cgi_fd );
+    close( m_cgi_pipe[0] );
+    close( m_cgi_pipe[1] );
+    m_cgi_fd = -1;
+}
+
+void http_conn::queue_chunk( int len )
+{
+    m_iv[ 0 ].iov_base = m_chunk_buf;
+    m_iv[ 0 ].iov_len = len;
+    m_iv_count = 1;
+    m_bytes_to_send = len;
+}
+
+/**
+ * 先发完待发的头部/块头/块尾 再把管道中的数据splice给客户 管道空了才从上游再读
+ * 客户写不动时等EPOLLOUT 上游没数据时等上游的EPOLLIN 同一时刻只等其中一个
+ */
+bool http_conn::cgi_forward()
+{
+    if ( m_cgi_slot != -1 )
+    {
+        return cgi_forward_shm();
+    }
+    while ( true )
+    {
+        if ( m_bytes_to_send > 0 )
+        {
+            int temp = send_iov();
+            if ( temp < 0 )
+            {
+                if ( errno == EAGAIN )
+                {
+                    modfd( m_epollfd, m_sockfd, EPOLLOUT );
+                    return true;
+                }
+                return false;
+            }
+            m_bytes_to_send -= temp;
+            m_bytes_sent += temp;
+            consume_iov( temp );
+            continue;
+        }
+
+        if ( m_cgi_pending > 0 )
+        {
+            ssize_t n = splice( m_cgi_pipe[0], NULL, m_sockfd, NULL, m_cgi_pending, SPLICE_F_NONBLOCK | SPLICE_F_MOVE );
+            if ( n < 0 )
+            {
+                if ( errno == EAGAIN )
+                {
+                    modfd( m_epollfd, m_sockfd, EPOLLOUT );
+                    return true;
+                }
+                return false;
+            }
+            m_cgi_pending -= n;
+            m_bytes_sent += n;
+            if ( m_cgi_pending == 0 )
+            {
+                queue_chunk( snprintf( m_chunk_buf, sizeof( m_chunk_buf ), "\r\n" ) );
+            }
+            continue;
+        }
+
+        if ( m_cgi_eof )
+        {
+            cgi_close();
+            return finish_response();
+        }
+
+        /*用户态TLS不能把明文splice给客户 读进暂存区 块头 数据 块尾一起交给SSL_write*/
+        bool staged = m_ssl && ! m_ktls;
+        if ( staged && ! m_tls_stage )
+        {
+            m_tls_stage = new char[ CGI_CHUNK_SIZE ];
+        }
+        ssize_t n = staged ? recv( m_cgi_fd, m_tls_stage, CGI_CHUNK_SIZE, 0 )
+                           : splice( m_cgi_fd, NULL, m_cgi_pipe[1], NULL, CGI_CHUNK_SIZE, SPLICE_F_NONBLOCK | SPLICE_F_MOVE );
+        if ( n > 0 && staged )
+        {
+            cork( true );
+            queue_chunk( snprintf( m_chunk_buf, sizeof( m_chunk_buf ), "%zx\r\n", ( size_t )n ) );
+            m_iv[ 1 ].iov_base = m_tls_stage;
+            m_iv[ 1 ].iov_len = n;
+            m_iv[ 2 ].iov_base = ( char* )"\r\n";
+            m_iv[ 2 ].iov_len = 2;
+            m_iv_count = 3;
+            m_bytes_to_send += n + 2;
+        }
+        else if ( n > 0 )
+        {
+            cork( true );
+            m_cgi_pending = n;
+            queue_chunk( snprintf( m_chunk_buf, sizeof( m_chunk_buf ), "%zx\r\n", ( size_t )n ) );
+        }
+        else if ( n == 0 )
+        {
+            m_cgi_eof = true;
+            queue_chunk( snprintf( m_chunk_buf, sizeof( m_chunk_buf ), "0\r\n\r\n" ) );
+        }
+        else if ( errno == EAGAIN )
+        {
+            /*上游暂时没有输出 已经排好的块先发出去*/
+            cork( false );
+            if ( m_cgi_registered )
+            {
+                modfd( m_epollfd, m_cgi_fd, EPOLLIN );
+            }
+            else
+            {
+                addfd( m_epollfd, m_cgi_fd, true );
+                m_cgi_registered = true;
+            }
+            return true;
+        }
+        else
+        {
+            return false;
+        }
+    }
+}
+
+/**
+ * 共享内存上的转发 块数据直接指向槽的输出环 发完才推进环的tail 子进程据此背压
+ * 环中没有数据时返回 子进程写入后由m_cgi_shm->dispatch再调用
+ */
+bool http_conn::cgi_forward_shm()
+{
+    m_cgi_shm->set_owner( m_cgi_slot, this );
+    while ( true )
+    {
+        if ( m_bytes_to_send > 0 )
+        {
+            int temp = send_iov();
+            if ( temp < 0 )
+            {
+                if ( errno == EAGAIN )
+                {
+                    modfd( m_epollfd, m_sockfd, EPOLLOUT );
+                    return true;
+                }
+                return false;
+            }
+            m_bytes_to_send -= temp;
+            m_bytes_sent += temp;
+            consume_iov( temp );
+            continue;
+        }
+
+        if ( m_cgi_held > 0 )
+        {
+            m_cgi_shm->consume( m_cgi_slot, m_cgi_held );
+            m_cgi_held = 0;
+        }
+
+        if ( m_cgi_eof )
+        {
+            cgi_close();
+            return finish_response();
+        }
+
+        const char* data;
+        int n = m_cgi_shm->readable( m_cgi_slot, &data );
+        if ( n > 0 )
+        {
+            cork( true );
+            queue_chunk( snprintf( m_chunk_buf, sizeof( m_chunk_buf ), "%x\r\n", n ) );
+            m_iv[ 1 ].iov_base = ( char* )data;
+            m_iv[ 1 ].iov_len = n;
+            m_iv[ 2 ].iov_base = ( char* )"\r\n";
+            m_iv[ 2 ].iov_len = 2;
+            m_iv_count = 3;
+            m_bytes_to_send += n + 2;
+            m_cgi_held = n;
+        }
+        else if ( m_cgi_shm->finished( m_cgi_slot ) )
+        {
+            m_cgi_eof = true;
+            queue_chunk( snprintf( m_chunk_buf, sizeof( m_chunk_buf ), "0\r\n\r\n" ) );
+        }
+        else
+        {
+            cork( false );
+            return true;
+        }
+    }
+}
+
+void http_conn::unmap()
+{
+    if( m_file_address )
+    {
+        munmap( m_file_address, m_file_stat.st_size );
+        m_file_address = 0;
+    }
+    if( m_file_fd != -1 )
+    {
+        close( m_file_fd );
+        m_file_fd = -1;
+    }
+    m_file_left = 0;
+    m_cached.reset();
+}
+
+void http_conn::consume_iov( int bytes )
+{
+    for ( int i = 0; i < m_iv_count && bytes > 0; ++i )
+    {
+        int n = ( ( size_t )bytes < m_iv[i].iov_len ) ? bytes : m_iv[i].iov_len;
+        m_iv[i].iov_base = ( char* )m_iv[i].iov_base + n;
+        m_iv[i].iov_len -= n;
+        bytes -= n;
+    }
+}
+
+bool http_conn::finish_response()
+{
+    /*拔掉塞子 凑不满报文段的结尾立即发出*/
+    cork( false );
+    /*零拷贝发出的数据还引用着映射的文件或缓存的应答 收到完成通知之前不能unmap 也不能开始下一个请求*/
+    if ( zerocopy_waiting() )
+    {
+        reap_zerocopy();
+        if ( zerocopy_waiting() )
+        {
+            m_zc_parked = true;
+            modfd( m_epollfd, m_sockfd, 0 );
+            return true;
+        }
+    }
+    m_zc_parked = false;
+    access_log();
+    unmap();
+    if( m_linger && ! m_draining )
+    {
+        init();
+        modfd( m_epollfd, m_sockfd, EPOLLIN );
+        return true;
+    }
+    else
+    {
+        modfd( m_epollfd, m_sockfd, EPOLLIN );
+        return false;
+    }
+}
+
+bool http_conn::write()
+{
+    int temp = 0;
+    if ( m_h2 )
+    {
+        return write_h2();
+    }
+    /*cgi应答由cgi_forward边读边发*/
+    if ( m_cgi_fd != -1 || m_cgi_slot != -1 )
+    {
+        return cgi_forward();
+    }
+    if ( m_bytes_to_send == 0 )
+    {
+        modfd( m_epollfd, m_sockfd, EPOLLIN );
+        init();
+        return true;
+    }
+
+    while( true )
+    {
+        /*头部发完后剩下的是要sendfile的文件*/
+        if ( m_bytes_to_send > m_file_left )
+        {
+            temp = send_iov();
+        }
+        else
+        {
+            temp = tls_sendfile( m_ssl, m_file_fd, m_file_off, m_file_left );
+            if ( temp == 0 )
+            {
+                unmap();
+                return false;
+            }
+            if ( temp > 0 )
+            {
+                m_file_off += temp;
+                m_file_left -= temp;
+            }
+        }
+        if ( temp <= -1 )
+        {
+            /** 
+             * 如果TCP写缓冲没有空间　则等待下一轮EPOLLOUT事件
+             * 虽然在此期间服务器无法立即接受到同一客户的下一个请求
+             * 但是这可以保证连接的完整性
+             */
+            if( errno == EAGAIN )
+            {
+                modfd( m_epollfd, m_sockfd, EPOLLOUT );
+                return true;
+            }
+            unmap();
+            return false;
+        }
+
+        /*部分写出时跳过已经发出的部分 下次从剩余处继续*/
+        m_bytes_to_send -= temp;
+        m_bytes_sent += temp;
+        consume_iov( temp );
+        if ( m_bytes_to_send <= 0 )
+        {
+            return finish_response();
+        }
+    }
+}
+
+/*下边几个函数都是一些相应结构的组织*/
+bool http_conn::add_response( const char* format, ... )
+{
+    if( m_write_idx >= WRITE_BUFFER_SIZE )
+    {
+        return false;
+    }
+    va_list arg_list;
+    va_start( arg_list, format );
+    int len = vsnprintf( m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list );
+    if( len >= ( WRITE_BUFFER_SIZE - 1 - m_write_idx ) )
+    {
+        return false;
+    }
+    m_write_idx += len;
     va_end( arg_list );
     return true;
 }
 
 bool http_conn::add_status_line( int status, const char* title )
 {
+    m_status = status;
     return add_response( "%s %d %s\r\n", "HTTP/1.1", status, title );
 }
 
 bool http_conn::add_headers( int content_len )
 {
-    add_content_length( content_len );
-    add_linger();
-    add_blank_line();
+    return add_content_length( content_len ) && add_linger() && add_blank_line();
 }
 
 bool http_conn::add_content_length( int content_len )
@@ -578,17 +1347,48 @@ bool http_conn::process_write( HTTP_CODE ret )
             }
             break;
         }
+        /*长度未知 用chunked编码 内容由cgi_forward随后发送*/
+        case CGI_REQUEST:
+        {
+            add_status_line( 200, ok_200_title );
+            add_response( "%s", "Transfer-Encoding: chunked\r\n" );
+            add_linger();
+            add_blank_line();
+            /*头部与第一块输出合在一起发*/
+            cork( true );
+            break;
+        }
         case FILE_REQUEST:
         {
+            if ( m_cached )
+            {
+                send_cached();
+                return true;
+            }
             add_status_line( 200, ok_200_title );
             if ( m_file_stat.st_size != 0 )
             {
                 add_headers( m_file_stat.st_size );
                 m_iv[ 0 ].iov_base = m_write_buf;
                 m_iv[ 0 ].iov_len = m_write_idx;
+                /*TLS时头部与文件分成几次写 明文的writev与零拷贝(MSG_MORE)已经是整段*/
+                if ( m_ssl )
+                {
+                    cork( true );
+                }
+                if ( m_file_fd != -1 )
+                {
+                    m_iv_count = 1;
+                    m_file_off = 0;
+                    m_file_left = m_file_stat.st_size;
+                    m_bytes_to_send = m_write_idx + m_file_stat.st_size;
+                    return true;
+                }
                 m_iv[ 1 ].iov_base = m_file_address;
                 m_iv[ 1 ].iov_len = m_file_stat.st_size;
                 m_iv_count = 2;
+                m_zc_iov = 1;
+                m_bytes_to_send = m_write_idx + m_file_stat.st_size;
                 return true;
             }
             else
@@ -600,6 +1400,7 @@ bool http_conn::process_write( HTTP_CODE ret )
                     return false;
                 }
             }
+            break;
         }
         default:
         {
@@ -610,25 +1411,444 @@ bool http_conn::process_write( HTTP_CODE ret )
     m_iv[ 0 ].iov_base = m_write_buf;
     m_iv[ 0 ].iov_len = m_write_idx;
     m_iv_count = 1;
+    m_bytes_to_send = m_write_idx;
     return true;
 }
 
+/**
+ * 主线程在任务队列已满时调用 工作线程在请求排队过久时调用
+ * 应答只有几十字节 非阻塞地send一次即可
+ */
+void http_conn::shed( int status )
+{
+    ssize_t sent = 0;
+    /*HTTP/2连接上排在503前面的可能还有别的流的帧 改为GOAWAY 客户会重试没有处理的流*/
+    if ( m_h2 )
+    {
+        m_h2->goaway( h2_session::ENHANCE_YOUR_CALM );
+        if ( ! m_ssl )
+        {
+            send( m_sockfd, m_h2->out_data(), m_h2->out_len(), MSG_DONTWAIT | MSG_NOSIGNAL );
+        }
+        else if ( m_tls_ready )
+        {
+            tls_write( m_ssl, m_h2->out_data(), m_h2->out_len() );
+        }
+        close_conn();
+        return;
+    }
+    const char* response = ( status == 429 ) ? error_429_response : error_503_response;
+    if ( ! m_ssl )
+    {
+        sent = send( m_sockfd, response, strlen( response ), MSG_DONTWAIT | MSG_NOSIGNAL );
+    }
+    else if ( m_tls_ready )
+    {
+        sent = tls_write( m_ssl, response, strlen( response ) );
+    }
+    m_status = status;
+    m_bytes_sent = ( sent > 0 ) ? sent : 0;
+    access_log();
+    close_conn();
+}
+
 /*由线程池内的工作线程调用　处理http请求的入口*/
 void http_conn::process()
 {
-    /* 先处理read */
-    HTTP_CODE read_ret = process_read();
+    if ( m_h2 || h2_preface() )
+    {
+        process_h2();
+        return;
+    }
+
+    /* 先处理read 主线程已经解析过的请求不再解析 缓冲区中的请求已被消费 再解析只会得到NO_REQUEST */
+    HTTP_CODE read_ret = ( m_parsed_ret != NO_REQUEST ) ? m_parsed_ret : read_request();
     if ( read_ret == NO_REQUEST )
     {
         modfd( m_epollfd, m_sockfd, EPOLLIN );
         return;
     }
+    if ( read_ret == GET_REQUEST && m_upgrade_h2c && upgrade_h2() )
+    {
+        process_h2();
+        return;
+    }
+    if ( read_ret == GET_REQUEST )
+    {
+        read_ret = do_request();
+    }
 
     bool write_ret = process_write( read_ret );
     if ( ! write_ret )
     {
         close_conn();
+        return;
     }
 
     modfd( m_epollfd, m_sockfd, EPOLLOUT );
-}
\ No newline at end of file
+}
+
+/*由主线程调用 请求不完整时直接重新注册读事件 命中缓存时直接发送 都不经过线程池*/
+bool http_conn::process_inline()
+{
+    if ( m_h2 || h2_preface() )
+    {
+        return false;
+    }
+    HTTP_CODE read_ret = read_request();
+    if ( read_ret == NO_REQUEST )
+    {
+        modfd( m_epollfd, m_sockfd, EPOLLIN );
+        return true;
+    }
+    /*请求有错时也交给工作线程 由它回错误应答*/
+    m_parsed_ret = read_ret;
+    if ( read_ret != GET_REQUEST )
+    {
+        return false;
+    }
+
+    if ( m_method != GET || m_upgrade_h2c )
+    {
+        return false;
+    }
+    m_cached = m_cache.get( m_url );
+    if ( ! m_cached )
+    {
+        return false;
+    }
+
+    send_cached();
+    if ( ! write() )
+    {
+        close_conn();
+    }
+    return true;
+}
+
+/*缓存的应答已经包含状态行和头部 整段作为唯一的iovec*/
+void http_conn::send_cached()
+{
+    m_status = 200;
+    int which = ( m_linger && ! m_draining ) ? 1 : 0;
+    m_iv[ 0 ].iov_base = ( char* )m_cached->data[ which ];
+    m_iv[ 0 ].iov_len = m_cached->len[ which ];
+    m_iv_count = 1;
+    m_zc_iov = 0;
+    m_bytes_to_send = m_cached->len[ which ];
+}
+
+void http_conn::access_log()
+{
+    long latency = m_start_us ? now_us() - m_start_us : 0;
+    log_access( m_address, m_method, m_url, m_status, m_bytes_sent, latency );
+    m_status = 0;
+}
+
+long long http_conn::now_us()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( long long )ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * 明文时就是writev
+ * TLS时每次SSL_write一个iovec 部分写模式下返回实际写出的字节数 由调用者consume_iov
+ */
+ssize_t http_conn::send_iov()
+{
+    if ( ! m_ssl )
+    {
+        if ( m_zerocopy && m_zc_iov >= 0 && m_iv[ m_zc_iov ].iov_len >= ( size_t )m_zerocopy_min )
+        {
+            return send_zerocopy();
+        }
+        return writev( m_sockfd, m_iv, m_iv_count );
+    }
+    for ( int i = 0; i < m_iv_count; ++i )
+    {
+        if ( m_iv[i].iov_len > 0 )
+        {
+            return tls_write( m_ssl, ( const char* )m_iv[i].iov_base, m_iv[i].iov_len );
+        }
+    }
+    return 0;
+}
+
+/**
+ * 头部在写缓冲区里 很短 照常复制并带MSG_MORE 与后面的数据合成整段
+ * 头部发完后再把剩下的部分零拷贝发出 调用者照常consume_iov
+ */
+ssize_t http_conn::send_zerocopy()
+{
+    int first = 0;
+    while ( first < m_iv_count && m_iv[ first ].iov_len == 0 )
+    {
+        ++first;
+    }
+    struct msghdr msg;
+    memset( &msg, 0, sizeof( msg ) );
+    msg.msg_iov = m_iv + first;
+    if ( first < m_zc_iov )
+    {
+        msg.msg_iovlen = m_zc_iov - first;
+        return sendmsg( m_sockfd, &msg, MSG_MORE | MSG_NOSIGNAL );
+    }
+    msg.msg_iovlen = m_iv_count - first;
+    ssize_t ret = sendmsg( m_sockfd, &msg, MSG_ZEROCOPY | MSG_NOSIGNAL );
+    if ( ret > 0 )
+    {
+        ++m_zc_sent;
+        STAT_INC( zerocopy_sends );
+    }
+    /*待确认的零拷贝数据超过了optmem的限额 这一次改为复制*/
+    else if ( ret < 0 && errno == ENOBUFS )
+    {
+        ret = sendmsg( m_sockfd, &msg, MSG_NOSIGNAL );
+    }
+    return ret;
+}
+
+void http_conn::cork( bool on )
+{
+    if ( m_can_cork && m_corked != on )
+    {
+        set_cork( m_sockfd, on );
+        m_corked = on;
+    }
+}
+
+void http_conn::reap_zerocopy()
+{
+    bool copied = false;
+    m_zc_done += zerocopy_reap( m_sockfd, &copied );
+    /*出口设备不支持零拷贝 内核仍在复制 这个连接以后直接复制*/
+    if ( copied )
+    {
+        STAT_INC( zerocopy_copied );
+        m_zerocopy = false;
+    }
+}
+
+bool http_conn::zerocopy_complete()
+{
+    int error = 0;
+    socklen_t len = sizeof( error );
+    if ( getsockopt( m_sockfd, SOL_SOCKET, SO_ERROR, &error, &len ) < 0 || error != 0 )
+    {
+        return false;
+    }
+    reap_zerocopy();
+    if ( m_zc_parked )
+    {
+        if ( zerocopy_waiting() )
+        {
+            modfd( m_epollfd, m_sockfd, 0 );
+            return true;
+        }
+        return finish_response();
+    }
+    /*应答还没有发完 写不动时write会重新等待EPOLLOUT*/
+    return write();
+}
+
+/*SSL内部已经解密但没有读走的数据 socket不会再通知 解析不出完整请求时接着读*/
+http_conn::HTTP_CODE http_conn::read_request()
+{
+    HTTP_CODE ret = process_read();
+    while ( ret == NO_REQUEST && m_ssl && tls_pending( m_ssl ) > 0 && m_read_idx < READ_BUFFER_SIZE && read() )
+    {
+        ret = process_read();
+    }
+    return ret;
+}
+
+/*还没有解析过任何字节时才检查 序言不完整也先切换 剩下的部分由会话核对*/
+bool http_conn::h2_preface()
+{
+    int n = ( m_read_idx < h2_session::PREFACE_SIZE ) ? m_read_idx : h2_session::PREFACE_SIZE;
+    if ( m_checked_idx != 0 || n < 4 || memcmp( m_read_buf, h2_session::preface(), n ) != 0 )
+    {
+        return false;
+    }
+    m_h2 = new h2_session( m_address, false );
+    return true;
+}
+
+/*只升级没有请求体的GET TLS上只能通过ALPN协商*/
+bool http_conn::upgrade_h2()
+{
+    if ( m_ssl || m_method != GET || m_h2_settings.empty() || m_body_len != 0 )
+    {
+        return false;
+    }
+    m_h2 = new h2_session( m_address, true );
+    const char* settings = m_arena.copy( m_h2_settings );
+    if ( ! settings || ! m_h2->upgrade( settings, m_url ) )
+    {
+        delete m_h2;
+        m_h2 = NULL;
+        return false;
+    }
+    /*请求之后已经读到的字节是客户的连接序言*/
+    int left = m_read_idx - m_checked_idx;
+    memmove( m_read_buf, m_read_buf + m_checked_idx, left );
+    m_read_idx = left;
+    m_checked_idx = 0;
+    m_start_line = 0;
+    return true;
+}
+
+/**
+ * 工作线程解析帧 为头部收齐的流找到文件 帧的发送仍由主线程的write_h2完成
+ * 有帧要发时同时等EPOLLIN与EPOLLOUT 发送大文件期间也能收到新的请求和WINDOW_UPDATE
+ */
+void http_conn::process_h2()
+{
+    bool ok = true;
+    do
+    {
+        ok = m_h2->feed( m_read_buf, m_read_idx );
+        m_read_idx = 0;
+    }
+    while ( ok && m_ssl && tls_pending( m_ssl ) > 0 && read() );
+
+    h2_stream* s;
+    while ( ok && ( s = m_h2->next_request() ) )
+    {
+        serve_h2( s );
+    }
+    m_h2->pump();
+    modfd( m_epollfd, m_sockfd, ( m_h2->out_len() > 0 || m_h2->finished() ) ? EPOLLIN | EPOLLOUT : EPOLLIN );
+}
+
+/**
+ * 与do_request走同一条路: 先查应答缓存 小文件装入缓存 其余按io_policy映射
+ * cgi的输出转发独占连接的上游socket与管道 HTTP/2上暂不支持
+ */
+void http_conn::serve_h2( h2_stream* s )
+{
+    static const char* methods[] = { "GET", "POST", "HEAD", "PUT" };
+    for ( int i = 0; i < 4; ++i )
+    {
+        if ( s->method == methods[i] )
+        {
+            s->log_method = i;
+        }
+    }
+
+    const char* url = s->path.c_str();
+    HTTP_CODE ret = BAD_REQUEST;
+    if ( url[0] == '/' && ( s->log_method == GET || s->log_method == POST || s->log_method == PUT ) )
+    {
+        if ( s->log_method == GET && ( s->cached = m_cache.get( url ) ) )
+        {
+            m_h2->respond( s, 200, s->cached->body, s->cached->body_len );
+            return;
+        }
+
+        char real_file[ FILENAME_LEN ];
+        struct stat st;
+        ret = stat_file( url, real_file, &st );
+        if ( ret == FILE_REQUEST && strncmp( url, cgi_prefix, strlen( cgi_prefix ) ) == 0 )
+        {
+            m_h2->respond( s, 501, error_501_form, strlen( error_501_form ) );
+            return;
+        }
+        int fd = ( ret == FILE_REQUEST ) ? open( real_file, O_RDONLY ) : -1;
+        /*缓存的stat结果过时 文件已经不在了*/
+        if ( ret == FILE_REQUEST && fd < 0 )
+        {
+            m_paths.remove( url );
+            ret = NO_RESOURCE;
+        }
+        if ( fd >= 0 )
+        {
+            fstat( fd, &st );
+            if ( s->log_method == GET && st.st_size <= m_cache.max_file_size() )
+            {
+                s->cached = m_cache.load( url, fd, st.st_size );
+            }
+            if ( ! s->cached && st.st_size > 0 )
+            {
+                char* address = map_file( fd, st.st_size );
+                if ( address != MAP_FAILED )
+                {
+                    s->map = address;
+                    s->map_len = st.st_size;
+                }
+            }
+            close( fd );
+            if ( s->cached )
+            {
+                m_h2->respond( s, 200, s->cached->body, s->cached->body_len );
+                return;
+            }
+            if ( s->map || st.st_size == 0 )
+            {
+                m_h2->respond( s, 200, s->map, st.st_size );
+                return;
+            }
+        }
+        if ( ret == FILE_REQUEST )
+        {
+            ret = INTERNAL_ERROR;
+        }
+    }
+
+    int status = 500;
+    const char* form = error_500_form;
+    if ( ret == BAD_REQUEST )
+    {
+        status = 400;
+        form = error_400_form;
+    }
+    else if ( ret == NO_RESOURCE )
+    {
+        status = 404;
+        form = error_404_form;
+    }
+    else if ( ret == FORBIDDEN_REQUEST )
+    {
+        status = 403;
+        form = error_403_form;
+    }
+    m_h2->respond( s, status, form, strlen( form ) );
+}
+
+/*发送会话攒下的帧 发完后再生成下一批DATA帧 都发不动时等EPOLLIN上的WINDOW_UPDATE*/
+bool http_conn::write_h2()
+{
+    while ( true )
+    {
+        if ( m_h2->out_len() == 0 && ! m_h2->pump() )
+        {
+            if ( m_h2->finished() )
+            {
+                return false;
+            }
+            /*热升级排空中 流都结束后告诉客户到新进程重新连接*/
+            if ( m_draining && m_h2->idle() )
+            {
+                m_h2->goaway( h2_session::NO_ERROR );
+                continue;
+            }
+            modfd( m_epollfd, m_sockfd, EPOLLIN );
+            return true;
+        }
+
+        ssize_t n = m_ssl ? tls_write( m_ssl, m_h2->out_data(), m_h2->out_len() )
+                          : send( m_sockfd, m_h2->out_data(), m_h2->out_len(), MSG_NOSIGNAL );
+        if ( n < 0 )
+        {
+            if ( errno == EAGAIN )
+            {
+                modfd( m_epollfd, m_sockfd, EPOLLIN | EPOLLOUT );
+                return true;
+            }
+            return false;
+        }
+        m_h2->consume( n );
+    }
+}
@@ -26,6 +26,17 @@
 #include <stdarg.h>
 #include <errno.h>
 #include "locker.h"
+#include "slab.h"
+#include "file_cache.h"
+#include "path_cache.h"
+#include "rate_limit.h"
+#include "request_arena.h"
+#include "log.h"
+#include "tls.h"
+#include "http2.h"
+#include "cgi_shm.h"
+#include "zerocopy.h"
+#include "sock_profile.h"
 
 class http_conn
 {
@@ -34,22 +45,28 @@ public:
     /*读缓冲区的大小*/
     static const int READ_BUFFER_SIZE = 2048;
     static const int WRITE_BUFFER_SIZE = 1024;
+    /*请求体的上限*/
+    static const long MAX_BODY_SIZE = 64L * 1024 * 1024;
+    /*向cgi上游发送请求体的超时(秒)*/
+    static const int CGI_SEND_TIMEOUT = 5;
     /*HTTP请求方法*/
     enum METHOD { GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT, PATCH };
     /*解析客户时主状态机所处的状态*/
     enum CHECK_STATE { CHECK_STATE_REQUESTLINE = 0, CHECK_STATE_HEADER, CHECK_STATE_CONTENT };
     /*请求结果*/
-    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
+    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION, CGI_REQUEST };
     /*行读取结果*/
     enum LINE_STATUS { LINE_OK = 0, LINE_BAD, LINE_OPEN };
+    /*chunked请求体的解码状态 块大小行 块数据 块数据后的CRLF 结尾的trailer*/
+    enum CHUNK_STATE { CHUNK_SIZE = 0, CHUNK_DATA, CHUNK_DATA_END, CHUNK_TRAILER };
 
 public:
-    http_conn(){}
-    ~http_conn(){}
+    http_conn() : m_tls_stage( NULL ), m_h2( NULL ) {}
+    ~http_conn() { delete [] m_tls_stage; delete m_h2; }
 
 public:
-    /*初始化新接受的连接*/
-    void init( int sockfd, const sockaddr_in& addr );
+    /*初始化新接受的连接 limit_slot为m_limits中该客户IP的槽号*/
+    void init( int sockfd, const sockaddr_in& addr, int limit_slot = rate_limiter::UNLIMITED );
     /*关闭连接*/
     void close_conn( bool real_close = true );
     /*处理客户请求*/
@@ -58,21 +75,57 @@ public:
     bool read();
     /*非阻塞写*/
     bool write();
+    /*过载时拒绝该请求 回复503(超过客户的速率限制时为429)后关闭连接*/
+    void shed( int status = 503 );
+    /*该连接在m_limits中的槽号*/
+    int limit_slot() const { return m_limit_slot; }
+    /**
+     * 主线程内联处理 请求不完整或命中应答缓存时直接在主线程完成并返回true
+     * 需要读文件或cgi时返回false 由调用者交给线程池
+     */
+    bool process_inline();
+    /*fd是否是本连接的cgi上游socket*/
+    bool is_cgi_fd( int fd ) const { return m_cgi_fd != -1 && fd == m_cgi_fd; }
+    /**
+     * 在主线程中把cgi输出转发给客户 上游可读或客户可写时调用
+     * 返回false时调用者关闭连接
+     */
+    bool cgi_forward();
+    /*还有零拷贝发送没有收到完成通知 此时的EPOLLERR交给zerocopy_complete*/
+    bool zerocopy_waiting() const { return m_zc_sent != m_zc_done; }
+    /**
+     * 错误队列上有完成通知 收完后继续发送 或者完成等待中的应答
+     * socket上有真正的错误时返回false 调用者关闭连接
+     */
+    bool zerocopy_complete();
 
 private:
     /*初始化连接*/
     void init();
     /*解析http请求*/
     HTTP_CODE process_read();
+    HTTP_CODE read_request();
     /*填充http请求*/
     bool process_write( HTTP_CODE ret );
 
     /*分析http请求*/
-    HTTP_CODE parse_request_line( char* text );
-    HTTP_CODE parse_headers( char* text );
-    HTTP_CODE parse_content( char* text );
+    HTTP_CODE parse_request_line( str_view line );
+    HTTP_CODE parse_headers( str_view line );
+    HTTP_CODE parse_content();
+    HTTP_CODE parse_chunked();
+    /*把请求体的一段写进memfd*/
+    bool spill_body( const char* data, int len );
+    /*从读缓冲区中去掉请求体起始处已经处理过的len字节*/
+    void consume_body( int len );
+    void body_close();
     HTTP_CODE do_request();
-    char* get_line() { return m_read_buf + m_start_line; }
+    /*url对应的文件是否存在且可读 HTTP/1.1与HTTP/2共用*/
+    static HTTP_CODE stat_file( const char* url, char* real_file, struct stat* st );
+    /*按io_policy映射整个文件*/
+    static char* map_file( int fd, off_t size );
+    /*刚由parse_line找到的一行 不含行尾的CRLF*/
+    str_view get_line() const { return str_view( m_read_buf + m_start_line, m_checked_idx - 2 - m_start_line ); }
+    /*只找行尾 不改写读缓冲区*/
     LINE_STATUS parse_line();
 
     /*被process_write调用以填充HTTP应答*/
@@ -84,19 +137,69 @@ private:
     bool add_content_length( int content_length );
     bool add_linger();
     bool add_blank_line();
+    /*跳过m_iv中已经发出的bytes字节*/
+    void consume_iov( int bytes );
+    /*发送m_iv 明文时writev TLS时SSL_write*/
+    ssize_t send_iov();
+    /*m_iv[m_zc_iov]足够大时 前面的头部照常复制 之后的部分用MSG_ZEROCOPY发送*/
+    ssize_t send_zerocopy();
+    /*收取错误队列中的完成通知*/
+    void reap_zerocopy();
+    /*按m_sock.cork塞住或拔掉TCP_CORK 状态没变时不调用setsockopt*/
+    void cork( bool on );
+    void send_cached();
+    /*应答发完或被拒绝时记访问日志*/
+    void access_log();
+    static long long now_us();
+    /*把m_chunk_buf中的len字节作为下一段待发送数据*/
+    void queue_chunk( int len );
 
-    void send_to_mycgi();
+    /*连接cgi服务器并发送要执行的程序 成功返回CGI_REQUEST*/
+    HTTP_CODE connect_cgi( const char* program );
+    bool send_body( int sockfd );
+    bool cgi_forward_shm();
+    void cgi_close();
+    /*响应发送完毕 keep-alive时重置状态等待下一个请求*/
+    bool finish_response();
+
+    /*读缓冲区以客户端连接序言开头时切换到HTTP/2*/
+    bool h2_preface();
+    /*Upgrade: h2c 把刚解析完的请求作为流1*/
+    bool upgrade_h2();
+    void process_h2();
+    bool write_h2();
+    /*为HTTP/2的一个流找到文件并排好应答*/
+    void serve_h2( h2_stream* s );
 
 public:
     /*所有scoket上的事件都被注册到同一个epoll内核事件表中　所以将其设置为静态的*/
     static int m_epollfd;
-    /*统计用户数量*/
+    /*统计用户数量 主线程在init中加 关闭连接的线程(工作线程或leader)减 都用原子操作*/
     static int m_user_count;
+    /*fd到连接对象的稀疏表 连接关闭时把对象还给它*/
+    static conn_table< http_conn >* m_users;
+    /*热升级后旧进程排空中 响应发完即关闭连接 不再保持keep-alive*/
+    static bool m_draining;
+    /*小文件应答缓存*/
+    static file_cache m_cache;
+    /*url解析结果的缓存 含不存在的url*/
+    static path_cache m_paths;
+    /*按客户IP的速率与连接数限制*/
+    static rate_limiter m_limits;
+    /*不为NULL时监听socket上是TLS*/
+    static tls_context* m_tls;
+    /*不为NULL时cgi请求经共享内存交给进程池 不走TCP*/
+    static cgi_channel< http_conn >* m_cgi_shm;
+    /*不为0时明文连接上不小于该字节数的映射文件与缓存应答用MSG_ZEROCOPY发送*/
+    static long m_zerocopy_min;
+    /*TCP连接的socket选项*/
+    static sock_profile m_sock;
 
 private:
     /*该连接的socket和地址*/
     int m_sockfd;
     sockaddr_in m_address;
+    int m_limit_slot;
 
     /*初始化cgi*/
     int cgi = 1;
@@ -109,6 +212,8 @@ private:
     int m_checked_idx;
     /*当前正在解析的行的起始位置*/
     int m_start_line;
+    /*请求体在读缓冲区中的起始位置 头部结束时记下 请求体不按行解析 进度从这里量起*/
+    int m_body_start;
     /*写缓冲区*/
     char m_write_buf[ WRITE_BUFFER_SIZE ];
     int m_write_idx;
@@ -119,12 +224,27 @@ private:
 
     /*客户请求的目标文件的完整路径其内容等于doc_root + m_url, doc_root是网站根目录*/
     char m_real_file[ FILENAME_LEN ];
-    /*客户请求的目标文件名*/
-    char* m_url;
-    char* m_version;
+    /*本请求的内存区 以'\0'结尾的字符串都从这里切出*/
+    request_arena< READ_BUFFER_SIZE > m_arena;
+    /*客户请求的目标文件名 从m_arena中复制出的 其余都是指向读缓冲区的视图*/
+    const char* m_url;
+    str_view m_version;
     /*主机名*/
-    char* m_host;
+    str_view m_host;
+    /*请求带有Upgrade: h2c 以及HTTP2-Settings头的值*/
+    bool m_upgrade_h2c;
+    str_view m_h2_settings;
     int m_content_length;
+    /**
+     * 请求体 能整个放进读缓冲区时m_body指向缓冲区内
+     * 否则边读边写进memfd(m_body_fd) 读缓冲区只需容纳请求头
+     */
+    bool m_chunked;
+    char* m_body;
+    int m_body_fd;
+    long m_body_len;
+    CHUNK_STATE m_chunk_state;
+    long m_chunk_left;
     /*请求是否要保持连接*/
     bool m_linger;
 
@@ -133,9 +253,66 @@ private:
     /*目标文件的状态*/
     struct stat m_file_stat;
     /*writev执行写操作 便于集中写*/
-    struct iovec m_iv[2];
+    struct iovec m_iv[3];
     /*数量*/
     int m_iv_count;
+    /*m_iv中还没有发出去的字节数*/
+    int m_bytes_to_send;
+
+    /*主线程解析的结果 NO_REQUEST表示没有解析过 GET_REQUEST时工作线程直接do_request 出错时直接回错误应答*/
+    HTTP_CODE m_parsed_ret;
+    /*正在发送的缓存应答 发送期间持有引用*/
+    std::shared_ptr< const cached_response > m_cached;
+    /*访问日志用 应答状态码(0表示没有待记录的应答) 已发送字节数 收到请求第一个字节的时刻*/
+    int m_status;
+    long m_bytes_sent;
+    long long m_start_us;
+
+    /*TLS会话 握手是否完成 发送方向是否由内核加密*/
+    SSL* m_ssl;
+    bool m_tls_ready;
+    bool m_ktls;
+    /*内核TLS时不mmap 头部发完后SSL_sendfile剩下的m_file_left字节*/
+    int m_file_fd;
+    off_t m_file_off;
+    long m_file_left;
+    /*用户态TLS转发cgi输出的暂存区 第一次用到时分配*/
+    char* m_tls_stage;
+    /*切换到HTTP/2后的会话 之后读到的字节都交给它*/
+    h2_session* m_h2;
+
+    /**
+     * cgi输出的转发 上游socket -> 管道 -> 客户socket 全程splice 数据不进用户态
+     * 管道中的数据没有发完之前不再读上游 客户端慢时由此产生背压
+     */
+    int m_cgi_fd;
+    int m_cgi_pipe[2];
+    /*上游socket是否已经加入epoll*/
+    bool m_cgi_registered;
+    /*管道中还没有发给客户的字节数*/
+    int m_cgi_pending;
+    /*上游已经关闭*/
+    bool m_cgi_eof;
+    /*经共享内存转发时所占的槽 输出直接从槽的环中发出 m_cgi_held是已排进m_iv还没发完的字节数*/
+    int m_cgi_slot;
+    int m_cgi_held;
+    /*chunked编码的块头与块尾*/
+    char m_chunk_buf[ 32 ];
+
+    /**
+     * 零拷贝发送 m_zerocopy表示socket上已开启SO_ZEROCOPY
+     * m_zc_iov是m_iv中可以零拷贝的那一项(映射的文件或缓存的应答) 没有时为-1
+     * 已发出与已完成的零拷贝发送次数 两者相等之前应答引用的内存不能释放
+     * m_zc_parked表示应答已经发完 正在等完成通知再结束这个应答
+     */
+    bool m_zerocopy;
+    int m_zc_iov;
+    unsigned int m_zc_sent;
+    unsigned int m_zc_done;
+    bool m_zc_parked;
+    /*该连接可以TCP_CORK(TCP且打开了cork) 当前是否塞住*/
+    bool m_can_cork;
+    bool m_corked;
 };
 
 #endif
\ No newline at end of file
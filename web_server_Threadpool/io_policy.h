@@ -0,0 +1,75 @@
+/**
+ * Created by 刘嘉辉 on 11/14/18.
+ * Copyright (c) 2018 刘嘉辉 All rights reserved.
+ * @brief To immplmente io_policy.h.
+ */
+
+#ifndef IO_POLICY_H
+#define IO_POLICY_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include "stats.h"
+
+/**
+ * 映射文件的I/O策略
+ * 默认的mmap在第一次访问时才逐页缺页 冷的大文件会在主线程的writev里一页一页地等磁盘
+ * 按文件大小选择:
+ *   不超过POPULATE_MAX 映射时MAP_POPULATE 缺页在工作线程里一次做完
+ *   更大的文件 posix_fadvise让内核提前读 madvise(MADV_SEQUENTIAL)加大预读并及早回收读过的页
+ *   再对开头READAHEAD_WINDOW字节MADV_WILLNEED 让发送一开始就有数据
+ */
+static const off_t POPULATE_MAX = 1024 * 1024;
+static const off_t READAHEAD_WINDOW = 4 * 1024 * 1024;
+/*透明大页的对齐大小*/
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+/*mmap之前调用 返回附加的mmap标志*/
+inline int io_map_flags( int fd, off_t size )
+{
+    if( size <= POPULATE_MAX )
+    {
+        STAT_INC( io_populate );
+        return MAP_POPULATE;
+    }
+    posix_fadvise( fd, 0, size, POSIX_FADV_SEQUENTIAL );
+    posix_fadvise( fd, 0, ( size < READAHEAD_WINDOW ) ? size : READAHEAD_WINDOW, POSIX_FADV_WILLNEED );
+    return 0;
+}
+
+/*mmap成功之后调用*/
+inline void io_advise_map( void* addr, off_t size )
+{
+    if( size <= POPULATE_MAX )
+    {
+        return;
+    }
+    madvise( addr, size, MADV_SEQUENTIAL );
+    madvise( addr, ( size < READAHEAD_WINDOW ) ? size : READAHEAD_WINDOW, MADV_WILLNEED );
+    STAT_INC( io_sequential );
+}
+
+/**
+ * 按大页对齐申请内存并请求透明大页 内核未开启THP时退化为普通页
+ * size须是HUGE_PAGE_SIZE的倍数 用free释放
+ */
+inline char* alloc_huge( size_t size )
+{
+    void* p = NULL;
+    if( posix_memalign( &p, HUGE_PAGE_SIZE, size ) != 0 )
+    {
+        return NULL;
+    }
+    if( madvise( p, size, MADV_HUGEPAGE ) == 0 )
+    {
+        STAT_INC( io_huge_regions );
+    }
+    return ( char* )p;
+}
+
+#endif
@@ -0,0 +1,255 @@
+/**
+ * Created by 刘嘉辉 on 11/18/18.
+ * Copyright (c) 2018 刘嘉辉 All rights reserved.
+ * @brief To immplmente lock_profile.h.
+ */
+
+#ifndef LOCK_PROFILE_H
+#define LOCK_PROFILE_H
+
+#include <stdio.h>
+
+/**
+ * locker sem cond spin_locker rw_locker的争用统计 需要以 -DLOCK_PROFILE 编译 否则只有空实现 锁的代码与原来相同
+ * 每个锁在构造时给出所在的位置名 同名的锁(如各个缓存分片)合并统计
+ * 每个位置记录获取次数 其中需要等待的次数 以及等待时间与持有时间的直方图
+ * 计数记在各线程自己的块里 记录时不写共享的缓存行 SIGUSR1时把所有线程的块加起来打印
+ */
+#if defined( LOCK_PROFILE )
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+class lock_profile
+{
+public:
+    /*最多区分的位置数 超出的都记在第0个位置上*/
+    static const int MAX_SITES = 32;
+    /*第0桶是0ns 第i桶是[2^(i-1), 2^i)ns 最后一桶收下所有更长的*/
+    static const int BUCKETS = 32;
+
+    static lock_profile& instance()
+    {
+        static lock_profile profile;
+        return profile;
+    }
+
+    static long long now_ns()
+    {
+        struct timespec ts;
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        return ( long long )ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+    /*按名字取得位置号 锁的构造函数调用 名字须是字符串常量*/
+    int site( const char* name )
+    {
+        pthread_mutex_lock( &m_mutex );
+        int count = m_site_number;
+        int id = 0;
+        for( ; id < count; ++id )
+        {
+            if( strcmp( m_names[ id ], name ) == 0 )
+            {
+                break;
+            }
+        }
+        if( id == count )
+        {
+            if( count < MAX_SITES )
+            {
+                m_names[ count ] = name;
+                __atomic_store_n( &m_site_number, count + 1, __ATOMIC_RELEASE );
+            }
+            else
+            {
+                id = 0;
+            }
+        }
+        pthread_mutex_unlock( &m_mutex );
+        return id;
+    }
+
+    /*一次获取 contended表示没能立即拿到 wait_ns是等待的时间*/
+    void acquired( int site, bool contended, long long wait_ns )
+    {
+        site_counters& c = local().sites[ site ];
+        bump( c.acquired, 1 );
+        if( contended )
+        {
+            bump( c.contended, 1 );
+        }
+        bump( c.wait_ns, wait_ns );
+        bump( c.wait_hist[ bucket( wait_ns ) ], 1 );
+    }
+
+    /*一次释放 hold_ns是从拿到到释放的时间*/
+    void released( int site, long long hold_ns )
+    {
+        site_counters& c = local().sites[ site ];
+        bump( c.hold_ns, hold_ns );
+        bump( c.hold_hist[ bucket( hold_ns ) ], 1 );
+    }
+
+    /*由SIGUSR1与运行时计数器一起打印 只列出用过的位置*/
+    void dump( FILE* out )
+    {
+        int count = __atomic_load_n( &m_site_number, __ATOMIC_ACQUIRE );
+        int threads = 0;
+        for( thread_counters* t = __atomic_load_n( &m_threads, __ATOMIC_ACQUIRE ); t; t = t->next )
+        {
+            ++threads;
+        }
+        fprintf( out, "lock_threads %d\n", threads );
+        for( int id = 0; id < count; ++id )
+        {
+            site_counters sum;
+            memset( &sum, 0, sizeof( sum ) );
+            for( thread_counters* t = __atomic_load_n( &m_threads, __ATOMIC_ACQUIRE ); t; t = t->next )
+            {
+                const site_counters& c = t->sites[ id ];
+                sum.acquired += load( c.acquired );
+                sum.contended += load( c.contended );
+                sum.wait_ns += load( c.wait_ns );
+                sum.hold_ns += load( c.hold_ns );
+                for( int b = 0; b < BUCKETS; ++b )
+                {
+                    sum.wait_hist[ b ] += load( c.wait_hist[ b ] );
+                    sum.hold_hist[ b ] += load( c.hold_hist[ b ] );
+                }
+            }
+            if( sum.acquired == 0 )
+            {
+                continue;
+            }
+            const char* name = m_names[ id ];
+            fprintf( out, "lock %s acquired %lu contended %lu wait_ns %lu\n", name, sum.acquired, sum.contended, sum.wait_ns );
+            fprintf( out, "lock %s wait_p50_ns %lld wait_p99_ns %lld\n", name, percentile( sum.wait_hist, 50 ), percentile( sum.wait_hist, 99 ) );
+            print_hist( out, name, "wait_hist", sum.wait_hist );
+            /*sem与cond没有持有时间 rw_locker只有写锁的持有时间*/
+            if( sum.hold_ns > 0 )
+            {
+                fprintf( out, "lock %s hold_ns %lu hold_p50_ns %lld hold_p99_ns %lld\n",
+                         name, sum.hold_ns, percentile( sum.hold_hist, 50 ), percentile( sum.hold_hist, 99 ) );
+                print_hist( out, name, "hold_hist", sum.hold_hist );
+            }
+        }
+        fflush( out );
+    }
+
+private:
+    struct site_counters
+    {
+        unsigned long acquired;
+        unsigned long contended;
+        unsigned long wait_ns;
+        unsigned long hold_ns;
+        unsigned long wait_hist[ BUCKETS ];
+        unsigned long hold_hist[ BUCKETS ];
+    };
+
+    /*每个线程第一次记录时分配 挂到链表上 线程退出后也不释放 工作线程与进程同寿*/
+    struct thread_counters
+    {
+        site_counters sites[ MAX_SITES ];
+        thread_counters* next;
+    };
+
+    lock_profile() : m_site_number( 1 ), m_threads( NULL )
+    {
+        pthread_mutex_init( &m_mutex, NULL );
+        m_names[ 0 ] = "other";
+    }
+
+    thread_counters& local()
+    {
+        static thread_local thread_counters* counters = NULL;
+        if( ! counters )
+        {
+            counters = new thread_counters();
+            thread_counters* head = __atomic_load_n( &m_threads, __ATOMIC_RELAXED );
+            do
+            {
+                counters->next = head;
+            } while( ! __atomic_compare_exchange_n( &m_threads, &head, counters, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED ) );
+        }
+        return *counters;
+    }
+
+    /*只有所属线程写 不需要加锁的原子加 打印的线程读到的是某个时刻的值*/
+    static void bump( unsigned long& counter, long long n )
+    {
+        __atomic_store_n( &counter, counter + n, __ATOMIC_RELAXED );
+    }
+
+    static unsigned long load( const unsigned long& counter )
+    {
+        return __atomic_load_n( &counter, __ATOMIC_RELAXED );
+    }
+
+    static int bucket( long long ns )
+    {
+        if( ns <= 0 )
+        {
+            return 0;
+        }
+        int b = 64 - __builtin_clzll( ( unsigned long long )ns );
+        return b < BUCKETS ? b : BUCKETS - 1;
+    }
+
+    /*所在桶的上界*/
+    static long long percentile( const unsigned long* hist, int p )
+    {
+        unsigned long total = 0;
+        for( int b = 0; b < BUCKETS; ++b )
+        {
+            total += hist[ b ];
+        }
+        unsigned long seen = 0;
+        for( int b = 0; b < BUCKETS; ++b )
+        {
+            seen += hist[ b ];
+            if( seen * 100 >= total * p )
+            {
+                return b == 0 ? 0 : ( 1LL << b ) - 1;
+            }
+        }
+        return ( 1LL << ( BUCKETS - 1 ) ) - 1;
+    }
+
+    /*只打印非空的桶 形如 <上界ns>:<次数>*/
+    static void print_hist( FILE* out, const char* name, const char* label, const unsigned long* hist )
+    {
+        fprintf( out, "lock %s %s", name, label );
+        for( int b = 0; b < BUCKETS; ++b )
+        {
+            if( hist[ b ] )
+            {
+                fprintf( out, " %lld:%lu", b == 0 ? 0 : ( 1LL << b ) - 1, hist[ b ] );
+            }
+        }
+        fprintf( out, "\n" );
+    }
+
+private:
+    pthread_mutex_t m_mutex;
+    const char* m_names[ MAX_SITES ];
+    int m_site_number;
+    thread_counters* m_threads;
+};
+
+inline void dump_lock_profile( FILE* out )
+{
+    lock_profile::instance().dump( out );
+}
+
+#else
+
+inline void dump_lock_profile( FILE* )
+{
+}
+
+#endif
+
+#endif
@@ -10,19 +10,30 @@
 #include <exception>
 #include <pthread.h>
 #include <semaphore.h>
+#include <sched.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "lock_profile.h"
 
 /*封装信号量的类*/
 class sem
 {
 public:
-    /*创建并初始化信号量*/
-    sem()
+    /*创建并初始化信号量 site是-DLOCK_PROFILE时统计所用的位置名*/
+    explicit sem( const char* site = "sem" )
     {
         if( sem_init( &m_sem, 0, 0 ) != 0 )
         {
             /*构造函数没有返回值　可以通过抛出异常来报告错误*/
             throw std::exception();
         }
+#if defined( LOCK_PROFILE )
+        m_site = lock_profile::instance().site( site );
+#else
+        ( void )site;
+#endif
     }
 
     ~sem()
@@ -33,7 +44,23 @@ public:
     /*等待信号量*/
     bool wait()
     {
+#if defined( LOCK_PROFILE )
+        /*先试一次 拿不到才计时 计数中的contended就是真正睡下去的次数*/
+        if( sem_trywait( &m_sem ) == 0 )
+        {
+            lock_profile::instance().acquired( m_site, false, 0 );
+            return true;
+        }
+        long long start = lock_profile::now_ns();
+        if( sem_wait( &m_sem ) != 0 )
+        {
+            return false;
+        }
+        lock_profile::instance().acquired( m_site, true, lock_profile::now_ns() - start );
+        return true;
+#else
         return sem_wait( &m_sem ) == 0;
+#endif
     }
     /*增加信号量*/
     bool post()
@@ -43,6 +70,9 @@ public:
 
 private:
     sem_t m_sem;
+#if defined( LOCK_PROFILE )
+    int m_site;
+#endif
 };
 
 
@@ -50,12 +80,17 @@ private:
 class locker
 {
 public:
-    locker()
+    explicit locker( const char* site = "locker" )
     {
         if( pthread_mutex_init( &m_mutex, NULL ) != 0 )
         {
             throw std::exception();
         }
+#if defined( LOCK_PROFILE )
+        m_site = lock_profile::instance().site( site );
+#else
+        ( void )site;
+#endif
     }
     ~locker()
     {
@@ -63,15 +98,40 @@ public:
     }
     bool lock()
     {
+#if defined( LOCK_PROFILE )
+        if( pthread_mutex_trylock( &m_mutex ) == 0 )
+        {
+            m_acquired_ns = lock_profile::now_ns();
+            lock_profile::instance().acquired( m_site, false, 0 );
+            return true;
+        }
+        long long start = lock_profile::now_ns();
+        if( pthread_mutex_lock( &m_mutex ) != 0 )
+        {
+            return false;
+        }
+        m_acquired_ns = lock_profile::now_ns();
+        lock_profile::instance().acquired( m_site, true, m_acquired_ns - start );
+        return true;
+#else
         return pthread_mutex_lock( &m_mutex ) == 0;
+#endif
     }
     bool unlock()
     {
+#if defined( LOCK_PROFILE )
+        /*m_acquired_ns只有持有者读写 须在释放之前取*/
+        lock_profile::instance().released( m_site, lock_profile::now_ns() - m_acquired_ns );
+#endif
         return pthread_mutex_unlock( &m_mutex ) == 0;
     }
 
 private:
     pthread_mutex_t m_mutex;
+#if defined( LOCK_PROFILE )
+    int m_site;
+    long long m_acquired_ns;
+#endif
 };
 
 
@@ -81,7 +141,7 @@ class cond
 public:
 
     /*创建并初始化*/
-    cond()
+    explicit cond( const char* site = "cond" )
     {
         if( pthread_mutex_init( &m_mutex, NULL ) != 0 )
         {
@@ -92,6 +152,11 @@ public:
             pthread_mutex_destroy( &m_mutex );
             throw std::exception();
         }
+#if defined( LOCK_PROFILE )
+        m_site = lock_profile::instance().site( site );
+#else
+        ( void )site;
+#endif
     }
     ~cond()
     {
@@ -103,9 +168,16 @@ public:
     bool wait()
     {
         int ret = 0;
+#if defined( LOCK_PROFILE )
+        /*条件变量每次都要睡下去 记为一次需要等待的获取*/
+        long long start = lock_profile::now_ns();
+#endif
         pthread_mutex_lock( &m_mutex );
         ret = pthread_cond_wait( &m_cond, &m_mutex );
         pthread_mutex_unlock( &m_mutex );
+#if defined( LOCK_PROFILE )
+        lock_profile::instance().acquired( m_site, true, lock_profile::now_ns() - start );
+#endif
         return ret == 0;
     }
 
@@ -119,6 +191,441 @@ public:
 private:
     pthread_mutex_t m_mutex;
     pthread_cond_t m_cond;
+#if defined( LOCK_PROFILE )
+    int m_site;
+#endif
+};
+
+
+/**
+ * 下面几个同步原语直接建在futex上 无竞争时只有用户态的一次原子操作
+ * 需要等待时才进入内核 futex_wait在*addr不等于val时立即返回 不会错过唤醒
+ */
+inline void futex_wait( int* addr, int val )
+{
+    syscall( SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0 );
+}
+
+inline void futex_wake( int* addr, int n )
+{
+    syscall( SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0 );
+}
+
+/*只有一个CPU时持有者不可能在别处同时运行 自旋没有意义*/
+inline bool spin_worthwhile()
+{
+    static const bool multi = sysconf( _SC_NPROCESSORS_ONLN ) > 1;
+    return multi;
+}
+
+/*自旋等待时让出流水线 超线程的另一半可以继续执行*/
+inline void cpu_relax()
+{
+#if defined( __x86_64__ ) || defined( __i386__ )
+    __builtin_ia32_pause();
+#elif defined( __aarch64__ )
+    asm volatile( "yield" ::: "memory" );
+#endif
+}
+
+
+/**
+ * 先自旋再睡眠的互斥锁 与locker接口相同
+ * 临界区很短时持有者马上就会释放 自旋一会儿比进内核睡眠再被唤醒便宜得多
+ * 自旋次数是自适应的: 记录最近拿到锁所需自旋次数的滑动平均 最多自旋它的两倍 一直拿不到的就很快直接睡眠
+ * 状态 0 未加锁 1 加锁且没有等待者 2 加锁且可能有等待者 只有2时解锁才需要futex_wake
+ * site为NULL时不计入-DLOCK_PROFILE的统计 给由别的锁代为统计的内部锁用
+ */
+class spin_locker
+{
+public:
+    static const int MAX_SPIN = 200;
+
+public:
+    explicit spin_locker( const char* site = "spin_locker" ) : m_state( 0 ), m_spin( MAX_SPIN / 8 )
+    {
+#if defined( LOCK_PROFILE )
+        m_site = site ? lock_profile::instance().site( site ) : -1;
+#else
+        ( void )site;
+#endif
+    }
+
+    bool try_lock()
+    {
+        if( ! try_acquire() )
+        {
+            return false;
+        }
+#if defined( LOCK_PROFILE )
+        if( m_site >= 0 )
+        {
+            m_acquired_ns = lock_profile::now_ns();
+            lock_profile::instance().acquired( m_site, false, 0 );
+        }
+#endif
+        return true;
+    }
+
+    bool lock()
+    {
+#if defined( LOCK_PROFILE )
+        if( m_site < 0 )
+        {
+            return acquire();
+        }
+        if( try_acquire() )
+        {
+            m_acquired_ns = lock_profile::now_ns();
+            lock_profile::instance().acquired( m_site, false, 0 );
+            return true;
+        }
+        /*自旋拿到的也算需要等待 等待时间包括自旋*/
+        long long start = lock_profile::now_ns();
+        acquire();
+        m_acquired_ns = lock_profile::now_ns();
+        lock_profile::instance().acquired( m_site, true, m_acquired_ns - start );
+        return true;
+#else
+        return acquire();
+#endif
+    }
+
+    bool unlock()
+    {
+#if defined( LOCK_PROFILE )
+        if( m_site >= 0 )
+        {
+            lock_profile::instance().released( m_site, lock_profile::now_ns() - m_acquired_ns );
+        }
+#endif
+        if( __atomic_exchange_n( &m_state, 0, __ATOMIC_RELEASE ) == 2 )
+        {
+            futex_wake( &m_state, 1 );
+        }
+        return true;
+    }
+
+private:
+    bool try_acquire()
+    {
+        int expected = 0;
+        return __atomic_compare_exchange_n( &m_state, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED );
+    }
+
+    bool acquire()
+    {
+        if( try_acquire() )
+        {
+            return true;
+        }
+        /*m_spin只是估计值 并发更新丢掉一次也无妨*/
+        int spin = __atomic_load_n( &m_spin, __ATOMIC_RELAXED );
+        int limit = ( spin * 2 + 16 < MAX_SPIN ) ? spin * 2 + 16 : MAX_SPIN;
+        if( ! spin_worthwhile() )
+        {
+            limit = 0;
+        }
+        for( int i = 0; i < limit; ++i )
+        {
+            cpu_relax();
+            if( __atomic_load_n( &m_state, __ATOMIC_RELAXED ) == 0 && try_acquire() )
+            {
+                __atomic_store_n( &m_spin, spin + ( i - spin ) / 8, __ATOMIC_RELAXED );
+                return true;
+            }
+        }
+        __atomic_store_n( &m_spin, spin + ( limit - spin ) / 8, __ATOMIC_RELAXED );
+        /*置为2后睡眠 拿到锁时也保持2 因为不知道身后还有没有别的等待者*/
+        while( __atomic_exchange_n( &m_state, 2, __ATOMIC_ACQUIRE ) != 0 )
+        {
+            futex_wait( &m_state, 2 );
+        }
+        return true;
+    }
+
+private:
+    int m_state;
+    int m_spin;
+#if defined( LOCK_PROFILE )
+    int m_site;
+    long long m_acquired_ns;
+#endif
+};
+
+
+/**
+ * 读多写少的读写锁 用于缓存这类几乎全是查找的数据
+ * pthread_rwlock的读者也要改同一个计数 多核上这条缓存行在读者之间来回传递
+ * 这里读者按线程分散到SLOTS个各占一条缓存行的计数上 读者之间不共享写入的缓存行
+ * 写者先由m_write_locker互斥 置m_writer后等所有计数归零 代价与SLOTS成正比
+ * 读者看到m_writer时退出 在m_write_locker上排队等写者结束 写者不会被源源不断的读者饿死
+ * 读者加计数与写者置标志之后都读对方的变量 两边都是SEQ_CST 至少有一方能看到另一方
+ * -DLOCK_PROFILE时读锁与写锁记在同一个位置上 读者可以同时有很多个 没有地方放各自拿到的时刻 只记写锁的持有时间
+ * m_write_locker由这里代为统计 自己不计数
+ */
+class rw_locker
+{
+public:
+    static const int SLOTS = 16;
+
+public:
+    explicit rw_locker( const char* site = "rw_locker" ) : m_writer( 0 ), m_write_locker( NULL )
+    {
+        for( int i = 0; i < SLOTS; ++i )
+        {
+            m_slots[i].readers = 0;
+        }
+#if defined( LOCK_PROFILE )
+        m_site = lock_profile::instance().site( site );
+#else
+        ( void )site;
+#endif
+    }
+
+    bool read_lock()
+    {
+        int* readers = &m_slots[ slot_index() ].readers;
+#if defined( LOCK_PROFILE )
+        long long start = 0;
+#endif
+        while( true )
+        {
+            __atomic_fetch_add( readers, 1, __ATOMIC_SEQ_CST );
+            if( __atomic_load_n( &m_writer, __ATOMIC_SEQ_CST ) == 0 )
+            {
+#if defined( LOCK_PROFILE )
+                lock_profile::instance().acquired( m_site, start != 0, start ? lock_profile::now_ns() - start : 0 );
+#endif
+                return true;
+            }
+            __atomic_fetch_sub( readers, 1, __ATOMIC_RELEASE );
+#if defined( LOCK_PROFILE )
+            if( start == 0 )
+            {
+                start = lock_profile::now_ns();
+            }
+#endif
+            m_write_locker.lock();
+            m_write_locker.unlock();
+        }
+    }
+
+    bool read_unlock()
+    {
+        __atomic_fetch_sub( &m_slots[ slot_index() ].readers, 1, __ATOMIC_RELEASE );
+        return true;
+    }
+
+    bool write_lock()
+    {
+#if defined( LOCK_PROFILE )
+        /*写锁很少 总是计时 等别的写者或者等读者退出都算需要等待*/
+        long long start = lock_profile::now_ns();
+        bool contended = ! m_write_locker.try_lock();
+        if( contended )
+        {
+            m_write_locker.lock();
+        }
+#else
+        m_write_locker.lock();
+#endif
+        __atomic_store_n( &m_writer, 1, __ATOMIC_SEQ_CST );
+        for( int i = 0; i < SLOTS; ++i )
+        {
+            /*读者的临界区很短 先自旋 等得久了让出CPU*/
+            for( int n = 0; __atomic_load_n( &m_slots[i].readers, __ATOMIC_SEQ_CST ) != 0; ++n )
+            {
+#if defined( LOCK_PROFILE )
+                contended = true;
+#endif
+                if( n < spin_locker::MAX_SPIN && spin_worthwhile() )
+                {
+                    cpu_relax();
+                }
+                else
+                {
+                    sched_yield();
+                }
+            }
+        }
+#if defined( LOCK_PROFILE )
+        m_acquired_ns = lock_profile::now_ns();
+        lock_profile::instance().acquired( m_site, contended, contended ? m_acquired_ns - start : 0 );
+#endif
+        return true;
+    }
+
+    bool write_unlock()
+    {
+#if defined( LOCK_PROFILE )
+        lock_profile::instance().released( m_site, lock_profile::now_ns() - m_acquired_ns );
+#endif
+        __atomic_store_n( &m_writer, 0, __ATOMIC_RELEASE );
+        return m_write_locker.unlock();
+    }
+
+private:
+    /*每个线程第一次加读锁时轮流分到一个计数 之后一直用它*/
+    static int slot_index()
+    {
+        static int next = 0;
+        static thread_local int index = -1;
+        if( index < 0 )
+        {
+            index = __atomic_fetch_add( &next, 1, __ATOMIC_RELAXED ) % SLOTS;
+        }
+        return index;
+    }
+
+    struct alignas( 64 ) slot
+    {
+        int readers;
+    };
+
+    slot m_slots[ SLOTS ];
+    int m_writer;
+    spin_locker m_write_locker;
+#if defined( LOCK_PROFILE )
+    int m_site;
+    long long m_acquired_ns;
+#endif
+};
+
+
+/**
+ * 带谓词的条件变量 可以配合locker或spin_locker使用
+ * cond的wait没有谓词 signal也不要求持有锁 在wait之前发出的signal就丢了
+ * 这里wait在持有锁时检查谓词 不满足时先记下序号再解锁睡眠
+ * 只要通知方在持有同一把锁时修改谓词涉及的状态 通知一定发生在记下序号之后 futex_wait会立即返回 不会错过
+ * 等待者在持有锁时登记 没有等待者时通知不进内核
+ */
+class cond_var
+{
+public:
+    cond_var() : m_seq( 0 ), m_state( 0 ) {}
+
+    /*调用时持有lock 返回时仍持有lock且pred()为真*/
+    template< typename L, typename P >
+    void wait( L& lock, P pred )
+    {
+        while( ! pred() )
+        {
+            int seq = __atomic_load_n( &m_seq, __ATOMIC_ACQUIRE );
+            __atomic_fetch_add( &m_state, WAITER, __ATOMIC_SEQ_CST );
+            lock.unlock();
+            futex_wait( &m_seq, seq );
+            /*离开时带走一个唤醒名额(如果有)*/
+            unsigned long long state = __atomic_load_n( &m_state, __ATOMIC_RELAXED );
+            unsigned long long next;
+            do
+            {
+                next = state - WAITER - ( ( state & SIGNALS ) ? 1 : 0 );
+            } while( ! __atomic_compare_exchange_n( &m_state, &state, next, true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED ) );
+            lock.lock();
+        }
+    }
+
+    void notify_one()
+    {
+        wake( false );
+    }
+
+    void notify_all()
+    {
+        wake( true );
+    }
+
+private:
+    /**
+     * m_state的高32位是登记的等待者数 低32位是已经发出还没有被等待者带走的唤醒名额
+     * 等待者都已有名额时不必再进内核: 被唤醒的线程还没来得及运行时 连续的通知只有第一次调用futex_wake
+     */
+    static const unsigned long long WAITER = 1ULL << 32;
+    static const unsigned long long SIGNALS = WAITER - 1;
+
+    void wake( bool all )
+    {
+        __atomic_fetch_add( &m_seq, 1, __ATOMIC_SEQ_CST );
+        unsigned long long state = __atomic_load_n( &m_state, __ATOMIC_SEQ_CST );
+        unsigned long long next;
+        do
+        {
+            unsigned long long waiters = state >> 32;
+            unsigned long long signals = state & SIGNALS;
+            if( signals >= waiters )
+            {
+                return;
+            }
+            next = ( waiters << 32 ) | ( all ? waiters : signals + 1 );
+        } while( ! __atomic_compare_exchange_n( &m_state, &state, next, true, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST ) );
+        futex_wake( &m_seq, all ? INT_MAX : 1 );
+    }
+
+private:
+    int m_seq;
+    unsigned long long m_state;
+};
+
+
+/**
+ * eventcount 让无锁队列的消费者在队列空时睡眠 生产者在没有等待者时只多一次内存屏障
+ * 消费者:
+ *     int key = ec.prepare_wait();
+ *     if( 队列中又有了数据 ) { ec.cancel_wait(); 去取 }
+ *     else ec.wait( key );
+ * 生产者: 放入数据之后 ec.notify()
+ * 消费者加等待数之后检查队列 生产者放入数据之后检查等待数 中间都有全屏障 至少一方能看到另一方
+ * 生产者在prepare_wait之后才推进m_epoch时 wait中的futex_wait立即返回
+ */
+class event_count
+{
+public:
+    event_count() : m_epoch( 0 ), m_waiters( 0 ) {}
+
+    int prepare_wait()
+    {
+        __atomic_fetch_add( &m_waiters, 1, __ATOMIC_SEQ_CST );
+        return __atomic_load_n( &m_epoch, __ATOMIC_SEQ_CST );
+    }
+
+    void cancel_wait()
+    {
+        __atomic_fetch_sub( &m_waiters, 1, __ATOMIC_RELAXED );
+    }
+
+    /*被唤醒或者key已经过时后返回 调用者重新检查队列*/
+    void wait( int key )
+    {
+        futex_wait( &m_epoch, key );
+        __atomic_fetch_sub( &m_waiters, 1, __ATOMIC_RELAXED );
+    }
+
+    void notify()
+    {
+        wake( 1 );
+    }
+
+    void notify_all()
+    {
+        wake( INT_MAX );
+    }
+
+private:
+    void wake( int n )
+    {
+        __atomic_thread_fence( __ATOMIC_SEQ_CST );
+        if( __atomic_load_n( &m_waiters, __ATOMIC_RELAXED ) == 0 )
+        {
+            return;
+        }
+        __atomic_fetch_add( &m_epoch, 1, __ATOMIC_SEQ_CST );
+        futex_wake( &m_epoch, n );
+    }
+
+private:
+    int m_epoch;
+    int m_waiters;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,345 @@
+/**
+ * Created by 刘嘉辉 on 11/15/18.
+ * Copyright (c) 2018 刘嘉辉 All rights reserved.
+ * @brief To immplmente log.h.
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+/**
+ * 异步日志
+ * 每个线程第一次写日志时创建自己的环形缓冲区 只有本线程写 后台线程读 不加锁
+ * 调试日志在本线程格式化成文本 访问日志只记录二进制字段 由后台线程格式化
+ * 后台线程轮询所有缓冲区 攒成大块后write 空闲时睡眠FLUSH_INTERVAL_MS
+ * 缓冲区满时丢弃并计数 请求线程永远不会阻塞在日志上
+ *
+ * 低于LOG_LEVEL的日志在编译期被消除 连参数都不求值
+ *     g++ -DLOG_LEVEL=0 ... 打开DEBUG
+ */
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO  1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_ERROR 3
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_AT( level, ... ) do { if( ( level ) >= LOG_LEVEL ) log_text( ( level ), __VA_ARGS__ ); } while( 0 )
+#define LOG_DEBUG( ... ) LOG_AT( LOG_LEVEL_DEBUG, __VA_ARGS__ )
+#define LOG_INFO( ... )  LOG_AT( LOG_LEVEL_INFO, __VA_ARGS__ )
+#define LOG_WARN( ... )  LOG_AT( LOG_LEVEL_WARN, __VA_ARGS__ )
+#define LOG_ERROR( ... ) LOG_AT( LOG_LEVEL_ERROR, __VA_ARGS__ )
+
+/*访问日志的一条记录 url截断到URL_MAX*/
+struct access_entry
+{
+    static const int URL_MAX = 160;
+
+    struct in_addr client;
+    unsigned short port;
+    /*经由Unix域socket连接 没有IP和端口*/
+    bool local;
+    short status;
+    int method;
+    long bytes;
+    long latency_us;
+    char url[ URL_MAX ];
+};
+
+struct log_record
+{
+    static const int TEXT_MAX = 200;
+    enum TYPE { TEXT = 0, ACCESS };
+
+    unsigned char type;
+    unsigned char level;
+    /*CLOCK_REALTIME_COARSE 微秒*/
+    long long time_us;
+    union
+    {
+        char text[ TEXT_MAX ];
+        access_entry access;
+    };
+};
+
+/*单生产者单消费者环形缓冲区 head只由所属线程写 tail只由后台线程写*/
+struct log_ring
+{
+    static const unsigned int RING_SIZE = 1024;
+
+    log_record slots[ RING_SIZE ];
+    /*两个下标隔开一条缓存行 避免生产者与消费者互相失效*/
+    unsigned long head;
+    char pad[ 64 ];
+    unsigned long tail;
+    unsigned long dropped;
+    log_ring* next;
+};
+
+class logger
+{
+public:
+    static const int FLUSH_INTERVAL_MS = 10;
+    static const int OUT_BUFFER_SIZE = 64 * 1024;
+
+public:
+    static logger& instance()
+    {
+        static logger l;
+        return l;
+    }
+
+    /*启动后台线程 access_path为空时不写访问日志*/
+    bool start( const char* access_path )
+    {
+        if( access_path )
+        {
+            m_access_fd = open( access_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644 );
+            if( m_access_fd < 0 )
+            {
+                return false;
+            }
+        }
+        m_running = true;
+        if( pthread_create( &m_thread, NULL, flusher, this ) != 0 )
+        {
+            m_running = false;
+            return false;
+        }
+        return true;
+    }
+
+    /*退出前调用 把缓冲区里剩下的都写出去*/
+    void stop()
+    {
+        if( ! m_running )
+        {
+            return;
+        }
+        __atomic_store_n( &m_running, false, __ATOMIC_RELEASE );
+        pthread_join( m_thread, NULL );
+        drain();
+    }
+
+    bool access_enabled() const { return m_access_fd >= 0; }
+
+    /*取一个空槽 满了返回NULL 填好后调用commit*/
+    log_record* reserve()
+    {
+        log_ring* ring = local_ring();
+        unsigned long head = ring->head;
+        if( head - __atomic_load_n( &ring->tail, __ATOMIC_ACQUIRE ) >= log_ring::RING_SIZE )
+        {
+            ++ring->dropped;
+            return NULL;
+        }
+        log_record* rec = &ring->slots[ head & ( log_ring::RING_SIZE - 1 ) ];
+        struct timespec ts;
+        clock_gettime( CLOCK_REALTIME_COARSE, &ts );
+        rec->time_us = ( long long )ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+        return rec;
+    }
+
+    void commit()
+    {
+        log_ring* ring = local_ring();
+        __atomic_store_n( &ring->head, ring->head + 1, __ATOMIC_RELEASE );
+    }
+
+    /*所有线程累计丢弃的条数*/
+    unsigned long dropped()
+    {
+        unsigned long total = 0;
+        for( log_ring* ring = __atomic_load_n( &m_rings, __ATOMIC_ACQUIRE ); ring; ring = ring->next )
+        {
+            total += __atomic_load_n( &ring->dropped, __ATOMIC_RELAXED );
+        }
+        return total;
+    }
+
+private:
+    logger() : m_rings( NULL ), m_running( false ), m_text_fd( STDOUT_FILENO ), m_access_fd( -1 ), m_text_len( 0 ), m_access_len( 0 ) {}
+
+    log_ring* local_ring()
+    {
+        static __thread log_ring* t_ring = NULL;
+        if( ! t_ring )
+        {
+            /*线程在进程生命期内不退出 缓冲区不回收*/
+            log_ring* ring = new log_ring;
+            ring->head = 0;
+            ring->tail = 0;
+            ring->dropped = 0;
+            ring->next = __atomic_load_n( &m_rings, __ATOMIC_RELAXED );
+            while( ! __atomic_compare_exchange_n( &m_rings, &ring->next, ring, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED ) )
+            {
+            }
+            t_ring = ring;
+        }
+        return t_ring;
+    }
+
+    static void* flusher( void* arg )
+    {
+        logger* l = ( logger* )arg;
+        while( __atomic_load_n( &l->m_running, __ATOMIC_ACQUIRE ) )
+        {
+            if( l->drain() == 0 )
+            {
+                usleep( FLUSH_INTERVAL_MS * 1000 );
+            }
+        }
+        return NULL;
+    }
+
+    /*把所有缓冲区中已提交的记录格式化写出 返回处理的条数*/
+    int drain()
+    {
+        int count = 0;
+        for( log_ring* ring = __atomic_load_n( &m_rings, __ATOMIC_ACQUIRE ); ring; ring = ring->next )
+        {
+            unsigned long tail = ring->tail;
+            unsigned long head = __atomic_load_n( &ring->head, __ATOMIC_ACQUIRE );
+            for( ; tail != head; ++tail, ++count )
+            {
+                format( ring->slots[ tail & ( log_ring::RING_SIZE - 1 ) ] );
+            }
+            __atomic_store_n( &ring->tail, tail, __ATOMIC_RELEASE );
+        }
+        flush( m_text_fd, m_text_buf, m_text_len );
+        flush( m_access_fd, m_access_buf, m_access_len );
+        return count;
+    }
+
+    void format( const log_record& rec )
+    {
+        static const char* level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+        static const char* method_names[] = { "GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT", "PATCH" };
+
+        char stamp[ 32 ];
+        time_t sec = rec.time_us / 1000000;
+        struct tm tm;
+        localtime_r( &sec, &tm );
+        strftime( stamp, sizeof( stamp ), "%Y-%m-%d %H:%M:%S", &tm );
+
+        if( rec.type == log_record::TEXT )
+        {
+            reserve_out( m_text_fd, m_text_buf, m_text_len );
+            m_text_len += snprintf( m_text_buf + m_text_len, OUT_BUFFER_SIZE - m_text_len, "%s.%06lld %s %s\n",
+                                    stamp, rec.time_us % 1000000, level_names[ rec.level & 3 ], rec.text );
+        }
+        else if( m_access_fd >= 0 )
+        {
+            const access_entry& a = rec.access;
+            char peer[ INET_ADDRSTRLEN + 8 ] = "unix";
+            if( ! a.local )
+            {
+                char ip[ INET_ADDRSTRLEN ];
+                inet_ntop( AF_INET, &a.client, ip, sizeof( ip ) );
+                snprintf( peer, sizeof( peer ), "%s:%u", ip, a.port );
+            }
+            const char* method = ( a.method >= 0 && a.method < 9 ) ? method_names[ a.method ] : "-";
+            reserve_out( m_access_fd, m_access_buf, m_access_len );
+            m_access_len += snprintf( m_access_buf + m_access_len, OUT_BUFFER_SIZE - m_access_len, "%s [%s] \"%s %s\" %d %ld %ldus\n",
+                                      peer, stamp, method, a.url, a.status, a.bytes, a.latency_us );
+        }
+    }
+
+    /*剩余空间不够一行时先写出*/
+    void reserve_out( int fd, char* buf, int& len )
+    {
+        if( len > OUT_BUFFER_SIZE - 512 )
+        {
+            flush( fd, buf, len );
+        }
+    }
+
+    static void flush( int fd, char* buf, int& len )
+    {
+        int done = 0;
+        while( fd >= 0 && done < len )
+        {
+            ssize_t n = ::write( fd, buf + done, len - done );
+            if( n <= 0 )
+            {
+                break;
+            }
+            done += n;
+        }
+        len = 0;
+    }
+
+private:
+    log_ring* m_rings;
+    bool m_running;
+    pthread_t m_thread;
+    int m_text_fd;
+    int m_access_fd;
+    char m_text_buf[ OUT_BUFFER_SIZE ];
+    int m_text_len;
+    char m_access_buf[ OUT_BUFFER_SIZE ];
+    int m_access_len;
+};
+
+/*由LOG_xxx宏调用 在本线程格式化 不做系统调用*/
+inline void log_text( int level, const char* format, ... )
+{
+    log_record* rec = logger::instance().reserve();
+    if( ! rec )
+    {
+        return;
+    }
+    rec->type = log_record::TEXT;
+    rec->level = level;
+    va_list arg_list;
+    va_start( arg_list, format );
+    vsnprintf( rec->text, log_record::TEXT_MAX, format, arg_list );
+    va_end( arg_list );
+    logger::instance().commit();
+}
+
+/*请求结束时记一条访问日志 只拷贝字段*/
+inline void log_access( const struct sockaddr_in& client, int method, const char* url, int status, long bytes, long latency_us )
+{
+    if( ! logger::instance().access_enabled() )
+    {
+        return;
+    }
+    log_record* rec = logger::instance().reserve();
+    if( ! rec )
+    {
+        return;
+    }
+    rec->type = log_record::ACCESS;
+    access_entry& a = rec->access;
+    a.client = client.sin_addr;
+    a.port = ntohs( client.sin_port );
+    a.local = client.sin_family == AF_UNIX;
+    a.status = status;
+    a.method = method;
+    a.bytes = bytes;
+    a.latency_us = latency_us;
+    if( url )
+    {
+        strncpy( a.url, url, access_entry::URL_MAX - 1 );
+        a.url[ access_entry::URL_MAX - 1 ] = '\0';
+    }
+    else
+    {
+        strcpy( a.url, "-" );
+    }
+    logger::instance().commit();
+}
+
+#endif
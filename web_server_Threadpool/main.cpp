@@ -15,16 +15,33 @@
 #include <stdlib.h>
 #include <cassert>
 #include <sys/epoll.h>
+#include <sys/wait.h>
+#include <time.h>
 
 #include "locker.h"
 #include "threadpool.h"
 #include "http_conn.h"
+#include "acceptor.h"
+#include "stats.h"
+#include "coro_conn.h"
+#include "log.h"
 
 #define MAX_FD 65536
 #define MAX_EVENT_NUMBER 10000
+/*热升级时通过该环境变量把监听socket的fd号传给新进程 多个时以逗号分隔*/
+#define LISTENFD_ENV "WEB_SERVER_LISTENFD"
+/*一个TCP监听socket加上若干个Unix域的*/
+#define MAX_LISTENERS 8
+/*旧进程等待在途请求完成的最长时间(秒)*/
+#define DRAIN_TIMEOUT 30
+/*文件描述符用完时隔多久再试accept(毫秒)*/
+#define ACCEPT_RETRY_MS 10
+/*线程池与主从模式的线程数 后者包括主线程*/
+#define THREAD_NUMBER 8
 
 extern int addfd( int epollfd, int fd, bool one_shot );
 extern int removefd( int epollfd, int fd );
+extern int setnonblocking( int fd );
 
 void addsig( int sig, void( handler )(int), bool restart = true )
 {
@@ -46,124 +63,745 @@ void show_error( int connfd, const char* info )
     close( connfd );
 }
 
+/*统一事件源 信号处理函数只把信号值写进管道*/
+static int sig_pipefd[2];
 
-int main( int argc, char* argv[] )
+void sig_handler( int sig )
+{
+    int save_errno = errno;
+    int msg = sig;
+    send( sig_pipefd[1], ( char* )&msg, 1, 0 );
+    errno = save_errno;
+}
+
+/*fd是第几个监听socket 不是时返回-1*/
+int listener_of( const acceptor* acc, int listener_number, int fd )
 {
-    if( argc <= 2 )
+    for( int l = 0; l < listener_number; ++l )
     {
-        printf( "usage: %s ip_address port_number\n", basename( argv[0] ) );
-        return 1;
+        if( acc[l].fd() == fd )
+        {
+            return l;
+        }
     }
-    const char* ip = argv[1];
-    int port = atoi( argv[2] );
-
-    addsig( SIGPIPE, SIG_IGN );
+    return -1;
+}
 
-    threadpool< http_conn >* pool = NULL;
-    try
+/**
+ * 热升级 fork出子进程并exec磁盘上新的可执行文件
+ * 监听socket不关闭而是留给子进程继承 fd号通过环境变量告诉它
+ * Unix域的socket文件也不删除 新进程继承的是同一个socket 代理的连接不会落空
+ * 另开一个close-on-exec的管道　读到EOF说明exec成功　读到数据说明失败
+ */
+bool hot_upgrade( char* argv[], const acceptor* acc, int listener_number )
+{
+    char fd_str[ 16 * MAX_LISTENERS ];
+    int len = 0;
+    for( int l = 0; l < listener_number; ++l )
     {
-        pool = new threadpool< http_conn >;
+        len += snprintf( fd_str + len, sizeof( fd_str ) - len, l ? ",%d" : "%d", acc[l].fd() );
     }
-    catch( ... )
+    setenv( LISTENFD_ENV, fd_str, 1 );
+
+    int exec_pipe[2];
+    if( pipe2( exec_pipe, O_CLOEXEC ) < 0 )
     {
-        return 1;
+        return false;
     }
-    
-    /*预先为每一个连接分配一个http_conn对象*/
-    http_conn* users = new http_conn[ MAX_FD ];
-    assert( users );
-    int user_count = 0;
 
-    int listenfd = socket( PF_INET, SOCK_STREAM, 0 );
-    assert( listenfd >= 0 );
-    struct linger tmp = { 1, 0 };
-    setsockopt( listenfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof( tmp ) );
+    pid_t pid = fork();
+    if( pid < 0 )
+    {
+        close( exec_pipe[0] );
+        close( exec_pipe[1] );
+        return false;
+    }
+    if( pid == 0 )
+    {
+        /*其余描述符都不能留给新进程 否则旧进程关闭连接时对端收不到FIN*/
+        long max_fd = sysconf( _SC_OPEN_MAX );
+        for( long fd = 3; fd < max_fd; ++fd )
+        {
+            if( listener_of( acc, listener_number, fd ) < 0 && fd != exec_pipe[1] )
+            {
+                close( fd );
+            }
+        }
+        /*监听socket是close-on-exec创建的 交给新进程前要清掉该标志*/
+        for( int l = 0; l < listener_number; ++l )
+        {
+            fcntl( acc[l].fd(), F_SETFD, 0 );
+        }
+        execv( argv[0], argv );
+        int err = errno;
+        ::write( exec_pipe[1], &err, sizeof( err ) );
+        _exit( 1 );
+    }
 
-    int ret = 0;
-    struct sockaddr_in address;
-    bzero( &address, sizeof( address ) );
-    address.sin_family = AF_INET;
-    inet_pton( AF_INET, ip, &address.sin_addr );
-    address.sin_port = htons( port );
+    close( exec_pipe[1] );
+    int err = 0;
+    int ret = ::read( exec_pipe[0], &err, sizeof( err ) );
+    close( exec_pipe[0] );
+    unsetenv( LISTENFD_ENV );
+    if( ret > 0 )
+    {
+        printf( "upgrade exec %s failed: %s\n", argv[0], strerror( err ) );
+        waitpid( pid, NULL, 0 );
+        return false;
+    }
+    printf( "upgrade: new process %d took over the listen sockets\n", pid );
+    return true;
+}
 
-    ret = bind( listenfd, ( struct sockaddr* )&address, sizeof( address ) );
-    assert( ret >= 0 );
+/*继承来的监听socket 逐个接管 返回接管的个数*/
+int inherit_listeners( const char* inherited, acceptor* acc, int backlog, int defer_secs )
+{
+    int listener_number = 0;
+    for( const char* p = inherited; *p && listener_number < MAX_LISTENERS; )
+    {
+        int fd = atoi( p );
+        fcntl( fd, F_SETFD, FD_CLOEXEC );
+        if( acc[ listener_number ].attach( fd, backlog, defer_secs ) >= 0 )
+        {
+            printf( "inherited %s listen socket %d\n", acc[ listener_number ].local() ? "unix" : "tcp", fd );
+            ++listener_number;
+        }
+        p = strchr( p, ',' );
+        if( ! p )
+        {
+            break;
+        }
+        ++p;
+    }
+    return listener_number;
+}
 
-    ret = listen( listenfd, 5 );
-    assert( ret >= 0 );
+/**
+ * 事件循环的状态
+ * 默认只有主线程运行事件循环 读到的请求交给线程池
+ * 主从(leader/follower)模式下所有线程轮流做leader 只有持有leader锁的线程访问这些状态
+ * 因此监听socket 限流表 cgi共享内存通道等原来只在主线程访问的对象仍然只有一个线程在用
+ */
+struct event_loop
+{
+    event_loop() : leader( "leader" ) {}
 
+    int epollfd;
+    acceptor* acc;
+    int listener_number;
+    /*上一轮accept预算用完 队列中可能还有连接 本轮不等待直接继续取 每个监听socket各自记录*/
+    bool accept_ready[ MAX_LISTENERS ];
+    bool any_ready;
+    /*有监听socket因文件描述符用完而停下 等待ACCEPT_RETRY_MS再重试 不以0超时空转*/
+    bool accept_starved;
+    /*升级后旧进程进入排空状态 不再accept 等在途请求完成后退出*/
+    bool draining;
+    time_t drain_start;
+    bool inline_mode;
+#if defined( __cpp_impl_coroutine )
+    bool coro_mode;
+#endif
+    char** argv;
+    conn_table< http_conn >* users;
+    /*主从模式下为NULL*/
+    threadpool< http_conn >* pool;
+    cgi_channel< http_conn >* cgi_shm;
+    /*主从模式 持有者是当前的leader*/
+    locker leader;
+    /*事件循环已经结束 其余线程拿到leader后退出*/
+    bool stop;
     epoll_event events[ MAX_EVENT_NUMBER ];
-    int epollfd = epoll_create( 5 );
-    assert( epollfd != -1 );
-    addfd( epollfd, listenfd, false );
-    http_conn::m_epollfd = epollfd;
+};
 
-    while( true )
+/**
+ * 事件循环的一轮 返回false时事件循环结束
+ * work为NULL时读到的请求交给线程池
+ * 否则是主从模式 每次只取一个事件 读到的请求放进*work 由调用者交出leader之后自己处理
+ */
+bool poll_events( event_loop& loop, http_conn** work )
+{
+    int timeout = loop.any_ready ? ( loop.accept_starved ? ACCEPT_RETRY_MS : 0 ) : ( loop.draining ? 1000 : -1 );
+#if defined( __cpp_impl_coroutine )
+    /*协程读请求头带有期限 没有事件时也要定期醒来让coro_reactor::expire检查*/
+    if( loop.coro_mode && ( timeout < 0 || timeout > coro_reactor::EXPIRE_INTERVAL_MS ) )
+    {
+        timeout = coro_reactor::EXPIRE_INTERVAL_MS;
+    }
+#endif
+    int number = epoll_wait( loop.epollfd, loop.events, work ? 1 : MAX_EVENT_NUMBER, timeout );
+    if ( ( number < 0 ) && ( errno != EINTR ) )
     {
-        int number = epoll_wait( epollfd, events, MAX_EVENT_NUMBER, -1 );
-        if ( ( number < 0 ) && ( errno != EINTR ) )
+        LOG_ERROR( "epoll failure: %s", strerror( errno ) );
+        return false;
+    }
+    int ret = 0;
+
+    for ( int i = 0; i < number; i++ )
+    {
+        int sockfd = loop.events[i].data.fd;
+        int l = listener_of( loop.acc, loop.listener_number, sockfd );
+        /*新连接放到本轮事件处理完之后统一accept*/
+        if( l >= 0 )
         {
-            printf( "epoll failure\n" );
-            break;
+            loop.accept_ready[l] = true;
+            loop.any_ready = true;
         }
 
-        for ( int i = 0; i < number; i++ )
+        else if( sockfd == sig_pipefd[0] )
         {
-            int sockfd = events[i].data.fd;
-            if( sockfd == listenfd )
+            char signals[ 1024 ];
+            while( ( ret = recv( sig_pipefd[0], signals, sizeof( signals ), 0 ) ) > 0 )
             {
-                struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof( client_address );
-                int connfd = accept( listenfd, ( struct sockaddr* )&client_address, &client_addrlength );
-                if ( connfd < 0 )
+                for( int j = 0; j < ret; ++j )
+                {
+                    if( signals[j] == SIGUSR1 )
+                    {
+                        printf( "log_dropped %lu\n", logger::instance().dropped() );
+                        http_conn::m_sock.dump( stdout );
+                        dump_stats( stdout );
+                        dump_lock_profile( stdout );
+                    }
+                    if( signals[j] == SIGUSR2 && ! loop.draining && hot_upgrade( loop.argv, loop.acc, loop.listener_number ) )
+                    {
+                        for( int k = 0; k < loop.listener_number; ++k )
+                        {
+                            epoll_ctl( loop.epollfd, EPOLL_CTL_DEL, loop.acc[k].fd(), 0 );
+                            close( loop.acc[k].fd() );
+                            loop.acc[k].reset();
+                            loop.accept_ready[k] = false;
+                        }
+                        loop.listener_number = 0;
+                        loop.any_ready = false;
+                        loop.accept_starved = false;
+                        loop.draining = true;
+                        http_conn::m_draining = true;
+                        loop.drain_start = time( NULL );
+                    }
+                }
+            }
+        }
+
+        /*进程池的子进程写出了cgi输出 交给各自的连接*/
+        else if( loop.cgi_shm && sockfd == loop.cgi_shm->doorbell() )
+        {
+            loop.cgi_shm->dispatch();
+        }
+
+        /*进程池退出了 在途的cgi连接无法完成*/
+        else if( loop.cgi_shm && sockfd == loop.cgi_shm->control() )
+        {
+            char buf[ 64 ];
+            if( recv( sockfd, buf, sizeof( buf ), 0 ) == 0 )
+            {
+                LOG_WARN( "cgi pool closed the shared memory channel" );
+                epoll_ctl( loop.epollfd, EPOLL_CTL_DEL, sockfd, 0 );
+                loop.cgi_shm->shutdown();
+            }
+        }
+
+#if defined( __cpp_impl_coroutine )
+        /*有协程在该fd上等待 恢复它*/
+        else if( loop.coro_mode && coro_reactor::dispatch( sockfd ) )
+        {
+            continue;
+        }
+#endif
+
+        /*fd上已经没有连接对象 说明连接已被关闭*/
+        else if( ! loop.users->get( sockfd ) )
+        {
+            continue;
+        }
+
+        /*cgi上游有数据或已关闭 继续转发*/
+        else if( loop.users->get( sockfd )->is_cgi_fd( sockfd ) )
+        {
+            http_conn* conn = loop.users->get( sockfd );
+            if( ! conn->cgi_forward() )
+            {
+                conn->close_conn();
+            }
+        }
+
+        /*零拷贝的完成通知放在错误队列上 也以EPOLLERR报告 收完之后再看是不是真的出错*/
+        else if( ( loop.events[i].events & EPOLLERR ) && loop.users->get( sockfd )->zerocopy_waiting() )
+        {
+            http_conn* conn = loop.users->get( sockfd );
+            if( ! conn->zerocopy_complete() )
+            {
+                conn->close_conn();
+            }
+        }
+
+        /*异常事件 直接关闭 不做过多处理*/
+        else if( loop.events[i].events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) )
+        {
+            loop.users->get( sockfd )->close_conn();
+        }
+
+        /*有读的数据了　向队列中添加处理任务*/
+        else if( loop.events[i].events & EPOLLIN )
+        {
+            http_conn* conn = loop.users->get( sockfd );
+            if( conn->read() )
+            {
+                /*该客户IP的令牌用完 回429 请求不进线程池*/
+                if( ! http_conn::m_limits.allow( conn->limit_slot() ) )
+                {
+                    STAT_INC( limit_requests );
+                    conn->shed( 429 );
+                    continue;
+                }
+                /*内联模式下缓存命中的小文件直接在主线程发送*/
+                if( loop.inline_mode && conn->process_inline() )
                 {
-                    printf( "errno is: %d\n", errno );
                     continue;
                 }
-                if( http_conn::m_user_count >= MAX_FD )
+                /*主从模式下由本线程交出leader之后处理*/
+                if( work )
                 {
-                    show_error( connfd, "Internal server busy" );
+                    *work = conn;
                     continue;
                 }
-                
-                /*初始化客户连接 及状态机的初始化*/
-                users[connfd].init( connfd, client_address );
+                /*向队列中添加客户端类 队列已满时直接回503 否则连接带着EPOLLONESHOT再也不会被处理*/
+                if( ! loop.pool->append( conn ) )
+                {
+                    STAT_INC( shed_queue_full );
+                    conn->shed();
+                }
+            }
+            else
+            {
+                conn->close_conn();
+            }
+        }
+        
+        /*内核缓冲区中发送空间不足 等待EPOLLOUT时间*/
+        else if( loop.events[i].events & EPOLLOUT )
+        {
+            http_conn* conn = loop.users->get( sockfd );
+            if( !conn->write() )
+            {
+                conn->close_conn();
+            }
+        }
+    }
+
+    loop.any_ready = false;
+    loop.accept_starved = false;
+    for( int l = 0; l < loop.listener_number; ++l )
+    {
+        if( ! loop.accept_ready[l] )
+        {
+            continue;
+        }
+        loop.acc[l].begin();
+        struct sockaddr_in client_address;
+        int connfd;
+        while( ( connfd = loop.acc[l].next( client_address ) ) >= 0 )
+        {
+            if( __atomic_load_n( &http_conn::m_user_count, __ATOMIC_RELAXED ) >= MAX_FD )
+            {
+                show_error( connfd, "Internal server busy" );
+                continue;
             }
 
-            /*异常事件 直接关闭 不做过多处理*/
-            else if( events[i].events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) )
+            /*该客户IP的连接数已到上限 直接关闭 不占连接对象*/
+            int slot = http_conn::m_limits.connect( client_address );
+            if( slot == rate_limiter::LIMITED )
             {
-                users[sockfd].close_conn();
+                STAT_INC( limit_conns );
+                close( connfd );
+                continue;
             }
 
-            /*有读的数据了　向队列中添加处理任务*/
-            else if( events[i].events & EPOLLIN )
+#if defined( __cpp_impl_coroutine )
+            if( loop.coro_mode )
             {
-                if( users[sockfd].read() )
+                STAT_INC( conn_accepted );
+                coro_serve_conn( connfd, slot );
+                continue;
+            }
+#endif
+
+            http_conn* conn = loop.users->create( connfd );
+            if( ! conn )
+            {
+                http_conn::m_limits.disconnect( slot );
+                show_error( connfd, "Internal server busy" );
+                continue;
+            }
+
+            /*初始化客户连接 及状态机的初始化*/
+            conn->init( connfd, client_address, slot );
+            STAT_INC( conn_accepted );
+        }
+        loop.accept_ready[l] = loop.acc[l].pending();
+        loop.any_ready = loop.any_ready || loop.accept_ready[l];
+        loop.accept_starved = loop.accept_starved || loop.acc[l].starved();
+    }
+    http_conn::m_limits.sweep();
+#if defined( __cpp_impl_coroutine )
+    if( loop.coro_mode )
+    {
+        coro_reactor::expire();
+    }
+#endif
+
+    int users = __atomic_load_n( &http_conn::m_user_count, __ATOMIC_RELAXED );
+    if( loop.draining && ( users <= 0 || time( NULL ) - loop.drain_start >= DRAIN_TIMEOUT ) )
+    {
+        LOG_INFO( "drained, %d connections left", users );
+        return false;
+    }
+    return true;
+}
+
+/**
+ * 主从模式下每个线程运行的循环
+ * 拿到leader锁的线程在epoll上等待一个事件 监听socket 信号 写事件等都由它处理
+ * 读到了请求就释放leader锁 由一个follower接着等待 自己处理该请求 省去了任务队列与一次线程唤醒
+ * 连接带着EPOLLONESHOT 处理完重新注册之前不会被别的线程拿到
+ */
+void lead_follow( event_loop& loop )
+{
+    while( true )
+    {
+        loop.leader.lock();
+        if( loop.stop )
+        {
+            loop.leader.unlock();
+            return;
+        }
+        http_conn* work = NULL;
+        loop.stop = ! poll_events( loop, &work );
+        loop.leader.unlock();
+        if( work )
+        {
+            work->process();
+        }
+    }
+}
+
+void* follower( void* arg )
+{
+    lead_follow( *( event_loop* )arg );
+    return NULL;
+}
+
+int main( int argc, char* argv[] )
+{
+    /**
+     * -b 全连接队列长度 -a 每轮最多accept的连接数 -d TCP_DEFER_ACCEPT秒数
+     * -c 主线程的CPU列表 -w 工作线程的CPU列表 如 "0-3,8"
+     * -q 任务排队超过该毫秒数且持续积压时丢弃 0表示关闭
+     * -i 主线程内联解析 命中应答缓存的请求不进线程池
+     * -o 用协程处理连接(需以C++20编译)
+     * -u Unix域socket的路径 可以给多次 只给-u时可以省掉ip和端口
+     * -r 每个客户IP每秒的请求数[,突发数] -n 每个客户IP的最大连接数 0表示不限
+     * -g cgi进程池控制socket的路径 接上后cgi请求经共享内存交给进程池
+     * -L 主从(leader/follower)模式 没有任务队列 -q不起作用
+     * -p TCP连接的socket选项 如 "nodelay,cork,fastopen=256,sndbuf=262144,lowat=16384" 默认"nodelay,cork" 见sock_profile.h
+     * -z 明文连接上不小于该字节数的映射文件与缓存应答用MSG_ZEROCOPY发送 0表示关闭
+     */
+    int backlog = acceptor::DEFAULT_BACKLOG;
+    int accept_budget = acceptor::DEFAULT_BUDGET;
+    int defer_secs = 0;
+    cpu_set_t reactor_cpus, worker_cpus;
+    bool pin_reactor = false, pin_workers = false;
+    int queue_target_ms = 20;
+    bool inline_mode = false;
+#if defined( __cpp_impl_coroutine )
+    bool coro_mode = false;
+#endif
+    int small_file_size = file_cache::DEFAULT_MAX_FILE_SIZE;
+    long cache_budget_mb = file_cache::DEFAULT_BUDGET >> 20;
+    bool huge_pages = false;
+    const char* access_path = NULL;
+    const char* cert_file = NULL;
+    const char* key_file = NULL;
+    const char* unix_paths[ MAX_LISTENERS - 1 ];
+    int unix_number = 0;
+    int rate = 0, burst = 0, max_conns = 0;
+    const char* cgi_control = NULL;
+    bool lf_mode = false;
+    long zerocopy_min = 0;
+    int opt;
+    while( ( opt = getopt( argc, argv, "b:a:d:c:w:q:s:m:tl:S:K:iou:r:n:g:Lz:p:" ) ) != -1 )
+    {
+        switch( opt )
+        {
+            case 'b': backlog = atoi( optarg ); break;
+            case 'a': accept_budget = atoi( optarg ); break;
+            case 'd': defer_secs = atoi( optarg ); break;
+            case 'c': pin_reactor = parse_cpu_list( optarg, &reactor_cpus ); break;
+            case 'w': pin_workers = parse_cpu_list( optarg, &worker_cpus ); break;
+            case 'q': queue_target_ms = atoi( optarg ); break;
+            case 's': small_file_size = atoi( optarg ); break;
+            case 'm': cache_budget_mb = atol( optarg ); break;
+            case 't': huge_pages = true; break;
+            case 'l': access_path = optarg; break;
+            case 'S': cert_file = optarg; break;
+            case 'K': key_file = optarg; break;
+            case 'i': inline_mode = true; break;
+            case 'r': sscanf( optarg, "%d,%d", &rate, &burst ); break;
+            case 'n': max_conns = atoi( optarg ); break;
+            case 'g': cgi_control = optarg; break;
+            case 'L': lf_mode = true; break;
+            case 'z': zerocopy_min = atol( optarg ); break;
+            case 'p':
+                if( ! http_conn::m_sock.parse( optarg ) )
                 {
-                    /*向队列中添加客户端类*/
-                    pool->append( users + sockfd );
+                    argc = 0;
                 }
-                else
+                break;
+            case 'u':
+                if( unix_number < MAX_LISTENERS - 1 )
                 {
-                    users[sockfd].close_conn();
+                    unix_paths[ unix_number++ ] = optarg;
                 }
+                break;
+#if defined( __cpp_impl_coroutine )
+            case 'o': coro_mode = true; break;
+#endif
+            default: argc = 0; break;
+        }
+    }
+    if( argc - optind < 2 && ( argc == 0 || argc != optind || unix_number == 0 ) )
+    {
+        printf( "usage: %s [ip_address port_number] [-u unix_path]... [-b backlog] [-a accept_budget] [-d defer_accept_secs]"
+                " [-c reactor_cpus] [-w worker_cpus] [-q queue_target_ms] [-s small_file_bytes] [-m cache_budget_mb] [-t] [-l access_log] [-S cert -K key] [-i] [-o] [-r rate[,burst]] [-n max_conns] [-g cgi_control] [-L] [-z zerocopy_bytes] [-p sock_profile]\n", basename( argv[0] ) );
+        return 1;
+    }
+    const char* ip = ( argc - optind >= 2 ) ? argv[ optind ] : NULL;
+    int port = ip ? atoi( argv[ optind + 1 ] ) : 0;
+
+    addsig( SIGPIPE, SIG_IGN );
+    if( ! logger::instance().start( access_path ) )
+    {
+        printf( "open access log %s failed: %s\n", access_path, strerror( errno ) );
+        return 1;
+    }
+    http_conn::m_cache.configure( small_file_size, cache_budget_mb << 20, huge_pages );
+    http_conn::m_limits.configure( rate, burst, max_conns );
+    http_conn::m_zerocopy_min = ( zerocopy_min > 0 ) ? zerocopy_min : 0;
+#if defined( __cpp_impl_coroutine )
+    /*协程都在主线程中恢复 不能与主从模式同时使用*/
+    if( coro_mode && lf_mode )
+    {
+        printf( "-o does not work with -L\n" );
+        return 1;
+    }
+#endif
+
+    /*给了证书就在监听socket上做TLS 协程模式只处理明文*/
+    if( cert_file || key_file )
+    {
+#if defined( WITH_TLS )
+        if( ! cert_file || ! key_file )
+        {
+            printf( "TLS needs both -S and -K\n" );
+            return 1;
+        }
+#if defined( __cpp_impl_coroutine )
+        if( coro_mode )
+        {
+            printf( "TLS does not work with -o\n" );
+            return 1;
+        }
+#endif
+        try
+        {
+            http_conn::m_tls = new tls_context( cert_file, key_file );
+        }
+        catch( ... )
+        {
+            printf( "load certificate %s or key %s failed\n", cert_file, key_file );
+            return 1;
+        }
+#else
+        printf( "built without TLS, rebuild with -DWITH_TLS -lssl -lcrypto\n" );
+        return 1;
+#endif
+    }
+
+    /**
+     * 主线程要在分配任何连接对象之前绑定 这样对象池的内存落在它所在的节点上
+     * 只指定了主线程时 工作线程放到同一NUMA节点的CPU上
+     */
+    if( pin_reactor )
+    {
+        if( ! pin_thread( pthread_self(), &reactor_cpus ) )
+        {
+            printf( "pin the reactor thread failed\n" );
+        }
+        if( ! pin_workers )
+        {
+            node_cpus( &reactor_cpus, &worker_cpus );
+            pin_workers = true;
+        }
+    }
+
+    /*主从模式没有线程池 线程在事件循环开始前创建*/
+    threadpool< http_conn >* pool = NULL;
+    if( ! lf_mode )
+    {
+        try
+        {
+            pool = new threadpool< http_conn >( THREAD_NUMBER, 10000, pin_workers ? &worker_cpus : NULL );
+        }
+        catch( ... )
+        {
+            return 1;
+        }
+        pool->set_codel( queue_target_ms, 100 );
+    }
+    
+    /*连接对象在accept时才从对象池中取出 关闭时归还*/
+    conn_table< http_conn >* users = new conn_table< http_conn >( MAX_FD );
+    http_conn::m_users = users;
+
+    int ret = 0;
+    acceptor acc[ MAX_LISTENERS ];
+    int listener_number = 0;
+    /*由旧进程热升级而来 直接沿用继承的监听socket 命令行上的地址与路径不再打开*/
+    const char* inherited = getenv( LISTENFD_ENV );
+    if( inherited )
+    {
+        listener_number = inherit_listeners( inherited, acc, backlog, defer_secs );
+        unsetenv( LISTENFD_ENV );
+    }
+    else
+    {
+        if( ip )
+        {
+            ret = acc[ listener_number++ ].open( ip, port, backlog, defer_secs );
+            assert( ret >= 0 );
+        }
+        for( int u = 0; u < unix_number; ++u )
+        {
+            if( acc[ listener_number++ ].open_unix( unix_paths[u], backlog ) < 0 )
+            {
+                printf( "listen on %s failed: %s\n", unix_paths[u], strerror( errno ) );
+                return 1;
             }
-            
-            /*内核缓冲区中发送空间不足 等待EPOLLOUT时间*/
-            else if( events[i].events & EPOLLOUT )
+        }
+    }
+    assert( listener_number > 0 );
+
+    int epollfd = epoll_create( 5 );
+    assert( epollfd != -1 );
+    for( int l = 0; l < listener_number; ++l )
+    {
+        acc[l].set_budget( accept_budget );
+        if( ! acc[l].local() )
+        {
+            http_conn::m_sock.apply_listener( acc[l].fd() );
+        }
+        addfd( epollfd, acc[l].fd(), false );
+    }
+    if( http_conn::m_sock.fastopen > 0 && http_conn::m_sock.applied_fastopen == 0 )
+    {
+        LOG_WARN( "TCP_FASTOPEN is not available on the listen socket" );
+    }
+    http_conn::m_epollfd = epollfd;
+#if defined( __cpp_impl_coroutine )
+    coro_reactor::set_epollfd( epollfd );
+#endif
+
+    /**
+     * 进程池同一时刻只接一个web服务器 热升级后的新进程接不上 仍走TCP
+     * 进程池没有启动或者没有给控制socket时同样走TCP
+     */
+    cgi_channel< http_conn >* cgi_shm = NULL;
+    if( cgi_control )
+    {
+        cgi_shm = new cgi_channel< http_conn >;
+        if( cgi_shm->attach( cgi_control ) )
+        {
+            addfd( epollfd, cgi_shm->doorbell(), false );
+            addfd( epollfd, cgi_shm->control(), false );
+            http_conn::m_cgi_shm = cgi_shm;
+        }
+        else
+        {
+            LOG_WARN( "attach to cgi pool at %s failed, cgi requests go over tcp", cgi_control );
+            delete cgi_shm;
+            cgi_shm = NULL;
+        }
+    }
+
+    /*SIGUSR2 触发热升级*/
+    ret = socketpair( PF_UNIX, SOCK_STREAM, 0, sig_pipefd );
+    assert( ret != -1 );
+    setnonblocking( sig_pipefd[1] );
+    addfd( epollfd, sig_pipefd[0], false );
+    addsig( SIGUSR2, sig_handler );
+    /*SIGUSR1 打印运行时计数器*/
+    addsig( SIGUSR1, sig_handler );
+
+    event_loop loop;
+    loop.epollfd = epollfd;
+    loop.acc = acc;
+    loop.listener_number = listener_number;
+    loop.any_ready = false;
+    loop.accept_starved = false;
+    loop.draining = false;
+    loop.drain_start = 0;
+    loop.inline_mode = inline_mode;
+#if defined( __cpp_impl_coroutine )
+    loop.coro_mode = coro_mode;
+#endif
+    loop.argv = argv;
+    loop.users = users;
+    loop.pool = pool;
+    loop.cgi_shm = cgi_shm;
+    loop.stop = false;
+    for( int l = 0; l < MAX_LISTENERS; ++l )
+    {
+        loop.accept_ready[l] = false;
+    }
+
+    if( pool )
+    {
+        while( poll_events( loop, NULL ) )
+        {
+        }
+    }
+    else
+    {
+        /*主线程也是其中之一 事件循环结束后等其他线程处理完手上的请求*/
+        pthread_t followers[ THREAD_NUMBER - 1 ];
+        for( int i = 0; i < THREAD_NUMBER - 1; ++i )
+        {
+            ret = pthread_create( &followers[i], NULL, follower, &loop );
+            assert( ret == 0 );
+            if( pin_workers && ! pin_thread( followers[i], nth_cpu( &worker_cpus, i ) ) )
             {
-                if( !users[sockfd].write() )
-                {
-                    users[sockfd].close_conn();
-                }
+                printf( "pin the %dth follower failed\n", i );
             }
         }
+        lead_follow( loop );
+        for( int i = 0; i < THREAD_NUMBER - 1; ++i )
+        {
+            pthread_join( followers[i], NULL );
+        }
     }
+    listener_number = loop.listener_number;
 
     close( epollfd );
-    close( listenfd );
-    delete [] users;
+    for( int l = 0; l < listener_number; ++l )
+    {
+        close( acc[l].fd() );
+    }
+    close( sig_pipefd[0] );
+    close( sig_pipefd[1] );
+    http_conn::m_users = NULL;
+    delete users;
     delete pool;
+    delete http_conn::m_tls;
+    http_conn::m_cgi_shm = NULL;
+    delete cgi_shm;
+    logger::instance().stop();
     return 0;
 }
\ No newline at end of file
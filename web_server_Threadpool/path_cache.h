@@ -0,0 +1,177 @@
+/**
+ * Created by 刘嘉辉 on 11/18/18.
+ * Copyright (c) 2018 刘嘉辉 All rights reserved.
+ * @brief To immplmente path_cache.h.
+ */
+
+#ifndef PATH_CACHE_H
+#define PATH_CACHE_H
+
+#include <string>
+#include <functional>
+#include <unordered_map>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "locker.h"
+#include "stats.h"
+#include "request_arena.h"
+
+/*一个url解析的结果 code是http_conn::HTTP_CODE 不存在或不可读的也记下来*/
+struct path_entry
+{
+    int code;
+    struct stat st;
+    /*规范化之后的文件路径*/
+    std::string real_file;
+    long long expire_ms;
+};
+
+/**
+ * url -> 文件路径与stat结果的缓存
+ * 同一个url只做一次路径规范化 TTL内不再stat 扫描不存在url的爬虫也不再每次都查文件系统
+ * 按url的哈希分成SHARD_NUMBER片 每片一把读写锁 命中时只加读锁 读者之间不争用
+ * 每片的条目有上限 满了先清掉过期的 仍然满就整片清空 随机url撑不大内存
+ */
+class path_cache
+{
+public:
+    static const int SHARD_NUMBER = 16;
+    static const size_t SHARD_ENTRIES = 1024;
+    /*与小文件缓存相同 文件的变化最迟这么久后可见*/
+    static const int TTL_MS = 1000;
+
+public:
+    /**
+     * 命中且未过期时拷贝结果 文件路径拷进调用者大小为size的缓冲区
+     * 命中的路径上不分配内存 key由每个线程复用
+     */
+    bool get( const char* url, int& code, struct stat& st, char* real_file, size_t size )
+    {
+        const std::string& key = lookup_key( url );
+        shard& s = m_shards[ std::hash< std::string >()( key ) % SHARD_NUMBER ];
+        bool hit = false;
+        s.m_locker.read_lock();
+        entry_map::iterator it = s.m_entries.find( key );
+        if( it != s.m_entries.end() && it->second.expire_ms > now_ms() && it->second.real_file.size() < size )
+        {
+            code = it->second.code;
+            st = it->second.st;
+            memcpy( real_file, it->second.real_file.c_str(), it->second.real_file.size() + 1 );
+            hit = true;
+        }
+        s.m_locker.read_unlock();
+        if( hit )
+        {
+            STAT_INC( path_hit );
+        }
+        else
+        {
+            STAT_INC( path_miss );
+        }
+        return hit;
+    }
+
+    void put( const char* url, path_entry& entry )
+    {
+        std::string key( url );
+        shard& s = m_shards[ std::hash< std::string >()( key ) % SHARD_NUMBER ];
+        long long now = now_ms();
+        entry.expire_ms = now + TTL_MS;
+        s.m_locker.write_lock();
+        if( s.m_entries.size() >= SHARD_ENTRIES && s.m_entries.find( key ) == s.m_entries.end() )
+        {
+            for( entry_map::iterator it = s.m_entries.begin(); it != s.m_entries.end(); )
+            {
+                if( it->second.expire_ms <= now )
+                {
+                    it = s.m_entries.erase( it );
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+            if( s.m_entries.size() >= SHARD_ENTRIES )
+            {
+                s.m_entries.clear();
+            }
+        }
+        s.m_entries[ key ] = entry;
+        s.m_locker.write_unlock();
+    }
+
+    /*缓存的结果已知过时(文件在TTL内被删除)时去掉 下一次请求重新stat*/
+    void remove( const char* url )
+    {
+        const std::string& key = lookup_key( url );
+        shard& s = m_shards[ std::hash< std::string >()( key ) % SHARD_NUMBER ];
+        s.m_locker.write_lock();
+        s.m_entries.erase( key );
+        s.m_locker.write_unlock();
+    }
+
+    /**
+     * 把url规范化后接在root后面 合并重复的'/' 去掉"." 按".."回退
+     * ".."越过了根目录时返回false 调用者按FORBIDDEN处理
+     */
+    static bool normalize( const char* root, const char* url, std::string& path )
+    {
+        path = root;
+        size_t root_len = path.size();
+        const char* p = url;
+        while( *p )
+        {
+            while( *p == '/' )
+            {
+                ++p;
+            }
+            const char* end = strchr( p, '/' );
+            size_t len = end ? end - p : strlen( p );
+            if( len == 2 && p[0] == '.' && p[1] == '.' )
+            {
+                if( path.size() == root_len )
+                {
+                    return false;
+                }
+                path.erase( path.rfind( '/' ) );
+            }
+            else if( len > 0 && ! ( len == 1 && p[0] == '.' ) )
+            {
+                path += '/';
+                path.append( p, len );
+            }
+            p += len;
+        }
+        /*目录的url保留结尾的'/' 仍按目录处理*/
+        if( path.size() == root_len || url[ strlen( url ) - 1 ] == '/' )
+        {
+            path += '/';
+        }
+        return true;
+    }
+
+private:
+    typedef std::unordered_map< std::string, path_entry > entry_map;
+
+    /*每片独占一条缓存行起始 相邻两片的锁不会互相失效*/
+    struct alignas( 64 ) shard
+    {
+        shard() : m_locker( "path_cache" ) {}
+
+        rw_locker m_locker;
+        entry_map m_entries;
+    };
+
+    static long long now_ms()
+    {
+        struct timespec ts;
+        clock_gettime( CLOCK_MONOTONIC_COARSE, &ts );
+        return ( long long )ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+private:
+    shard m_shards[ SHARD_NUMBER ];
+};
+
+#endif
@@ -0,0 +1,196 @@
+/**
+ * Created by 刘嘉辉 on 11/18/18.
+ * Copyright (c) 2018 刘嘉辉 All rights reserved.
+ * @brief To immplmente rate_limit.h.
+ */
+
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+
+/*一个客户IP的状态 key为0表示空槽*/
+struct rate_bucket
+{
+    unsigned int key;
+    /*当前打开的连接数 关闭连接的线程原子减*/
+    int conns;
+    /*千分之一个令牌为单位 一个请求消耗1000*/
+    long long tokens;
+    long long last_ms;
+};
+
+/**
+ * 按客户IP限制请求速率和并发连接数 在主线程accept与读事件时检查 超限的请求进不了线程池
+ * 定长的表按IP哈希分成若干片 每片SHARD_SLOTS个连续的槽 在片内线性探测
+ * 只有主线程占用和回收槽 其他线程只对连接数做原子减 不加锁
+ * 令牌在检查时按流逝的时间补充 不需要定时器
+ * 主线程每轮事件之后扫描一小段槽 没有连接且令牌已满的槽被回收
+ * 片内没有空槽时新IP不受限制 宁可放过也不误伤
+ * Unix域的连接来自本机的代理 不受限制
+ */
+class rate_limiter
+{
+public:
+    static const int SHARD_SLOTS = 8;
+    static const int TABLE_SIZE = 65536;
+    /*片数是2的SHARD_BITS次方 TABLE_SIZE / SHARD_SLOTS*/
+    static const int SHARD_BITS = 13;
+    static const int SWEEP_SLOTS = 256;
+    /*不受限制的连接的槽号*/
+    static const int UNLIMITED = -1;
+    /*连接数超限*/
+    static const int LIMITED = -2;
+
+public:
+    rate_limiter() : m_slots( NULL ), m_rate( 0 ), m_burst( 0 ), m_max_conns( 0 ), m_sweep( 0 ) {}
+    ~rate_limiter()
+    {
+        delete [] m_slots;
+    }
+
+    /*启动时由命令行设置 rate为每秒请求数 都为0时不限制*/
+    void configure( int rate, int burst, int max_conns )
+    {
+        m_rate = rate;
+        m_burst = ( burst > 0 ) ? burst : rate;
+        m_max_conns = max_conns;
+        if( ( rate > 0 || max_conns > 0 ) && ! m_slots )
+        {
+            m_slots = new rate_bucket[ TABLE_SIZE ];
+            memset( m_slots, 0, sizeof( rate_bucket ) * TABLE_SIZE );
+        }
+    }
+
+    /*新连接 返回槽号 连接关闭时交给disconnect*/
+    int connect( const sockaddr_in& addr )
+    {
+        if( ! m_slots || addr.sin_family == AF_UNIX )
+        {
+            return UNLIMITED;
+        }
+        int slot = find( addr.sin_addr.s_addr );
+        if( slot < 0 )
+        {
+            return UNLIMITED;
+        }
+        rate_bucket& b = m_slots[ slot ];
+        if( m_max_conns > 0 && __atomic_load_n( &b.conns, __ATOMIC_RELAXED ) >= m_max_conns )
+        {
+            return LIMITED;
+        }
+        __atomic_fetch_add( &b.conns, 1, __ATOMIC_RELAXED );
+        return slot;
+    }
+
+    /*可以在任何线程调用*/
+    void disconnect( int slot )
+    {
+        if( slot >= 0 )
+        {
+            __atomic_fetch_sub( &m_slots[ slot ].conns, 1, __ATOMIC_RELAXED );
+        }
+    }
+
+    /*连接上来了一个请求 令牌不够时返回false*/
+    bool allow( int slot )
+    {
+        if( slot < 0 || m_rate <= 0 )
+        {
+            return true;
+        }
+        rate_bucket& b = m_slots[ slot ];
+        refill( b, now_ms() );
+        if( b.tokens < 1000 )
+        {
+            return false;
+        }
+        b.tokens -= 1000;
+        return true;
+    }
+
+    /*回收一段空闲的槽 由主线程每轮调用*/
+    void sweep()
+    {
+        if( ! m_slots )
+        {
+            return;
+        }
+        long long now = now_ms();
+        for( int i = 0; i < SWEEP_SLOTS; ++i, m_sweep = ( m_sweep + 1 ) & ( TABLE_SIZE - 1 ) )
+        {
+            rate_bucket& b = m_slots[ m_sweep ];
+            if( b.key == 0 || __atomic_load_n( &b.conns, __ATOMIC_RELAXED ) > 0 )
+            {
+                continue;
+            }
+            refill( b, now );
+            if( m_rate <= 0 || b.tokens >= m_burst * 1000LL )
+            {
+                b.key = 0;
+            }
+        }
+    }
+
+private:
+    /*在IP所属的片内找已有的槽或者占一个空槽 片满时返回-1*/
+    int find( unsigned int key )
+    {
+        /**
+         * 乘法哈希取高位 高位由key的所有位决定
+         * 低位只取决于s_addr的低16位 小端机上就是IP的前两段 同一个/16的客户会全挤在一片里
+         */
+        unsigned int shard = ( ( key * 2654435761u ) >> ( 32 - SHARD_BITS ) ) * SHARD_SLOTS;
+        int empty = -1;
+        for( int i = 0; i < SHARD_SLOTS; ++i )
+        {
+            int slot = shard + i;
+            if( m_slots[ slot ].key == key )
+            {
+                return slot;
+            }
+            if( empty < 0 && m_slots[ slot ].key == 0 )
+            {
+                empty = slot;
+            }
+        }
+        if( empty >= 0 )
+        {
+            rate_bucket& b = m_slots[ empty ];
+            b.key = key;
+            b.conns = 0;
+            b.tokens = m_burst * 1000LL;
+            b.last_ms = now_ms();
+        }
+        return empty;
+    }
+
+    void refill( rate_bucket& b, long long now )
+    {
+        long long cap = m_burst * 1000LL;
+        if( now > b.last_ms )
+        {
+            b.tokens += ( now - b.last_ms ) * m_rate;
+            b.tokens = ( b.tokens < cap ) ? b.tokens : cap;
+            b.last_ms = now;
+        }
+    }
+
+    static long long now_ms()
+    {
+        struct timespec ts;
+        clock_gettime( CLOCK_MONOTONIC_COARSE, &ts );
+        return ( long long )ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+private:
+    rate_bucket* m_slots;
+    int m_rate;
+    int m_burst;
+    int m_max_conns;
+    int m_sweep;
+};
+
+#endif
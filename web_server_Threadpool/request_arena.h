@@ -0,0 +1,158 @@
+/**
+ * Created by 刘嘉辉 on 11/18/18.
+ * Copyright (c) 2018 刘嘉辉 All rights reserved.
+ * @brief To immplmente request_arena.h.
+ */
+
+#ifndef REQUEST_ARENA_H
+#define REQUEST_ARENA_H
+
+#include <string>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+
+/**
+ * 指向读缓冲区(或请求内存区)中的一段字符 不以'\0'结尾 也不拥有内存
+ * 解析请求行和头部时只切出视图 不再往读缓冲区里写'\0'
+ */
+struct str_view
+{
+    const char* data;
+    int len;
+
+    str_view() : data( NULL ), len( 0 ) {}
+    str_view( const char* d, int n ) : data( d ), len( n ) {}
+
+    bool empty() const { return len == 0; }
+
+    bool equals_nocase( const char* s ) const
+    {
+        return ( int )strlen( s ) == len && strncasecmp( data, s, len ) == 0;
+    }
+
+    bool starts_with_nocase( const char* s ) const
+    {
+        int n = strlen( s );
+        return n <= len && strncasecmp( data, s, n ) == 0;
+    }
+
+    bool contains_nocase( const char* s ) const
+    {
+        int n = strlen( s );
+        for( int i = 0; i + n <= len; ++i )
+        {
+            if( strncasecmp( data + i, s, n ) == 0 )
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /*去掉开头n个字符*/
+    str_view skip( int n ) const
+    {
+        return ( n < len ) ? str_view( data + n, len - n ) : str_view( data + len, 0 );
+    }
+
+    /*第一个空格或制表符之前的部分 没有空白时就是整个视图*/
+    str_view before_blank() const
+    {
+        int i = 0;
+        while( i < len && data[ i ] != ' ' && data[ i ] != '\t' )
+        {
+            ++i;
+        }
+        return str_view( data, i );
+    }
+
+    /*去掉两端的空格与制表符*/
+    str_view trim() const
+    {
+        int begin = 0, end = len;
+        while( begin < end && ( data[ begin ] == ' ' || data[ begin ] == '\t' ) )
+        {
+            ++begin;
+        }
+        while( end > begin && ( data[ end - 1 ] == ' ' || data[ end - 1 ] == '\t' ) )
+        {
+            --end;
+        }
+        return str_view( data + begin, end - begin );
+    }
+
+    /*十进制非负整数 没有数字或者溢出时返回-1*/
+    long to_long() const
+    {
+        long value = 0;
+        int i = 0;
+        for( ; i < len && data[i] >= '0' && data[i] <= '9'; ++i )
+        {
+            if( value > ( 0x7fffffffffffffffL - 9 ) / 10 )
+            {
+                return -1;
+            }
+            value = value * 10 + ( data[i] - '0' );
+        }
+        return ( i == 0 ) ? -1 : value;
+    }
+};
+
+/**
+ * 每个连接一块的请求内存区 放进http_conn对象本身 随连接对象从slab中分配
+ * 一个请求中需要以'\0'结尾的字符串(url 交给HTTP/2的设置等)从这里按指针递增切出
+ * keep-alive的下一个请求开始前init只把已用长度清零 不清内容 请求处理的路径上不再经过malloc
+ * SIZE取读缓冲区的大小 从读缓冲区中切出的互不重叠的视图各带一个'\0'也一定放得下
+ */
+template< int SIZE >
+class request_arena
+{
+public:
+    request_arena() : m_used( 0 ) {}
+
+    void reset() { m_used = 0; }
+
+    /*放不下时返回NULL*/
+    char* alloc( int n )
+    {
+        if( n < 0 || n > SIZE - m_used )
+        {
+            return NULL;
+        }
+        char* p = m_buf + m_used;
+        m_used += n;
+        return p;
+    }
+
+    /*把视图复制成以'\0'结尾的字符串*/
+    char* copy( const str_view& v )
+    {
+        char* p = alloc( v.len + 1 );
+        if( p )
+        {
+            memcpy( p, v.data, v.len );
+            p[ v.len ] = '\0';
+        }
+        return p;
+    }
+
+    int used() const { return m_used; }
+
+private:
+    char m_buf[ SIZE ];
+    int m_used;
+};
+
+/**
+ * 以std::string为键的缓存查找时不想每次都构造临时的key
+ * 每个线程复用一个 容量够了之后assign不再分配内存
+ */
+inline const std::string& lookup_key( const char* s )
+{
+    static thread_local std::string key;
+    key.assign( s );
+    return key;
+}
+
+#endif
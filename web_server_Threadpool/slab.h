@@ -0,0 +1,238 @@
+/**
+ * Created by 刘嘉辉 on 11/02/18.
+ * Copyright (c) 2018 刘嘉辉 All rights reserved.
+ * @brief To immplmente slab.h.
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <vector>
+#include <exception>
+#include "locker.h"
+
+/**
+ * 对象池 以SLAB_SIZE个对象为一块向系统申请内存
+ * 释放的对象挂回空闲链表　供下一个连接复用　内存只随连接数峰值增长
+ * 非线程安全 由conn_table加锁保护
+ */
+template< typename T >
+class slab
+{
+public:
+    /*每一块中的对象个数*/
+    static const int SLAB_SIZE = 64;
+
+public:
+    slab() : m_allocated( 0 ) {}
+    ~slab()
+    {
+        for ( size_t i = 0; i < m_chunks.size(); ++i )
+        {
+            delete [] m_chunks[i];
+        }
+    }
+
+    /*取一个空闲对象 没有则新申请一块*/
+    T* alloc()
+    {
+        if ( m_free.empty() )
+        {
+            T* chunk = new T[ SLAB_SIZE ];
+            m_chunks.push_back( chunk );
+            for ( int i = SLAB_SIZE - 1; i >= 0; --i )
+            {
+                m_free.push_back( chunk + i );
+            }
+            m_allocated += SLAB_SIZE;
+        }
+        T* obj = m_free.back();
+        m_free.pop_back();
+        return obj;
+    }
+
+    /*归还对象*/
+    void free( T* obj )
+    {
+        m_free.push_back( obj );
+    }
+
+    /*已经构造的对象总数*/
+    int allocated() const { return m_allocated; }
+
+private:
+    std::vector< T* > m_chunks;
+    std::vector< T* > m_free;
+    int m_allocated;
+};
+
+
+/**
+ * 稀疏的 fd -> 连接对象 表
+ * 两级索引 每页PAGE_SIZE个指针　页在该段fd第一次出现时才分配
+ * 取代原先 new T[ MAX_FD ] 的做法　内存随活跃连接数而不是最大fd增长
+ *
+ * get() 只在主线程调用　不加锁
+ * create()/remove()/recycle() 可能分别在主线程和工作线程调用　由m_locker保护
+ */
+template< typename T >
+class conn_table
+{
+public:
+    static const int PAGE_SHIFT = 10;
+    static const int PAGE_SIZE = 1 << PAGE_SHIFT;
+
+public:
+    conn_table( int max_fd ) : m_max_fd( max_fd ), m_count( 0 ), m_locker( "conn_table" )
+    {
+        if( max_fd <= 0 )
+        {
+            throw std::exception();
+        }
+        m_page_number = ( max_fd + PAGE_SIZE - 1 ) >> PAGE_SHIFT;
+        m_pages = new T**[ m_page_number ];
+        for ( int i = 0; i < m_page_number; ++i )
+        {
+            m_pages[i] = NULL;
+        }
+    }
+
+    ~conn_table()
+    {
+        for ( int i = 0; i < m_page_number; ++i )
+        {
+            delete [] m_pages[i];
+        }
+        delete [] m_pages;
+    }
+
+    /*查找fd对应的连接对象 不存在返回NULL*/
+    T* get( int fd )
+    {
+        if( ( fd < 0 ) || ( fd >= m_max_fd ) )
+        {
+            return NULL;
+        }
+        T** page = __atomic_load_n( &m_pages[ fd >> PAGE_SHIFT ], __ATOMIC_ACQUIRE );
+        if( ! page )
+        {
+            return NULL;
+        }
+        return __atomic_load_n( &page[ fd & ( PAGE_SIZE - 1 ) ], __ATOMIC_ACQUIRE );
+    }
+
+    /**
+     * 为新接受的连接取一个对象
+     * fd上还有对象说明旧连接没有先remove就关闭了fd 复用会让两个连接共用一个对象 返回NULL
+     */
+    T* create( int fd )
+    {
+        if( ( fd < 0 ) || ( fd >= m_max_fd ) )
+        {
+            return NULL;
+        }
+        m_locker.lock();
+        T** page = page_of( fd );
+        T* obj = NULL;
+        if( ! page[ fd & ( PAGE_SIZE - 1 ) ] )
+        {
+            obj = m_slab.alloc();
+            __atomic_store_n( &page[ fd & ( PAGE_SIZE - 1 ) ], obj, __ATOMIC_RELEASE );
+            ++m_count;
+        }
+        m_locker.unlock();
+        return obj;
+    }
+
+    /**
+     * 连接关闭 清空fd的表项 须在close(fd)之前调用
+     * 对象此时还没有归还 调用者用完之后再recycle
+     */
+    T* remove( int fd )
+    {
+        if( ( fd < 0 ) || ( fd >= m_max_fd ) )
+        {
+            return NULL;
+        }
+        m_locker.lock();
+        T** page = m_pages[ fd >> PAGE_SHIFT ];
+        T* obj = page ? page[ fd & ( PAGE_SIZE - 1 ) ] : NULL;
+        if( obj )
+        {
+            __atomic_store_n( &page[ fd & ( PAGE_SIZE - 1 ) ], ( T* )NULL, __ATOMIC_RELEASE );
+            --m_count;
+        }
+        m_locker.unlock();
+        return obj;
+    }
+
+    /*将remove取下的对象归还对象池*/
+    void recycle( T* obj )
+    {
+        m_locker.lock();
+        m_slab.free( obj );
+        m_locker.unlock();
+    }
+
+    /**
+     * 让另一个fd(例如连接对应的cgi上游socket)也索引到同一个对象
+     * 只是别名 不占用对象池 关闭前须detach
+     */
+    bool attach( int fd, T* obj )
+    {
+        if( ( fd < 0 ) || ( fd >= m_max_fd ) )
+        {
+            return false;
+        }
+        m_locker.lock();
+        T** page = page_of( fd );
+        __atomic_store_n( &page[ fd & ( PAGE_SIZE - 1 ) ], obj, __ATOMIC_RELEASE );
+        m_locker.unlock();
+        return true;
+    }
+
+    void detach( int fd )
+    {
+        if( ( fd < 0 ) || ( fd >= m_max_fd ) )
+        {
+            return;
+        }
+        m_locker.lock();
+        T** page = m_pages[ fd >> PAGE_SHIFT ];
+        if( page )
+        {
+            __atomic_store_n( &page[ fd & ( PAGE_SIZE - 1 ) ], ( T* )NULL, __ATOMIC_RELEASE );
+        }
+        m_locker.unlock();
+    }
+
+    /*当前持有对象的连接数*/
+    int size() const { return m_count; }
+
+private:
+    /*fd所在的页 不存在则分配 调用时持有m_locker*/
+    T** page_of( int fd )
+    {
+        T** page = m_pages[ fd >> PAGE_SHIFT ];
+        if( ! page )
+        {
+            page = new T*[ PAGE_SIZE ];
+            for ( int i = 0; i < PAGE_SIZE; ++i )
+            {
+                page[i] = NULL;
+            }
+            __atomic_store_n( &m_pages[ fd >> PAGE_SHIFT ], page, __ATOMIC_RELEASE );
+        }
+        return page;
+    }
+
+private:
+    int m_max_fd;
+    int m_page_number;
+    T*** m_pages;
+    int m_count;
+    slab< T > m_slab;
+    locker m_locker;
+};
+
+#endif
@@ -0,0 +1,157 @@
+/**
+ * Created by 刘嘉辉 on 11/18/18.
+ * Copyright (c) 2018 刘嘉辉 All rights reserved.
+ * @brief To immplmente sock_profile.h.
+ */
+
+#ifndef SOCK_PROFILE_H
+#define SOCK_PROFILE_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef TCP_NOTSENT_LOWAT
+#define TCP_NOTSENT_LOWAT 25
+#endif
+
+/**
+ * TCP连接的socket选项 启动时由-p给出 之后只读
+ * nodelay  已连接的socket上关掉Nagle 小应答一次写出后立即发送 不等前一段的ACK
+ * cork     一个应答要分几次写(头部+sendfile cgi的块头+数据+块尾)时先TCP_CORK 凑满报文段再发 应答结束或停下等待时拔掉
+ * fastopen 监听socket的TFO队列长度 回头客的SYN里直接带上请求 省掉一个RTT 还需要net.ipv4.tcp_fastopen打开服务端
+ * sndbuf   SO_SNDBUF 设置后内核不再自动调整发送缓冲区
+ * lowat    TCP_NOTSENT_LOWAT 缓冲区中还没发出的数据低于该值才报告可写 发送缓冲区里不堆积太多排队的字节
+ * 数值为0表示不设置 沿用内核的默认值
+ */
+struct sock_profile
+{
+    bool nodelay;
+    bool cork;
+    int fastopen;
+    int sndbuf;
+    int lowat;
+    /*内核实际采用的值 第一次设置后用getsockopt读回 SO_SNDBUF会被加倍 TFO可能不被支持*/
+    int applied_sndbuf;
+    int applied_fastopen;
+
+    sock_profile() : nodelay( true ), cork( true ), fastopen( 0 ), sndbuf( 0 ), lowat( 0 ), applied_sndbuf( 0 ), applied_fastopen( 0 ) {}
+
+    /**
+     * 解析形如 "nodelay,cork,fastopen=256,sndbuf=262144,lowat=16384" 的列表
+     * 列表替换默认值 没有列出的开关关闭 "none"表示全部关闭
+     */
+    bool parse( const char* text )
+    {
+        nodelay = false;
+        cork = false;
+        fastopen = 0;
+        sndbuf = 0;
+        lowat = 0;
+        const char* p = text;
+        while( *p )
+        {
+            const char* end = strchr( p, ',' );
+            int len = end ? end - p : strlen( p );
+            const char* eq = ( const char* )memchr( p, '=', len );
+            int name_len = eq ? eq - p : len;
+            int value = eq ? atoi( eq + 1 ) : 0;
+            if( name_len == 7 && strncmp( p, "nodelay", 7 ) == 0 && ! eq )
+            {
+                nodelay = true;
+            }
+            else if( name_len == 4 && strncmp( p, "cork", 4 ) == 0 && ! eq )
+            {
+                cork = true;
+            }
+            else if( name_len == 4 && strncmp( p, "none", 4 ) == 0 && ! eq )
+            {
+            }
+            else if( name_len == 8 && strncmp( p, "fastopen", 8 ) == 0 && value > 0 )
+            {
+                fastopen = value;
+            }
+            else if( name_len == 6 && strncmp( p, "sndbuf", 6 ) == 0 && value > 0 )
+            {
+                sndbuf = value;
+            }
+            else if( name_len == 5 && strncmp( p, "lowat", 5 ) == 0 && value > 0 )
+            {
+                lowat = value;
+            }
+            else
+            {
+                return false;
+            }
+            p += len;
+            if( *p == ',' )
+            {
+                ++p;
+            }
+        }
+        return true;
+    }
+
+    /*TCP的监听socket 热升级继承来的也再设一次*/
+    void apply_listener( int fd )
+    {
+        if( fastopen > 0 )
+        {
+            setsockopt( fd, IPPROTO_TCP, TCP_FASTOPEN, &fastopen, sizeof( fastopen ) );
+            socklen_t len = sizeof( applied_fastopen );
+            if( getsockopt( fd, IPPROTO_TCP, TCP_FASTOPEN, &applied_fastopen, &len ) < 0 )
+            {
+                applied_fastopen = 0;
+            }
+        }
+    }
+
+    /*accept之后的TCP连接 Unix域的连接不调用*/
+    void apply( int fd )
+    {
+        int on = 1;
+        if( nodelay )
+        {
+            setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof( on ) );
+        }
+        if( lowat > 0 )
+        {
+            setsockopt( fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof( lowat ) );
+        }
+        if( sndbuf > 0 )
+        {
+            setsockopt( fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof( sndbuf ) );
+            /*每个连接的结果都一样 只读一次*/
+            if( __atomic_load_n( &applied_sndbuf, __ATOMIC_RELAXED ) == 0 )
+            {
+                int value = 0;
+                socklen_t len = sizeof( value );
+                getsockopt( fd, SOL_SOCKET, SO_SNDBUF, &value, &len );
+                __atomic_store_n( &applied_sndbuf, value, __ATOMIC_RELAXED );
+            }
+        }
+    }
+
+    /*由SIGUSR1与运行时计数器一起打印*/
+    void dump( FILE* out ) const
+    {
+        fprintf( out, "sock_nodelay %d\n", nodelay ? 1 : 0 );
+        fprintf( out, "sock_cork %d\n", cork ? 1 : 0 );
+        fprintf( out, "sock_fastopen %d\n", applied_fastopen );
+        fprintf( out, "sock_sndbuf %d\n", __atomic_load_n( &applied_sndbuf, __ATOMIC_RELAXED ) );
+        fprintf( out, "sock_lowat %d\n", lowat );
+    }
+};
+
+/*TCP_CORK 拔掉时内核立即发出凑不满一个报文段的剩余数据*/
+inline void set_cork( int fd, bool on )
+{
+    int value = on ? 1 : 0;
+    setsockopt( fd, IPPROTO_TCP, TCP_CORK, &value, sizeof( value ) );
+}
+
+#endif
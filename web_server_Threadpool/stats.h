@@ -0,0 +1,100 @@
+/**
+ * Created by 刘嘉辉 on 11/08/18.
+ * Copyright (c) 2018 刘嘉辉 All rights reserved.
+ * @brief To immplmente stats.h.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <sys/resource.h>
+
+/**
+ * 运行时计数器 各线程用原子加更新
+ * 收到SIGUSR1时由主线程打印
+ */
+struct server_stats
+{
+    /*accept的连接数*/
+    unsigned long conn_accepted;
+    /*任务队列已满 直接在主线程回503的请求数*/
+    unsigned long shed_queue_full;
+    /*在队列中等待过久 被工作线程回503的请求数*/
+    unsigned long shed_queue_age;
+    /*超过客户IP的连接数上限被关闭的连接 超过速率被回429的请求*/
+    unsigned long limit_conns;
+    unsigned long limit_requests;
+    /*小文件缓存的命中 未命中 淘汰次数*/
+    unsigned long cache_hit;
+    unsigned long cache_miss;
+    unsigned long cache_evict;
+    /*url解析缓存的命中 未命中次数*/
+    unsigned long path_hit;
+    unsigned long path_miss;
+    /*映射文件的I/O策略 见io_policy.h*/
+    unsigned long io_populate;
+    unsigned long io_sequential;
+    unsigned long io_huge_regions;
+    /*完成的TLS握手 其中恢复的会话 启用了内核TLS发送的连接*/
+    unsigned long tls_handshakes;
+    unsigned long tls_resumed;
+    unsigned long tls_ktls;
+    /*HTTP/2连接数与流数*/
+    unsigned long h2_sessions;
+    unsigned long h2_streams;
+    /*经共享内存与经TCP交给cgi进程池的请求数*/
+    unsigned long cgi_shm;
+    unsigned long cgi_tcp;
+    /*MSG_ZEROCOPY的发送次数 完成通知表明内核退回了复制的次数*/
+    unsigned long zerocopy_sends;
+    unsigned long zerocopy_copied;
+    /*SYN中带着请求数据的连接(TCP Fast Open)*/
+    unsigned long tfo_accepted;
+};
+
+/*inline函数中的静态变量在所有编译单元中只有一份*/
+inline server_stats& stats()
+{
+    static server_stats s;
+    return s;
+}
+
+#define STAT_ADD( field, n ) __atomic_fetch_add( &stats().field, ( n ), __ATOMIC_RELAXED )
+#define STAT_INC( field ) STAT_ADD( field, 1 )
+#define STAT_GET( field ) __atomic_load_n( &stats().field, __ATOMIC_RELAXED )
+
+inline void dump_stats( FILE* out )
+{
+    fprintf( out, "conn_accepted %lu\n", STAT_GET( conn_accepted ) );
+    fprintf( out, "shed_queue_full %lu\n", STAT_GET( shed_queue_full ) );
+    fprintf( out, "shed_queue_age %lu\n", STAT_GET( shed_queue_age ) );
+    fprintf( out, "limit_conns %lu\n", STAT_GET( limit_conns ) );
+    fprintf( out, "limit_requests %lu\n", STAT_GET( limit_requests ) );
+    fprintf( out, "cache_hit %lu\n", STAT_GET( cache_hit ) );
+    fprintf( out, "cache_miss %lu\n", STAT_GET( cache_miss ) );
+    fprintf( out, "cache_evict %lu\n", STAT_GET( cache_evict ) );
+    fprintf( out, "path_hit %lu\n", STAT_GET( path_hit ) );
+    fprintf( out, "path_miss %lu\n", STAT_GET( path_miss ) );
+    fprintf( out, "io_populate %lu\n", STAT_GET( io_populate ) );
+    fprintf( out, "io_sequential %lu\n", STAT_GET( io_sequential ) );
+    fprintf( out, "io_huge_regions %lu\n", STAT_GET( io_huge_regions ) );
+    fprintf( out, "tls_handshakes %lu\n", STAT_GET( tls_handshakes ) );
+    fprintf( out, "tls_resumed %lu\n", STAT_GET( tls_resumed ) );
+    fprintf( out, "tls_ktls %lu\n", STAT_GET( tls_ktls ) );
+    fprintf( out, "h2_sessions %lu\n", STAT_GET( h2_sessions ) );
+    fprintf( out, "h2_streams %lu\n", STAT_GET( h2_streams ) );
+    fprintf( out, "cgi_shm %lu\n", STAT_GET( cgi_shm ) );
+    fprintf( out, "cgi_tcp %lu\n", STAT_GET( cgi_tcp ) );
+    fprintf( out, "zerocopy_sends %lu\n", STAT_GET( zerocopy_sends ) );
+    fprintf( out, "zerocopy_copied %lu\n", STAT_GET( zerocopy_copied ) );
+    fprintf( out, "tfo_accepted %lu\n", STAT_GET( tfo_accepted ) );
+    /*进程累计的缺页数 对照上面几项看预读和大页的效果*/
+    struct rusage usage;
+    getrusage( RUSAGE_SELF, &usage );
+    fprintf( out, "major_faults %ld\n", usage.ru_majflt );
+    fprintf( out, "minor_faults %ld\n", usage.ru_minflt );
+    fflush( out );
+}
+
+#endif
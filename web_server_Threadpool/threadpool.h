@@ -7,28 +7,49 @@
 #ifndef THREADPOOL_H
 #define THREADPOOL_H
 
-#include <list>
 #include <cstdio>
 #include <exception>
 #include <pthread.h>
+#include <time.h>
 #include "locker.h"
+#include "affinity.h"
+#include "stats.h"
 
 
-/*线程池类，将它定义为模板类是为了代码复用。模板参数T是任务类*/
+/**
+ * 线程池类，将它定义为模板类是为了代码复用。模板参数T是任务类
+ * T需要实现process() 以及shed() 后者在请求被拒绝时调用 用于回复503并关闭连接
+ */
 template< typename T >
 class threadpool
 {
 public:
-    /*thread_number 是线程数量　最多允许10000个*/
-    threadpool( int thread_number = 8, int max_requests = 10000 );
+    /*thread_number 是线程数量　最多允许10000个 cpus非空时第i个线程绑定到其中第i个CPU上*/
+    threadpool( int thread_number = 8, int max_requests = 10000, const cpu_set_t* cpus = NULL );
     ~threadpool();
-    /*往请求队列中添加任务*/
+    /*往请求队列中添加任务 队列已满时返回false 由调用者拒绝该请求*/
     bool append( T* request );
+    /**
+     * CoDel式的按等待时间丢弃
+     * 队首任务的等待时间持续interval毫秒都超过target毫秒 说明队列已经积压 之后出队的超时任务直接shed
+     * target为0时关闭
+     */
+    void set_codel( int target_ms, int interval_ms );
 
 private:
     /*工作线程运行的函数 它不断地从工作队列中取出任务并执行之*/
     static void* worker( void* arg );
     void run();
+    /*出队时判断是否丢弃 调用时持有m_queuelocker*/
+    bool should_shed( long long enqueue_us, long long now_us );
+    static long long now_us();
+
+    /*队列中的任务及其入队时间*/
+    struct item
+    {
+        T* request;
+        long long enqueue_us;
+    };
 
 private:
     /*池中线程数*/
@@ -37,19 +58,29 @@ private:
     int m_max_requests;
     /*描述线程池的数组其大小为m_thread_number*/
     pthread_t* m_threads;
-    /*请求队列*/
-    std::list< T* > m_workqueue;
+    /*请求队列 构造时一次分配好的环 入队出队都不再分配内存*/
+    item* m_workqueue;
+    int m_queue_head;
+    int m_queue_size;
     /*保护请求队列的互斥锁*/
     locker m_queuelocker;
     /*是否有任务需要处理*/
     sem m_queuestat;
     /*是否结束线程*/
     bool m_stop;
+    /*CoDel参数(微秒)*/
+    long long m_target_us;
+    long long m_interval_us;
+    /*等待时间开始持续超过target的截止时刻 0表示当前没有超过*/
+    long long m_first_above_us;
 };
 
 template< typename T >
-threadpool< T >::threadpool( int thread_number, int max_requests ) : 
-        m_thread_number( thread_number ), m_max_requests( max_requests ), m_stop( false ), m_threads( NULL )
+threadpool< T >::threadpool( int thread_number, int max_requests, const cpu_set_t* cpus ) : 
+        m_thread_number( thread_number ), m_max_requests( max_requests ), m_stop( false ), m_threads( NULL ),
+        m_workqueue( NULL ), m_queue_head( 0 ), m_queue_size( 0 ),
+        m_queuelocker( "pool_queue" ), m_queuestat( "pool_queue_stat" ),
+        m_target_us( 0 ), m_interval_us( 0 ), m_first_above_us( 0 )
 {
     if( ( thread_number <= 0 ) || ( max_requests <= 0 ) )
     {
@@ -61,6 +92,8 @@ threadpool< T >::threadpool( int thread_number, int max_requests ) :
     {
         throw std::exception();
     }
+    /*队列中最多有max_requests + 1个任务*/
+    m_workqueue = new item[ m_max_requests + 1 ];
     /*创建thread_num个线程　并将他们都设置为脱离线程 ?*/ 
     for ( int i = 0; i < thread_number; ++i )
     {
@@ -68,12 +101,18 @@ threadpool< T >::threadpool( int thread_number, int max_requests ) :
         if( pthread_create( m_threads + i, NULL, worker, this ) != 0 )
         {
             delete [] m_threads;
+            delete [] m_workqueue;
             throw std::exception();
         }
+        if( cpus && ! pin_thread( m_threads[i], nth_cpu( cpus, i ) ) )
+        {
+            printf( "pin the %dth thread failed\n", i );
+        }
         /*线程脱离 不用 pthread_join 手动回收*/
         if( pthread_detach( m_threads[i] ) )
         {
             delete [] m_threads;
+            delete [] m_workqueue;
             throw std::exception();
         }
     }
@@ -84,6 +123,7 @@ template< typename T >
 threadpool< T >::~threadpool()
 {
     delete [] m_threads;
+    delete [] m_workqueue;
     m_stop = true;
 }
 
@@ -94,13 +134,15 @@ bool threadpool< T >::append( T* request )
     m_queuelocker.lock();
 
     /*任务请求队列大于最大请求数　舍弃*/
-    if ( m_workqueue.size() > m_max_requests )
+    if ( m_queue_size > m_max_requests )
     {
         m_queuelocker.unlock();
         return false;
     }
     /*添加进队列之中*/
-    m_workqueue.push_back( request );
+    item it = { request, now_us() };
+    m_workqueue[ ( m_queue_head + m_queue_size ) % ( m_max_requests + 1 ) ] = it;
+    ++m_queue_size;
     m_queuelocker.unlock();
     
     m_queuestat.post();
@@ -108,6 +150,45 @@ bool threadpool< T >::append( T* request )
 }
 
 
+template< typename T >
+void threadpool< T >::set_codel( int target_ms, int interval_ms )
+{
+    m_queuelocker.lock();
+    m_target_us = ( long long )target_ms * 1000;
+    m_interval_us = ( long long )interval_ms * 1000;
+    m_first_above_us = 0;
+    m_queuelocker.unlock();
+}
+
+template< typename T >
+long long threadpool< T >::now_us()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( long long )ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+template< typename T >
+bool threadpool< T >::should_shed( long long enqueue_us, long long now )
+{
+    if( m_target_us <= 0 )
+    {
+        return false;
+    }
+    /*等待时间低于目标 或者队列已经排空 积压结束*/
+    if( now - enqueue_us < m_target_us || m_queue_size == 0 )
+    {
+        m_first_above_us = 0;
+        return false;
+    }
+    if( m_first_above_us == 0 )
+    {
+        m_first_above_us = now + m_interval_us;
+        return false;
+    }
+    return now >= m_first_above_us;
+}
+
 /*线程运行的函数*/
 template< typename T >
 void* threadpool< T >::worker( void* arg )
@@ -127,21 +208,31 @@ void threadpool< T >::run()
         m_queuestat.wait();
         m_queuelocker.lock();
         
-        if ( m_workqueue.empty() )
+        if ( m_queue_size == 0 )
         {
             m_queuelocker.unlock();
             continue;
         }
 
         /*取出第一个任务来处理*/
-        T* request = m_workqueue.front();
-        m_workqueue.pop_front();
+        item it = m_workqueue[ m_queue_head ];
+        m_queue_head = ( m_queue_head + 1 ) % ( m_max_requests + 1 );
+        --m_queue_size;
+        bool shed = should_shed( it.enqueue_us, now_us() );
         m_queuelocker.unlock();
+        T* request = it.request;
         if ( ! request )
         {
             /*可能为空*/
             continue;
         }
+        /*积压时丢弃等待过久的请求 保证被接受的请求延迟有上界*/
+        if( shed )
+        {
+            STAT_INC( shed_queue_age );
+            request->shed();
+            continue;
+        }
         /*执行任务*/
         request->process();
     }
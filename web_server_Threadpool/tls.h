@@ -0,0 +1,228 @@
+/**
+ * Created by 刘嘉辉 on 11/16/18.
+ * Copyright (c) 2018 刘嘉辉 All rights reserved.
+ * @brief To immplmente tls.h.
+ */
+
+#ifndef TLS_H
+#define TLS_H
+
+/**
+ * 监听socket上可选的TLS 需要以 -DWITH_TLS 编译并链接 -lssl -lcrypto
+ * 否则只有下面的空实现 http_conn中m_ssl恒为NULL 走明文路径
+ *
+ * 会话恢复: 服务端会话缓存 + 会话票据(OpenSSL自动轮换票据密钥) 恢复时省掉一次完整握手
+ * 内核TLS: 打开SSL_OP_ENABLE_KTLS 内核支持时握手后由内核加密
+ *          大文件可以SSL_sendfile零拷贝 cgi输出也可以继续splice
+ *          不支持时退化为SSL_write 文件与cgi输出都要在用户态加密一次
+ *
+ * ALPN: 客户支持时优先选h2 由http_conn切换到HTTP/2
+ *
+ * 本地测试用自签名证书:
+ *     openssl req -x509 -newkey rsa:2048 -nodes -keyout key.pem -out cert.pem -days 365 -subj /CN=localhost
+ *     ./server -S cert.pem -K key.pem 127.0.0.1 8443
+ *     curl -k https://127.0.0.1:8443/1
+ *     openssl s_client -connect 127.0.0.1:8443 -reconnect
+ */
+#if defined( WITH_TLS )
+
+#include <exception>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+class tls_context
+{
+public:
+    /*会话缓存的条目数*/
+    static const long SESSION_CACHE_SIZE = 20480;
+
+public:
+    tls_context( const char* cert_file, const char* key_file )
+    {
+        m_ctx = SSL_CTX_new( TLS_server_method() );
+        if( ! m_ctx )
+        {
+            throw std::exception();
+        }
+        SSL_CTX_set_min_proto_version( m_ctx, TLS1_2_VERSION );
+        /*部分写 重试时缓冲区地址可以变化 与writev式的发送配合*/
+        SSL_CTX_set_mode( m_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS );
+        SSL_CTX_set_options( m_ctx, SSL_OP_ENABLE_KTLS );
+        SSL_CTX_set_session_cache_mode( m_ctx, SSL_SESS_CACHE_SERVER );
+        SSL_CTX_sess_set_cache_size( m_ctx, SESSION_CACHE_SIZE );
+        static const unsigned char sid_ctx[] = "web_server";
+        SSL_CTX_set_session_id_context( m_ctx, sid_ctx, sizeof( sid_ctx ) - 1 );
+        SSL_CTX_set_alpn_select_cb( m_ctx, select_alpn, NULL );
+        if( SSL_CTX_use_certificate_chain_file( m_ctx, cert_file ) != 1
+            || SSL_CTX_use_PrivateKey_file( m_ctx, key_file, SSL_FILETYPE_PEM ) != 1
+            || SSL_CTX_check_private_key( m_ctx ) != 1 )
+        {
+            ERR_print_errors_fp( stdout );
+            SSL_CTX_free( m_ctx );
+            throw std::exception();
+        }
+    }
+
+    ~tls_context()
+    {
+        SSL_CTX_free( m_ctx );
+    }
+
+    /*为新接受的连接创建服务端会话 握手在第一次tls_read中进行*/
+    SSL* accept( int fd )
+    {
+        SSL* ssl = SSL_new( m_ctx );
+        if( ssl )
+        {
+            SSL_set_fd( ssl, fd );
+            SSL_set_accept_state( ssl );
+        }
+        return ssl;
+    }
+
+private:
+    /*按我们的顺序在客户提供的协议中选第一个 都不支持时不协商 仍按HTTP/1.1处理*/
+    static int select_alpn( SSL*, const unsigned char** out, unsigned char* outlen, const unsigned char* in, unsigned int inlen, void* )
+    {
+        static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+        if ( SSL_select_next_proto( ( unsigned char** )out, outlen, protocols, sizeof( protocols ) - 1, in, inlen ) != OPENSSL_NPN_NEGOTIATED )
+        {
+            return SSL_TLSEXT_ERR_NOACK;
+        }
+        return SSL_TLSEXT_ERR_OK;
+    }
+
+private:
+    SSL_CTX* m_ctx;
+};
+
+/*把SSL_get_error映射成与recv/send相同的约定 需要重试时errno为EAGAIN*/
+inline ssize_t tls_result( SSL* ssl, int ret )
+{
+    if( ret > 0 )
+    {
+        return ret;
+    }
+    switch( SSL_get_error( ssl, ret ) )
+    {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        default:
+            errno = ECONNRESET;
+            return -1;
+    }
+}
+
+/**
+ * 与recv相同的返回值 握手没有完成时由它推进
+ * 握手消息只有几KB 发送缓冲区总是放得下 所以不单独处理握手中的WANT_WRITE
+ */
+inline ssize_t tls_read( SSL* ssl, char* buf, size_t len )
+{
+    ERR_clear_error();
+    return tls_result( ssl, SSL_read( ssl, buf, len ) );
+}
+
+inline ssize_t tls_write( SSL* ssl, const char* buf, size_t len )
+{
+    ERR_clear_error();
+    return tls_result( ssl, SSL_write( ssl, buf, len ) );
+}
+
+/*只在tls_ktls_send为真时使用*/
+inline ssize_t tls_sendfile( SSL* ssl, int fd, off_t offset, size_t len )
+{
+    ERR_clear_error();
+    ossl_ssize_t ret = SSL_sendfile( ssl, fd, offset, len, 0 );
+    if( ret >= 0 )
+    {
+        return ret;
+    }
+    if( SSL_get_error( ssl, ret ) == SSL_ERROR_WANT_WRITE || errno == EAGAIN )
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    errno = ECONNRESET;
+    return -1;
+}
+
+/*握手已完成时返回true 并给出是否为恢复的会话*/
+inline bool tls_ready( SSL* ssl, bool* resumed )
+{
+    if( ! SSL_is_init_finished( ssl ) )
+    {
+        return false;
+    }
+    *resumed = SSL_session_reused( ssl );
+    return true;
+}
+
+/*发送方向是否已交给内核加密*/
+inline bool tls_ktls_send( SSL* ssl )
+{
+#if defined( OPENSSL_NO_KTLS )
+    return false;
+#else
+    return BIO_get_ktls_send( SSL_get_wbio( ssl ) );
+#endif
+}
+
+/*握手时ALPN是否选中了h2*/
+inline bool tls_alpn_h2( SSL* ssl )
+{
+    const unsigned char* protocol = NULL;
+    unsigned int len = 0;
+    SSL_get0_alpn_selected( ssl, &protocol, &len );
+    return len == 2 && memcmp( protocol, "h2", 2 ) == 0;
+}
+
+/*SSL内部已解密但还没有被读走的字节 socket上不会再有事件通知它们*/
+inline int tls_pending( SSL* ssl )
+{
+    return SSL_pending( ssl );
+}
+
+/*尽力发送close_notify 不等待对方回应*/
+inline void tls_close( SSL* ssl )
+{
+    if( SSL_is_init_finished( ssl ) )
+    {
+        ERR_clear_error();
+        SSL_shutdown( ssl );
+    }
+    SSL_free( ssl );
+}
+
+#else
+
+#include <sys/types.h>
+#include <errno.h>
+
+typedef struct ssl_st SSL;
+
+class tls_context
+{
+public:
+    SSL* accept( int ) { return NULL; }
+};
+
+inline ssize_t tls_read( SSL*, char*, size_t ) { errno = ENOTSUP; return -1; }
+inline ssize_t tls_write( SSL*, const char*, size_t ) { errno = ENOTSUP; return -1; }
+inline ssize_t tls_sendfile( SSL*, int, off_t, size_t ) { errno = ENOTSUP; return -1; }
+inline bool tls_ready( SSL*, bool* ) { return false; }
+inline bool tls_ktls_send( SSL* ) { return false; }
+inline bool tls_alpn_h2( SSL* ) { return false; }
+inline int tls_pending( SSL* ) { return 0; }
+inline void tls_close( SSL* ) {}
+
+#endif
+
+#endif
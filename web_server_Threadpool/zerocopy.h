@@ -0,0 +1,81 @@
+/**
+ * Created by 刘嘉辉 on 11/18/18.
+ * Copyright (c) 2018 刘嘉辉 All rights reserved.
+ * @brief To immplmente zerocopy.h.
+ */
+
+#ifndef ZEROCOPY_H
+#define ZEROCOPY_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+/**
+ * MSG_ZEROCOPY发送 内核不复制用户态的数据 而是引用它所在的页直到对方确认
+ * 所以在收到完成通知之前 数据所在的内存不能释放也不能改写
+ * 每次成功的零拷贝sendmsg在内核中按0 1 2...编号 完成通知以编号区间的形式放在socket的错误队列里
+ * 错误队列非空时epoll报告EPOLLERR 与真正的错误用SO_ERROR区分
+ * 出口设备不支持时内核仍然会复制 通知中带SO_EE_CODE_ZEROCOPY_COPIED 此时还不如直接复制
+ */
+
+/*Unix域socket与老内核上会失败 此时连接照常复制*/
+inline bool zerocopy_enable( int sockfd )
+{
+    int on = 1;
+    return setsockopt( sockfd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof( on ) ) == 0;
+}
+
+/**
+ * 取出错误队列中所有的完成通知 返回完成的发送次数
+ * 有通知表明内核退回了复制时copied置为true
+ */
+inline unsigned int zerocopy_reap( int sockfd, bool* copied )
+{
+    unsigned int done = 0;
+    char control[ 128 ];
+    while( true )
+    {
+        struct msghdr msg;
+        memset( &msg, 0, sizeof( msg ) );
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof( control );
+        if( recvmsg( sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT ) < 0 )
+        {
+            break;
+        }
+        for( struct cmsghdr* cmsg = CMSG_FIRSTHDR( &msg ); cmsg; cmsg = CMSG_NXTHDR( &msg, cmsg ) )
+        {
+            if( ! ( ( cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR )
+                    || ( cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR ) ) )
+            {
+                continue;
+            }
+            struct sock_extended_err err;
+            memcpy( &err, CMSG_DATA( cmsg ), sizeof( err ) );
+            if( err.ee_origin != SO_EE_ORIGIN_ZEROCOPY || err.ee_errno != 0 )
+            {
+                continue;
+            }
+            /*ee_info到ee_data是一段连续的编号*/
+            done += err.ee_data - err.ee_info + 1;
+            if( err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED )
+            {
+                *copied = true;
+            }
+        }
+    }
+    return done;
+}
+
+#endif